@@ -172,6 +172,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/base58.h \
     src/bignum.h \
     src/checkpoints.h \
+    src/checkqueue.h \
     src/compat.h \
         src/coincontrol.h \
     src/sync.h \
@@ -186,6 +187,9 @@ HEADERS += src/qt/bitcoingui.h \
     src/net.h \
     src/key.h \
     src/db.h \
+    src/logdb.h \
+    src/txcache.h \
+    src/blockfile.h \
     src/walletdb.h \
     src/script.h \
     src/init.h \
@@ -243,6 +247,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/sph_luffa.h \
     src/sph_shavite.h \
     src/sph_simd.h \
+    src/x13simd.h \
     src/sph_skein.h \
     src/sph_fugue.h \
     src/sph_hamsi.h \
@@ -353,6 +358,9 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/checkpoints.cpp \
     src/addrman.cpp \
     src/db.cpp \
+    src/logdb.cpp \
+    src/txcache.cpp \
+    src/blockfile.cpp \
     src/walletdb.cpp \
     src/qt/clientmodel.cpp \
     src/qt/guiutil.cpp \
@@ -410,6 +418,7 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/luffa.c \
     src/shavite.c \
     src/simd.c \
+    src/x13simd.c \
     src/skein.c \
     src/fugue.c \
     src/hamsi.c \
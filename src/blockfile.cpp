@@ -0,0 +1,152 @@
+// Copyright (c) 2014 The BlackToken developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfile.h"
+#include "main.h"
+#include "util.h"
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <limits>
+
+using namespace std;
+
+CBlockFileMap blockfilemap;
+
+CMappedFile::~CMappedFile()
+{
+    if (!pbegin)
+        return;
+#ifdef WIN32
+    UnmapViewOfFile(pbegin);
+    CloseHandle(hMapping);
+#else
+    munmap((void*)pbegin, nSize);
+#endif
+}
+
+boost::shared_ptr<CMappedFile> CMappedFile::Open(const boost::filesystem::path& path)
+{
+    boost::shared_ptr<CMappedFile> mapping;
+#ifdef WIN32
+    // Let the block writer keep appending while the file is mapped
+    HANDLE hFile = CreateFileA(path.string().c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                               NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return mapping;
+    LARGE_INTEGER nFileSize;
+    if (!GetFileSizeEx(hFile, &nFileSize) || nFileSize.QuadPart == 0 || (uint64)nFileSize.QuadPart > (uint64)std::numeric_limits<size_t>::max())
+    {
+        CloseHandle(hFile);
+        return mapping;
+    }
+    HANDLE hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(hFile);
+    if (hMapping == NULL)
+        return mapping;
+    const char* pbegin = (const char*)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+    if (pbegin == NULL)
+    {
+        CloseHandle(hMapping);
+        return mapping;
+    }
+    mapping.reset(new CMappedFile());
+    mapping->hMapping = hMapping;
+    mapping->pbegin = pbegin;
+    mapping->nSize = nFileSize.QuadPart;
+#else
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd == -1)
+        return mapping;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0 || (uint64)st.st_size > (uint64)std::numeric_limits<size_t>::max())
+    {
+        close(fd);
+        return mapping;
+    }
+    // Only the bytes present now are mapped; pages past the end of the file
+    // at the time of the call must never be touched
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return mapping;
+    mapping.reset(new CMappedFile());
+    mapping->pbegin = (const char*)p;
+    mapping->nSize = st.st_size;
+#endif
+    return mapping;
+}
+
+
+// A few files cover the whole chain; a 32-bit process keeps fewer of its
+// up to 2GB mappings around
+static const unsigned int DEFAULT_BLOCKFILE_MAPS = sizeof(void*) > 4 ? 8 : 2;
+
+CBlockFileMap::CBlockFileMap() : nMaxMaps(DEFAULT_BLOCKFILE_MAPS), nMapped(0)
+{
+}
+
+void CBlockFileMap::SetMaxMaps(unsigned int nMaxMapsIn)
+{
+    LOCK(cs_blockfilemap);
+    nMaxMaps = nMaxMapsIn;
+    while (listMaps.size() > nMaxMaps)
+        listMaps.pop_back();
+}
+
+boost::shared_ptr<CMappedFile> CBlockFileMap::Get(unsigned int nFile, size_t nEnd)
+{
+    boost::shared_ptr<CMappedFile> mapping;
+    if (nFile < 1 || nFile == (unsigned int)-1)
+        return mapping;
+
+    LOCK(cs_blockfilemap);
+    if (nMaxMaps == 0)
+        return mapping;
+    for (list<pair<unsigned int, boost::shared_ptr<CMappedFile> > >::iterator it = listMaps.begin(); it != listMaps.end(); ++it)
+    {
+        if (it->first != nFile)
+            continue;
+        if (it->second->size() >= nEnd)
+        {
+            mapping = it->second;
+            listMaps.splice(listMaps.begin(), listMaps, it);
+            return mapping;
+        }
+        // The read runs past this mapping; the file may have grown since
+        listMaps.erase(it);
+        break;
+    }
+
+    mapping = CMappedFile::Open(BlockFilePath(nFile));
+    if (!mapping)
+        return mapping;
+    nMapped++;
+    listMaps.push_front(make_pair(nFile, mapping));
+    while (listMaps.size() > nMaxMaps)
+        listMaps.pop_back();
+    if (mapping->size() < nEnd)
+        mapping.reset();
+    return mapping;
+}
+
+void CBlockFileMap::Clear()
+{
+    LOCK(cs_blockfilemap);
+    listMaps.clear();
+}
+
+void CBlockFileMap::GetStats(unsigned int& nMapsRet, uint64& nMappedRet) const
+{
+    LOCK(cs_blockfilemap);
+    nMapsRet = listMaps.size();
+    nMappedRet = nMapped;
+}
@@ -0,0 +1,102 @@
+// Copyright (c) 2014 The BlackToken developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKFILE_H
+#define BITCOIN_BLOCKFILE_H
+
+#include "serialize.h"
+#include "sync.h"
+#include "version.h"
+
+#include <list>
+
+#include <boost/filesystem/path.hpp>
+#include <boost/shared_ptr.hpp>
+
+/** Read-only memory mapping of a whole file, unmapped on destruction */
+class CMappedFile
+{
+private:
+    const char* pbegin;
+    size_t nSize;
+#ifdef WIN32
+    void* hMapping;
+#endif
+
+    CMappedFile() : pbegin(NULL), nSize(0) {}
+
+    // no copying, the destructor unmaps
+    CMappedFile(const CMappedFile&);
+    CMappedFile& operator=(const CMappedFile&);
+
+public:
+    ~CMappedFile();
+
+    /** Map the file as it is now; NULL if it is empty or cannot be mapped */
+    static boost::shared_ptr<CMappedFile> Open(const boost::filesystem::path& path);
+
+    const char* begin() const { return pbegin; }
+    const char* end() const { return pbegin + nSize; }
+    size_t size() const { return nSize; }
+};
+
+
+/** Mappings of the most recently read blk000N.dat files.
+ *
+ * Block files are only ever appended to, so a mapping stays valid and is
+ * replaced by a larger one when a read runs past its end.  Readers hold a
+ * reference to the mapping they use, which keeps it alive if it is evicted
+ * or replaced in the meantime.
+ */
+class CBlockFileMap
+{
+private:
+    mutable CCriticalSection cs_blockfilemap;
+    // nFile -> mapping, most recently used first
+    std::list<std::pair<unsigned int, boost::shared_ptr<CMappedFile> > > listMaps;
+    unsigned int nMaxMaps;
+    uint64 nMapped;
+
+public:
+    CBlockFileMap();
+
+    void SetMaxMaps(unsigned int nMaxMapsIn);
+
+    /** Mapping of block file nFile that extends at least to nEnd */
+    boost::shared_ptr<CMappedFile> Get(unsigned int nFile, size_t nEnd);
+
+    /** Deserialize obj from block file nFile at nPos.  Returns false when
+     *  the file cannot be mapped or the data does not deserialize; the
+     *  caller then falls back to reading through a FILE*. */
+    template<typename T>
+    bool Read(unsigned int nFile, unsigned int nPos, T& obj, int nType=SER_DISK)
+    {
+        size_t nEnd = (size_t)nPos + 1;
+        for (int nTry = 0; nTry < 2; nTry++)
+        {
+            boost::shared_ptr<CMappedFile> mapping = Get(nFile, nEnd);
+            if (!mapping)
+                return false;
+            CBufferReader reader(mapping->begin() + nPos, mapping->end(), nType, CLIENT_VERSION);
+            try {
+                reader >> obj;
+                return true;
+            }
+            catch (std::exception &e) {
+                // Ran past the end of the mapping: the file may have grown
+                // since it was mapped, so try once more with a fresh mapping
+                if (!reader.eof())
+                    return false;
+                nEnd = mapping->size() + 1;
+            }
+        }
+        return false;
+    }
+
+    void Clear();
+    void GetStats(unsigned int& nMapsRet, uint64& nMappedRet) const;
+};
+
+extern CBlockFileMap blockfilemap;
+
+#endif
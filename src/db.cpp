@@ -9,6 +9,8 @@
 #include "util.h"
 #include "main.h"
 #include "kernel.h"
+#include "ui_interface.h"
+#include "txcache.h"
 #include <boost/version.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
@@ -215,7 +217,7 @@ void CDBEnv::CheckpointLSN(std::string strFile)
 
 
 CDB::CDB(const char *pszFile, const char* pszMode) :
-    pdb(NULL), activeTxn(NULL)
+    pdb(NULL), activeTxn(NULL), fReadOnly(true), plogdb(NULL), fLogTxn(false), pcache(NULL)
 {
     int ret;
     if (pszFile == NULL)
@@ -287,6 +289,15 @@ static bool IsChainFile(std::string strFile)
 
 void CDB::Close()
 {
+    if (plogdb)
+    {
+        // Like an aborted BDB transaction, an uncommitted batch is dropped
+        logbatch.Clear();
+        fLogTxn = false;
+        plogdb = NULL;
+        pcache = NULL;
+        return;
+    }
     if (!pdb)
         return;
     if (activeTxn)
@@ -480,10 +491,415 @@ void CDBEnv::Flush(bool fShutdown)
 
 
 
+bool CDB::LogCommit(const CLogDB::CBatch& batch)
+{
+    if (pcache)
+    {
+        pcache->Write(batch);
+        return true;
+    }
+    return plogdb->WriteBatch(batch);
+}
+
+bool CDB::LogRead(const CDataStream& ssKey, std::string& strValue)
+{
+    string strKey(ssKey.begin(), ssKey.end());
+    if (fLogTxn)
+    {
+        map<string, pair<bool, string> >::const_iterator mi = logbatch.mapWrites.find(strKey);
+        if (mi != logbatch.mapWrites.end())
+        {
+            if (mi->second.first)
+                return false;
+            strValue = mi->second.second;
+            return true;
+        }
+    }
+    if (pcache)
+    {
+        // Held across the engine read so a concurrent flush cannot leave
+        // the value read here stale in the cache
+        LOCK(pcache->cs_txcache);
+        bool fFound;
+        if (pcache->Get(strKey, strValue, fFound))
+            return fFound;
+        if (!plogdb->Read(strKey, strValue))
+            return false;
+        pcache->AddClean(strKey, strValue);
+        return true;
+    }
+    return plogdb->Read(strKey, strValue);
+}
+
+bool CDB::LogWrite(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite)
+{
+    if (!fOverwrite && LogExists(ssKey))
+        return false;
+    string strKey(ssKey.begin(), ssKey.end());
+    string strValue(ssValue.begin(), ssValue.end());
+    if (fLogTxn)
+    {
+        logbatch.Write(strKey, strValue);
+        return true;
+    }
+    CLogDB::CBatch batch;
+    batch.Write(strKey, strValue);
+    return LogCommit(batch);
+}
+
+bool CDB::LogErase(const CDataStream& ssKey)
+{
+    string strKey(ssKey.begin(), ssKey.end());
+    if (fLogTxn)
+    {
+        logbatch.Erase(strKey);
+        return true;
+    }
+    if (!LogExists(ssKey))
+        return true;
+    CLogDB::CBatch batch;
+    batch.Erase(strKey);
+    return LogCommit(batch);
+}
+
+bool CDB::LogExists(const CDataStream& ssKey)
+{
+    string strKey(ssKey.begin(), ssKey.end());
+    if (fLogTxn)
+    {
+        map<string, pair<bool, string> >::const_iterator mi = logbatch.mapWrites.find(strKey);
+        if (mi != logbatch.mapWrites.end())
+            return !mi->second.first;
+    }
+    if (pcache)
+    {
+        string strValue;
+        bool fFound;
+        if (pcache->Get(strKey, strValue, fFound))
+            return fFound;
+    }
+    return plogdb->Exists(strKey);
+}
+
+int CDB::ReadAtLogCursor(std::string& strPos, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags)
+{
+    string strKey, strValue;
+    if (fFlags == DB_SET_RANGE)
+        strPos = string(ssKey.begin(), ssKey.end());
+    else if (fFlags != DB_NEXT)
+        return EINVAL;
+    if (!plogdb->Seek(strPos, fFlags == DB_SET_RANGE, strKey, strValue))
+        return DB_NOTFOUND;
+    strPos = strKey;
+
+    ssKey.SetType(SER_DISK);
+    ssKey.clear();
+    ssKey.write(strKey.data(), strKey.size());
+    ssValue.SetType(SER_DISK);
+    ssValue.clear();
+    ssValue.write(strValue.data(), strValue.size());
+    return 0;
+}
+
+
+
+
 //
 // CTxDB
 //
 
+// Storage engine behind CTxDB, see OpenTxDB()
+static CLogDB logdbTx;
+static bool fTxDBLog = false;
+static bool fTxDBCache = false;
+
+CTxDB::CTxDB(const char* pszMode) : CDB(fTxDBLog ? NULL : "blkindex.dat", pszMode)
+{
+    if (!fTxDBLog)
+        return;
+    plogdb = &logdbTx;
+    if (fTxDBCache)
+        pcache = &txcache;
+    fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
+    if (strchr(pszMode, 'c') && !Exists(string("version")))
+    {
+        bool fTmp = fReadOnly;
+        fReadOnly = false;
+        WriteVersion(CLIENT_VERSION);
+        fReadOnly = fTmp;
+    }
+}
+
+bool CTxDB::MigrateToLog(CLogDB& logdb)
+{
+    Dbc* pcursor = GetCursor();
+    if (!pcursor)
+        return false;
+
+    unsigned int nRecords = 0;
+    CLogDB::CBatch batch;
+    loop
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        int ret = ReadAtCursor(pcursor, ssKey, ssValue, DB_NEXT);
+        if (ret == DB_NOTFOUND)
+            break;
+        else if (ret != 0)
+        {
+            pcursor->close();
+            return false;
+        }
+        batch.Write(string(ssKey.begin(), ssKey.end()), string(ssValue.begin(), ssValue.end()));
+        if (batch.mapWrites.size() >= 10000)
+        {
+            if (!logdb.WriteBatch(batch))
+            {
+                pcursor->close();
+                return false;
+            }
+            batch.Clear();
+        }
+        nRecords++;
+    }
+    pcursor->close();
+    if (!logdb.WriteBatch(batch))
+        return false;
+    printf("CTxDB::MigrateToLog() : copied %u records\n", nRecords);
+    return true;
+}
+
+// Rewrite the transaction index records still in the original format, see
+// CTxIndex.  Works through the index in chunks so no cursor is open while
+// the chunk is written back.
+bool CTxDB::CompactTxIndex()
+{
+    int64 nStart = GetTimeMillis();
+    unsigned int nRecords = 0, nConverted = 0;
+    int64 nBytesBefore = 0, nBytesAfter = 0;
+    uint256 hashResume = 0;
+    bool fResume = false;
+    bool fDone = false;
+    while (!fDone && !fRequestShutdown)
+    {
+        // Collect a chunk of records still in the original format
+        vector<pair<uint256, CTxIndex> > vChunk;
+        Dbc* pcursor = NULL;
+        string strLogPos;
+        if (!plogdb && !(pcursor = GetCursor()))
+            return false;
+        unsigned int fFlags = DB_SET_RANGE;
+        unsigned int nScanned = 0;
+        loop
+        {
+            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            if (fFlags == DB_SET_RANGE)
+                ssKey << make_pair(string("tx"), hashResume);
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            int ret = plogdb ? ReadAtLogCursor(strLogPos, ssKey, ssValue, fFlags) : ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
+            fFlags = DB_NEXT;
+            if (ret == DB_NOTFOUND)
+            {
+                fDone = true;
+                break;
+            }
+            else if (ret != 0)
+            {
+                if (pcursor)
+                    pcursor->close();
+                return false;
+            }
+
+            string strType;
+            uint256 hash;
+            try {
+                ssKey >> strType;
+                if (strType != "tx")
+                {
+                    fDone = true;
+                    break;
+                }
+                ssKey >> hash;
+                if (fResume && hash == hashResume)
+                    continue;
+                nRecords++;
+                if (CTxIndex::IsLegacyFormat(ssValue))
+                {
+                    nBytesBefore += ssValue.size();
+                    CTxIndex txindex;
+                    ssValue >> txindex;
+                    vChunk.push_back(make_pair(hash, txindex));
+                }
+            }
+            catch (std::exception &e) {
+                if (pcursor)
+                    pcursor->close();
+                return error("CTxDB::CompactTxIndex() : deserialize error");
+            }
+            // The next chunk starts after this record
+            hashResume = hash;
+            fResume = true;
+            if (++nScanned >= 50000 || vChunk.size() >= 10000)
+                break;
+        }
+        if (pcursor)
+            pcursor->close();
+
+        if (vChunk.empty())
+            continue;
+        if (!TxnBegin())
+            return error("CTxDB::CompactTxIndex() : TxnBegin failed");
+        for (unsigned int i = 0; i < vChunk.size(); i++)
+        {
+            if (!UpdateTxIndex(vChunk[i].first, vChunk[i].second))
+            {
+                TxnAbort();
+                return error("CTxDB::CompactTxIndex() : UpdateTxIndex failed");
+            }
+            nBytesAfter += ::GetSerializeSize(vChunk[i].second, SER_DISK, CLIENT_VERSION);
+        }
+        if (!TxnCommit() || !FlushTxDBCache(false))
+            return error("CTxDB::CompactTxIndex() : TxnCommit failed");
+        nConverted += vChunk.size();
+    }
+    if (fRequestShutdown)
+        return false;
+
+    int64 nElapsed = max(GetTimeMillis() - nStart, (int64)1);
+    printf("CTxDB::CompactTxIndex() : converted %u of %u records, %"PRI64d" -> %"PRI64d" bytes, %"PRI64d"ms (%"PRI64d" records/s)\n",
+           nConverted, nRecords, nBytesBefore, nBytesAfter, nElapsed, (int64)nConverted * 1000 / nElapsed);
+    return true;
+}
+
+// Convert the transaction index to the compact record format once, when
+// asked to.  Older clients check no version before reading the index and
+// cannot read compact records, so until then records keep the old format.
+static bool UpgradeTxIndex()
+{
+    CTxDB txdb("cr+");
+    int nFormat = 0;
+    if (txdb.ReadTxIndexFormat(nFormat) && nFormat >= CTxDB::TXINDEX_COMPACT)
+    {
+        fTxIndexCompact = true;
+        return true;
+    }
+    if (!GetBoolArg("-compacttxindex"))
+        return true;
+
+    fTxIndexCompact = true;
+    uiInterface.InitMessage(_("Compacting transaction index..."));
+    printf("Compacting transaction index...\n");
+    if (!txdb.CompactTxIndex())
+        return false;
+    if (!txdb.WriteTxIndexFormat(CTxDB::TXINDEX_COMPACT) || !FlushTxDBCache(true))
+        return false;
+    if (fTxDBLog)
+    {
+        int64 nSizeBefore = logdbTx.GetFileSize();
+        if (!logdbTx.Compact())
+            return false;
+        printf("blkindex.log: %"PRI64d" -> %"PRI64d" bytes\n", nSizeBefore, logdbTx.GetFileSize());
+    }
+    return true;
+}
+
+bool OpenTxDB()
+{
+    string strEngine = GetArg("-txdb", "bdb");
+    if (strEngine == "bdb")
+    {
+        // After a migration blkindex.dat is left behind as it was, and
+        // everything since then is only in the log
+        if (filesystem::exists(GetDataDir() / "blkindex.log"))
+            return error("OpenTxDB() : blkindex.dat is older than blkindex.log, use -txdb=log");
+        printf("Using Berkeley DB transaction database\n");
+        return UpgradeTxIndex();
+    }
+    if (strEngine != "log")
+        return error("OpenTxDB() : unknown -txdb engine '%s'", strEngine.c_str());
+
+    filesystem::path pathLog = GetDataDir() / "blkindex.log";
+    if (!filesystem::exists(pathLog) && filesystem::exists(GetDataDir() / "blkindex.dat"))
+    {
+        // One-shot migration, into a temporary file so an interrupted
+        // migration is simply started over
+        int64 nStart = GetTimeMillis();
+        uiInterface.InitMessage(_("Migrating block index..."));
+        printf("Migrating blkindex.dat to blkindex.log...\n");
+        filesystem::path pathTmp = GetDataDir() / "blkindex.log.migrate";
+        filesystem::remove(pathTmp);
+        CLogDB logdbNew;
+        if (!logdbNew.Open(pathTmp))
+            return false;
+        {
+            CTxDB txdb("r");
+            if (!txdb.MigrateToLog(logdbNew))
+                return error("OpenTxDB() : migration of blkindex.dat failed");
+        }
+        bitdb.CloseDb("blkindex.dat");
+        logdbNew.Close();
+        if (!RenameOver(pathTmp, pathLog))
+            return error("OpenTxDB() : cannot rename %s", pathTmp.string().c_str());
+        printf("Migrated block index in %"PRI64d"ms; blkindex.dat is no longer used\n", GetTimeMillis() - nStart);
+    }
+
+    if (!logdbTx.Open(bitdb.IsMock() ? filesystem::path() : pathLog))
+        return false;
+    fTxDBLog = true;
+    printf("Using log-structured transaction database, %u records\n", logdbTx.GetCount());
+
+    int64 nCacheSize = GetArg("-dbcache", 25) << 20;
+    if (nCacheSize > 0)
+    {
+        txcache.SetMaxSize(nCacheSize);
+        fTxDBCache = true;
+        printf("Using %"PRI64d"MB transaction database cache\n", nCacheSize >> 20);
+    }
+    return UpgradeTxIndex();
+}
+
+bool FlushTxDBCache(bool fForce)
+{
+    if (!fTxDBCache)
+        return true;
+
+    // No new records can be committed to the cache while it is written out
+    LOCK(txcache.cs_txcache);
+    if (!fForce && !txcache.NeedsFlush())
+        return true;
+    int64 nStart = GetTimeMillis();
+    CLogDB::CBatch batch;
+    txcache.GetDirty(batch);
+    if (batch.IsEmpty())
+        return true;
+    if (!logdbTx.WriteBatch(batch))
+        return error("FlushTxDBCache() : writing %"PRIszu" records failed", batch.mapWrites.size());
+    txcache.SetFlushed(batch);
+    if (fDebug)
+    {
+        int64 nSize, nDirty;
+        uint64 nHits, nMisses;
+        txcache.GetStats(nSize, nDirty, nHits, nMisses);
+        printf("FlushTxDBCache() : wrote %"PRIszu" records in %"PRI64d"ms, cache %"PRI64d"kB, outputs hits %"PRI64u" misses %"PRI64u"\n",
+               batch.mapWrites.size(), GetTimeMillis() - nStart, nSize >> 10, nHits, nMisses);
+    }
+    return true;
+}
+
+void FlushTxDB()
+{
+    FlushTxDBCache(true);
+    logdbTx.Flush();
+}
+
+void CloseTxDB()
+{
+    FlushTxDBCache(true);
+    fTxDBCache = false;
+    txcache.Clear();
+    logdbTx.Close();
+}
+
 bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
 {
     assert(!fClient);
@@ -552,6 +968,16 @@ bool CTxDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
     return Write(make_pair(string("blockindex"), blockindex.GetBlockHash()), blockindex);
 }
 
+bool CTxDB::ReadTxIndexFormat(int& nFormat)
+{
+    return Read(string("txindexformat"), nFormat);
+}
+
+bool CTxDB::WriteTxIndexFormat(int nFormat)
+{
+    return Write(string("txindexformat"), nFormat);
+}
+
 bool CTxDB::ReadHashBestChain(uint256& hashBestChain)
 {
     return Read(string("hashBestChain"), hashBestChain);
@@ -562,14 +988,20 @@ bool CTxDB::WriteHashBestChain(uint256 hashBestChain)
     return Write(string("hashBestChain"), hashBestChain);
 }
 
-bool CTxDB::ReadBestInvalidTrust(CBigNum& bnBestInvalidTrust)
+// Trust is kept in memory as a uint256 but stored as a CBigNum, as it
+// always has been
+bool CTxDB::ReadBestInvalidTrust(uint256& nBestInvalidTrust)
 {
-    return Read(string("bnBestInvalidTrust"), bnBestInvalidTrust);
+    CBigNum bnBestInvalidTrust;
+    if (!Read(string("bnBestInvalidTrust"), bnBestInvalidTrust))
+        return false;
+    nBestInvalidTrust = bnBestInvalidTrust.getuint256();
+    return true;
 }
 
-bool CTxDB::WriteBestInvalidTrust(CBigNum bnBestInvalidTrust)
+bool CTxDB::WriteBestInvalidTrust(const uint256& nBestInvalidTrust)
 {
-    return Write(string("bnBestInvalidTrust"), bnBestInvalidTrust);
+    return Write(string("bnBestInvalidTrust"), CBigNum(nBestInvalidTrust));
 }
 
 bool CTxDB::ReadSyncCheckpoint(uint256& hashCheckpoint)
@@ -620,7 +1052,7 @@ bool CTxDB::LoadBlockIndex()
     if (fRequestShutdown)
         return true;
 
-    // Calculate bnChainTrust
+    // Calculate nChainTrust
     vector<pair<int, CBlockIndex*> > vSortedByHeight;
     vSortedByHeight.reserve(mapBlockIndex.size());
     BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
@@ -629,13 +1061,18 @@ bool CTxDB::LoadBlockIndex()
         vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
     }
     sort(vSortedByHeight.begin(), vSortedByHeight.end());
+    // Blocks at or below the last hardened checkpoint were checked against
+    // the stake modifier checkpoints when they were accepted, so those are
+    // not re-verified on every start. The checksums are still computed: each
+    // one chains its parent's.
+    int nCheckpointHeight = Checkpoints::GetTotalBlocksEstimate();
     BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
     {
         CBlockIndex* pindex = item.second;
-        pindex->bnChainTrust = (pindex->pprev ? pindex->pprev->bnChainTrust : 0) + pindex->GetBlockTrust();
+        pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : uint256(0)) + pindex->GetBlockTrust();
         // ppcoin: calculate stake modifier checksum
         pindex->nStakeModifierChecksum = GetStakeModifierChecksum(pindex);
-        if (!CheckStakeModifierCheckpoints(pindex->nHeight, pindex->nStakeModifierChecksum))
+        if (pindex->nHeight > nCheckpointHeight && !CheckStakeModifierCheckpoints(pindex->nHeight, pindex->nStakeModifierChecksum))
             return error("CTxDB::LoadBlockIndex() : Failed stake modifier checkpoint height=%d, modifier=0x%016"PRI64x, pindex->nHeight, pindex->nStakeModifier);
     }
 
@@ -650,9 +1087,13 @@ bool CTxDB::LoadBlockIndex()
         return error("CTxDB::LoadBlockIndex() : hashBestChain not found in the block index");
     pindexBest = mapBlockIndex[hashBestChain];
     nBestHeight = pindexBest->nHeight;
-    bnBestChainTrust = pindexBest->bnChainTrust;
+    chainActive.SetTip(pindexBest);
+    stakeModifierIndex.Clear();
+    for (CBlockIndex* pindex = pindexGenesisBlock; pindex; pindex = pindex->pnext)
+        stakeModifierIndex.Connect(pindex);
+    nBestChainTrust = pindexBest->nChainTrust;
     printf("LoadBlockIndex(): hashBestChain=%s  height=%d  trust=%s  date=%s\n",
-      hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, bnBestChainTrust.ToString().c_str(),
+      hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, nBestChainTrust.ToString().c_str(),
       DateTimeStrFormat("%x %H:%M:%S", pindexBest->GetBlockTime()).c_str());
 
     // ppcoin: load hashSyncCheckpoint
@@ -660,22 +1101,42 @@ bool CTxDB::LoadBlockIndex()
         return error("CTxDB::LoadBlockIndex() : hashSyncCheckpoint not loaded");
     printf("LoadBlockIndex(): synchronized checkpoint %s\n", Checkpoints::hashSyncCheckpoint.ToString().c_str());
 
-    // Load bnBestInvalidTrust, OK if it doesn't exist
-    ReadBestInvalidTrust(bnBestInvalidTrust);
+    // Load nBestInvalidTrust, OK if it doesn't exist
+    ReadBestInvalidTrust(nBestInvalidTrust);
 
-    // Verify blocks in the best chain
+    // Verify blocks in the best chain. The transaction index checks of
+    // -checklevel 2 and up need an index nothing is writing to, so they run
+    // here; plain block checks run in ThreadVerifyBlocks once the node is up.
     int nCheckLevel = GetArg("-checklevel", 1);
-    int nCheckDepth = GetArg( "-checkblocks", 2500);
+    if (nCheckLevel > 1)
+        return VerifyBlocks(nCheckLevel, GetArg("-checkblocks", 2500));
+
+    return true;
+}
+
+bool CTxDB::VerifyBlocks(int nCheckLevel, int nCheckDepth)
+{
+    CBlockIndex* pindexTip;
+    {
+        LOCK(cs_main);
+        pindexTip = pindexBest;
+    }
+    if (pindexTip == NULL)
+        return true;
+
+    // Block index entries are never freed and their pprev never changes, so
+    // the chain below pindexTip can be walked without cs_main
+    int nTipHeight = pindexTip->nHeight;
     if (nCheckDepth == 0)
         nCheckDepth = 1000000000; // suffices until the year 19000
-    if (nCheckDepth > nBestHeight)
-        nCheckDepth = nBestHeight;
+    if (nCheckDepth > nTipHeight)
+        nCheckDepth = nTipHeight;
     printf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
     CBlockIndex* pindexFork = NULL;
     map<pair<unsigned int, unsigned int>, CBlockIndex*> mapBlockPos;
-    for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev; pindex = pindex->pprev)
+    for (CBlockIndex* pindex = pindexTip; pindex && pindex->pprev; pindex = pindex->pprev)
     {
-        if (fRequestShutdown || pindex->nHeight < nBestHeight-nCheckDepth)
+        if (fShutdown || fRequestShutdown || pindex->nHeight < nTipHeight-nCheckDepth)
             break;
         CBlock block;
         if (!block.ReadFromDisk(pindex))
@@ -777,8 +1238,14 @@ bool CTxDB::LoadBlockIndex()
             }
         }
     }
-    if (pindexFork && !fRequestShutdown)
+    if (pindexFork && !fShutdown && !fRequestShutdown)
     {
+        LOCK(cs_main);
+        // The best chain may have moved on while verifying; only reorg if
+        // the fork is still part of it
+        if (pindexFork != pindexBest && pindexFork->pnext == NULL)
+            return true;
+
         // Reorg back to the fork
         printf("LoadBlockIndex() : *** moving best chain pointer back to block %d\n", pindexFork->nHeight);
         CBlock block;
@@ -793,13 +1260,143 @@ bool CTxDB::LoadBlockIndex()
 
 
 
+// Records read off the cursor are decoded and hashed this many at a time
+static const unsigned int BLOCKINDEX_DECODE_CHUNK = 16384;
+
+// Decodes the raw block index records [nBegin, nEnd) of a chunk and hashes
+// their headers with Hash9xN. Each job only touches its own slots, so
+// several of them run at once.
+class CBlockIndexDecodeJob
+{
+public:
+    std::vector<CDataStream>* pvRecord;
+    std::vector<CDiskBlockIndex>* pvIndex;
+    std::vector<uint256>* pvHash;
+    size_t nBegin;
+    size_t nEnd;
+    bool fOk;
+
+    void operator()()
+    {
+        fOk = true;
+        try {
+            for (size_t i = nBegin; i < nEnd; i++)
+                (*pvRecord)[i] >> (*pvIndex)[i];
+        }
+        catch (std::exception &e) {
+            fOk = false;
+            return;
+        }
+
+        CBlock vHeader[HASH9_MAX_LANES];
+        const unsigned char* ppData[HASH9_MAX_LANES];
+        for (size_t i = nBegin; i < nEnd; i += HASH9_MAX_LANES)
+        {
+            unsigned int nLanes = std::min((size_t)HASH9_MAX_LANES, nEnd - i);
+            for (unsigned int j = 0; j < nLanes; j++)
+            {
+                const CDiskBlockIndex& diskindex = (*pvIndex)[i + j];
+                vHeader[j].nVersion       = diskindex.nVersion;
+                vHeader[j].hashPrevBlock  = diskindex.hashPrev;
+                vHeader[j].hashMerkleRoot = diskindex.hashMerkleRoot;
+                vHeader[j].nTime          = diskindex.nTime;
+                vHeader[j].nBits          = diskindex.nBits;
+                vHeader[j].nNonce         = diskindex.nNonce;
+                ppData[j] = (const unsigned char*)BEGIN(vHeader[j].nVersion);
+            }
+            Hash9xN(ppData, CBlock::HEADER_SIZE, nLanes, &(*pvHash)[i]);
+        }
+    }
+};
+
+// Decode and hash a chunk of raw block index records on up to -par threads,
+// then link them into mapBlockIndex, which only this thread touches
+static bool LoadBlockIndexChunk(std::vector<CDataStream>& vRecord)
+{
+    size_t nRecords = vRecord.size();
+    std::vector<CDiskBlockIndex> vIndex(nRecords);
+    std::vector<uint256> vHash(nRecords);
+
+    unsigned int nJobs = std::max(1, nScriptCheckThreads);
+    size_t nPerJob = (nRecords + nJobs - 1) / nJobs;
+    nPerJob = (nPerJob + HASH9_MAX_LANES - 1) / HASH9_MAX_LANES * HASH9_MAX_LANES;
+    std::vector<CBlockIndexDecodeJob> vJob;
+    for (size_t nBegin = 0; nBegin < nRecords; nBegin += nPerJob)
+    {
+        CBlockIndexDecodeJob job;
+        job.pvRecord = &vRecord;
+        job.pvIndex = &vIndex;
+        job.pvHash = &vHash;
+        job.nBegin = nBegin;
+        job.nEnd = std::min(nBegin + nPerJob, nRecords);
+        job.fOk = false;
+        vJob.push_back(job);
+    }
+
+    // The last job runs on this thread
+    boost::thread_group threadGroup;
+    for (size_t i = 0; i + 1 < vJob.size(); i++)
+        threadGroup.create_thread(boost::ref(vJob[i]));
+    if (!vJob.empty())
+        vJob.back()();
+    threadGroup.join_all();
+
+    BOOST_FOREACH(const CBlockIndexDecodeJob& job, vJob)
+        if (!job.fOk)
+            return error("LoadBlockIndex() : deserialize error");
+
+    for (size_t i = 0; i < nRecords; i++)
+    {
+        const CDiskBlockIndex& diskindex = vIndex[i];
+
+        // Construct block index object
+        CBlockIndex* pindexNew = InsertBlockIndex(vHash[i]);
+        pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+        pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
+        pindexNew->nFile          = diskindex.nFile;
+        pindexNew->nBlockPos      = diskindex.nBlockPos;
+        pindexNew->nHeight        = diskindex.nHeight;
+        pindexNew->nMint          = diskindex.nMint;
+        pindexNew->nMoneySupply   = diskindex.nMoneySupply;
+        pindexNew->nFlags         = diskindex.nFlags;
+        pindexNew->nStakeModifier = diskindex.nStakeModifier;
+        pindexNew->prevoutStake   = diskindex.prevoutStake;
+        pindexNew->nStakeTime     = diskindex.nStakeTime;
+        pindexNew->hashProofOfStake = diskindex.hashProofOfStake;
+        pindexNew->nVersion       = diskindex.nVersion;
+        pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+        pindexNew->nTime          = diskindex.nTime;
+        pindexNew->nBits          = diskindex.nBits;
+        pindexNew->nNonce         = diskindex.nNonce;
+
+        // Watch for genesis block
+        if (pindexGenesisBlock == NULL && vHash[i] == (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet))
+            pindexGenesisBlock = pindexNew;
+
+        if (!pindexNew->CheckIndex())
+            return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
+
+        // ppcoin: build setStakeSeen
+        if (pindexNew->IsProofOfStake())
+            setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+    }
+    vRecord.clear();
+    return true;
+}
+
 bool CTxDB::LoadBlockIndexGuts()
 {
     // Get database cursor
-    Dbc* pcursor = GetCursor();
-    if (!pcursor)
+    Dbc* pcursor = NULL;
+    string strLogPos;
+    if (!plogdb && !(pcursor = GetCursor()))
         return false;
 
+    // The cursor is walked on this thread; the records it returns are
+    // decoded BLOCKINDEX_DECODE_CHUNK at a time by LoadBlockIndexChunk
+    std::vector<CDataStream> vRecord;
+    vRecord.reserve(BLOCKINDEX_DECODE_CHUNK);
+
     // Load mapBlockIndex
     unsigned int fFlags = DB_SET_RANGE;
     loop
@@ -809,7 +1406,7 @@ bool CTxDB::LoadBlockIndexGuts()
         if (fFlags == DB_SET_RANGE)
             ssKey << make_pair(string("blockindex"), uint256(0));
         CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
+        int ret = plogdb ? ReadAtLogCursor(strLogPos, ssKey, ssValue, fFlags) : ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
         fFlags = DB_NEXT;
         if (ret == DB_NOTFOUND)
             break;
@@ -823,39 +1420,9 @@ bool CTxDB::LoadBlockIndexGuts()
         ssKey >> strType;
         if (strType == "blockindex" && !fRequestShutdown)
         {
-            CDiskBlockIndex diskindex;
-            ssValue >> diskindex;
-
-            // Construct block index object
-            CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
-            pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-            pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
-            pindexNew->nFile          = diskindex.nFile;
-            pindexNew->nBlockPos      = diskindex.nBlockPos;
-            pindexNew->nHeight        = diskindex.nHeight;
-            pindexNew->nMint          = diskindex.nMint;
-            pindexNew->nMoneySupply   = diskindex.nMoneySupply;
-            pindexNew->nFlags         = diskindex.nFlags;
-            pindexNew->nStakeModifier = diskindex.nStakeModifier;
-            pindexNew->prevoutStake   = diskindex.prevoutStake;
-            pindexNew->nStakeTime     = diskindex.nStakeTime;
-            pindexNew->hashProofOfStake = diskindex.hashProofOfStake;
-            pindexNew->nVersion       = diskindex.nVersion;
-            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-            pindexNew->nTime          = diskindex.nTime;
-            pindexNew->nBits          = diskindex.nBits;
-            pindexNew->nNonce         = diskindex.nNonce;
-
-            // Watch for genesis block
-            if (pindexGenesisBlock == NULL && diskindex.GetBlockHash() == (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet))
-                pindexGenesisBlock = pindexNew;
-
-            if (!pindexNew->CheckIndex())
-                return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
-
-            // ppcoin: build setStakeSeen
-            if (pindexNew->IsProofOfStake())
-                setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+            vRecord.push_back(ssValue);
+            if (vRecord.size() == BLOCKINDEX_DECODE_CHUNK && !LoadBlockIndexChunk(vRecord))
+                return false;
         }
         else
         {
@@ -866,7 +1433,11 @@ bool CTxDB::LoadBlockIndexGuts()
             return error("%s() : deserialize error", __PRETTY_FUNCTION__);
         }
     }
-    pcursor->close();
+    if (pcursor)
+        pcursor->close();
+
+    if (!vRecord.empty() && !LoadBlockIndexChunk(vRecord))
+        return false;
 
     return true;
 }
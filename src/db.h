@@ -6,6 +6,7 @@
 #define BITCOIN_DB_H
 
 #include "main.h"
+#include "logdb.h"
 
 #include <map>
 #include <string>
@@ -20,6 +21,7 @@ class CDiskBlockIndex;
 class CDiskTxPos;
 class CMasterKey;
 class COutPoint;
+class CTxCache;
 class CTxIndex;
 class CWallet;
 class CWalletTx;
@@ -29,6 +31,15 @@ extern unsigned int nWalletDBUpdated;
 void ThreadFlushWalletDB(void* parg);
 bool BackupWallet(const CWallet& wallet, const std::string& strDest);
 
+/** Open the CTxDB storage engine selected by -txdb.  The first start with
+ *  the log engine migrates an existing blkindex.dat into blkindex.log. */
+bool OpenTxDB();
+/** Write the CTxDB records held in the CTxCache to the storage engine.
+ *  Called at block boundaries; unless fForce, only when the cache is full. */
+bool FlushTxDBCache(bool fForce);
+void FlushTxDB();
+void CloseTxDB();
+
 
 class CDBEnv
 {
@@ -93,7 +104,9 @@ public:
 extern CDBEnv bitdb;
 
 
-/** RAII class that provides access to a Berkeley database */
+/** RAII class that provides access to a Berkeley database, or to a CLogDB
+ *  when plogdb is set.  With pcache also set, committed log writes go to the
+ *  write-back cache instead. */
 class CDB
 {
 protected:
@@ -101,6 +114,16 @@ protected:
     std::string strFile;
     DbTxn *activeTxn;
     bool fReadOnly;
+    CLogDB* plogdb;
+    CLogDB::CBatch logbatch;
+    bool fLogTxn;
+    CTxCache* pcache;
+
+    bool LogCommit(const CLogDB::CBatch& batch);
+    bool LogRead(const CDataStream& ssKey, std::string& strValue);
+    bool LogWrite(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite);
+    bool LogErase(const CDataStream& ssKey);
+    bool LogExists(const CDataStream& ssKey);
 
     explicit CDB(const char* pszFile, const char* pszMode="r+");
     ~CDB() { Close(); }
@@ -114,13 +137,29 @@ protected:
     template<typename K, typename T>
     bool Read(const K& key, T& value)
     {
-        if (!pdb)
+        if (!pdb && !plogdb)
             return false;
 
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+
+        if (plogdb)
+        {
+            std::string strValue;
+            if (!LogRead(ssKey, strValue))
+                return false;
+            try {
+                CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+                ssValue >> value;
+            }
+            catch (std::exception &e) {
+                return false;
+            }
+            return true;
+        }
+
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Read
@@ -149,7 +188,7 @@ protected:
     template<typename K, typename T>
     bool Write(const K& key, const T& value, bool fOverwrite=true)
     {
-        if (!pdb)
+        if (!pdb && !plogdb)
             return false;
         if (fReadOnly)
             assert(!"Write called on database in read-only mode");
@@ -158,12 +197,16 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
-        Dbt datKey(&ssKey[0], ssKey.size());
 
         // Value
         CDataStream ssValue(SER_DISK, CLIENT_VERSION);
         ssValue.reserve(10000);
         ssValue << value;
+
+        if (plogdb)
+            return LogWrite(ssKey, ssValue, fOverwrite);
+
+        Dbt datKey(&ssKey[0], ssKey.size());
         Dbt datValue(&ssValue[0], ssValue.size());
 
         // Write
@@ -178,7 +221,7 @@ protected:
     template<typename K>
     bool Erase(const K& key)
     {
-        if (!pdb)
+        if (!pdb && !plogdb)
             return false;
         if (fReadOnly)
             assert(!"Erase called on database in read-only mode");
@@ -187,6 +230,8 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+        if (plogdb)
+            return LogErase(ssKey);
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Erase
@@ -200,13 +245,15 @@ protected:
     template<typename K>
     bool Exists(const K& key)
     {
-        if (!pdb)
+        if (!pdb && !plogdb)
             return false;
 
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+        if (plogdb)
+            return LogExists(ssKey);
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Exists
@@ -267,9 +314,22 @@ protected:
         return 0;
     }
 
+    /* Log engine counterpart of GetCursor()/ReadAtCursor(): strPos holds the
+     * cursor position.  Only DB_SET_RANGE and DB_NEXT are supported, and
+     * records not yet flushed from the CTxCache are not seen. */
+    int ReadAtLogCursor(std::string& strPos, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags=DB_NEXT);
+
 public:
     bool TxnBegin()
     {
+        if (plogdb)
+        {
+            if (fLogTxn)
+                return false;
+            logbatch.Clear();
+            fLogTxn = true;
+            return true;
+        }
         if (!pdb || activeTxn)
             return false;
         DbTxn* ptxn = bitdb.TxnBegin();
@@ -281,6 +341,15 @@ public:
 
     bool TxnCommit()
     {
+        if (plogdb)
+        {
+            if (!fLogTxn)
+                return false;
+            fLogTxn = false;
+            bool fRet = LogCommit(logbatch);
+            logbatch.Clear();
+            return fRet;
+        }
         if (!pdb || !activeTxn)
             return false;
         int ret = activeTxn->commit(0);
@@ -290,6 +359,14 @@ public:
 
     bool TxnAbort()
     {
+        if (plogdb)
+        {
+            if (!fLogTxn)
+                return false;
+            fLogTxn = false;
+            logbatch.Clear();
+            return true;
+        }
         if (!pdb || !activeTxn)
             return false;
         int ret = activeTxn->abort();
@@ -321,7 +398,14 @@ public:
 class CTxDB : public CDB
 {
 public:
-    CTxDB(const char* pszMode="r+") : CDB("blkindex.dat", pszMode) { }
+    /** Values of the "txindexformat" record */
+    enum
+    {
+        TXINDEX_LEGACY = 0,
+        TXINDEX_COMPACT = 1,
+    };
+
+    CTxDB(const char* pszMode="r+");
 private:
     CTxDB(const CTxDB&);
     void operator=(const CTxDB&);
@@ -336,15 +420,20 @@ public:
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx, CTxIndex& txindex);
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx);
     bool WriteBlockIndex(const CDiskBlockIndex& blockindex);
+    bool ReadTxIndexFormat(int& nFormat);
+    bool WriteTxIndexFormat(int nFormat);
     bool ReadHashBestChain(uint256& hashBestChain);
     bool WriteHashBestChain(uint256 hashBestChain);
-    bool ReadBestInvalidTrust(CBigNum& bnBestInvalidTrust);
-    bool WriteBestInvalidTrust(CBigNum bnBestInvalidTrust);
+    bool ReadBestInvalidTrust(uint256& nBestInvalidTrust);
+    bool WriteBestInvalidTrust(const uint256& nBestInvalidTrust);
     bool ReadSyncCheckpoint(uint256& hashCheckpoint);
     bool WriteSyncCheckpoint(uint256 hashCheckpoint);
     bool ReadCheckpointPubKey(std::string& strPubKey);
     bool WriteCheckpointPubKey(const std::string& strPubKey);
     bool LoadBlockIndex();
+    bool VerifyBlocks(int nCheckLevel, int nCheckDepth);
+    bool MigrateToLog(CLogDB& logdb);
+    bool CompactTxIndex();
 private:
     bool LoadBlockIndexGuts();
 };
@@ -15,6 +15,7 @@
 #include "sph_echo.h"
 #include "sph_hamsi.h"
 #include "sph_fugue.h"
+#include "x13simd.h"
 
 #ifndef QT_NO_DEBUG
 #include <string>
@@ -71,7 +72,6 @@ inline uint256 Hash9(const T1 pbegin, const T1 pend)
 {
     sph_blake512_context     ctx_blake;
     sph_bmw512_context       ctx_bmw;
-    sph_groestl512_context   ctx_groestl;
     sph_jh512_context        ctx_jh;
     sph_keccak512_context    ctx_keccak;
     sph_skein512_context     ctx_skein;
@@ -79,7 +79,6 @@ inline uint256 Hash9(const T1 pbegin, const T1 pend)
     sph_cubehash512_context  ctx_cubehash;
     sph_shavite512_context   ctx_shavite;
     sph_simd512_context      ctx_simd;
-    sph_echo512_context      ctx_echo;
     sph_hamsi512_context      ctx_hamsi;
     sph_fugue512_context      ctx_fugue;
     static unsigned char pblank[1];
@@ -99,9 +98,7 @@ inline uint256 Hash9(const T1 pbegin, const T1 pend)
     sph_bmw512 (&ctx_bmw, static_cast<const void*>(&hash[0]), 64);
     sph_bmw512_close(&ctx_bmw, static_cast<void*>(&hash[1]));
 
-    sph_groestl512_init(&ctx_groestl);
-    sph_groestl512 (&ctx_groestl, static_cast<const void*>(&hash[1]), 64);
-    sph_groestl512_close(&ctx_groestl, static_cast<void*>(&hash[2]));
+    x13_groestl512_64(static_cast<const void*>(&hash[1]), static_cast<void*>(&hash[2]));
 
     sph_skein512_init(&ctx_skein);
     sph_skein512 (&ctx_skein, static_cast<const void*>(&hash[2]), 64);
@@ -131,9 +128,7 @@ inline uint256 Hash9(const T1 pbegin, const T1 pend)
     sph_simd512 (&ctx_simd, static_cast<const void*>(&hash[8]), 64);
     sph_simd512_close(&ctx_simd, static_cast<void*>(&hash[9]));
 
-    sph_echo512_init(&ctx_echo);
-    sph_echo512 (&ctx_echo, static_cast<const void*>(&hash[9]), 64);
-    sph_echo512_close(&ctx_echo, static_cast<void*>(&hash[10]));
+    x13_echo512_64(static_cast<const void*>(&hash[9]), static_cast<void*>(&hash[10]));
 
     sph_hamsi512_init(&ctx_hamsi);
     sph_hamsi512 (&ctx_hamsi, static_cast<const void*>(&hash[10]), 64);
@@ -147,6 +142,74 @@ inline uint256 Hash9(const T1 pbegin, const T1 pend)
     return hash[12].trim256();
 }
 
+/** Largest batch hashed in one pass by Hash9xN(). */
+static const unsigned int HASH9_MAX_LANES = 8;
+
+#define HASH9_STAGE(name, in, out) do { \
+    for (unsigned int i = 0; i < nLanes; i++) \
+    { \
+        sph_##name##512_init(&ctx_##name); \
+        sph_##name##512 (&ctx_##name, static_cast<const void*>(&in[i]), 64); \
+        sph_##name##512_close(&ctx_##name, static_cast<void*>(&out[i])); \
+    } \
+} while (0)
+
+/** Batched Hash9(): hashes nLanes independent inputs of nLen bytes each,
+ * typically block headers that only differ in their nonce. The X13 chain is
+ * run one stage at a time across the whole batch, so each primitive's code
+ * and tables stay hot in cache, and stages that have multi-buffer SIMD
+ * kernels (see x13simd.h) hash all lanes at once. phashOut[i] equals
+ * Hash9() of ppData[i].
+ */
+inline void Hash9xN(const unsigned char* const* ppData, size_t nLen, unsigned int nLanes, uint256* phashOut)
+{
+    while (nLanes > HASH9_MAX_LANES)
+    {
+        Hash9xN(ppData, nLen, HASH9_MAX_LANES, phashOut);
+        ppData += HASH9_MAX_LANES;
+        phashOut += HASH9_MAX_LANES;
+        nLanes -= HASH9_MAX_LANES;
+    }
+
+    sph_blake512_context     ctx_blake;
+    sph_bmw512_context       ctx_bmw;
+    sph_jh512_context        ctx_jh;
+    sph_keccak512_context    ctx_keccak;
+    sph_skein512_context     ctx_skein;
+    sph_luffa512_context     ctx_luffa;
+    sph_shavite512_context   ctx_shavite;
+    sph_simd512_context      ctx_simd;
+    sph_hamsi512_context     ctx_hamsi;
+    sph_fugue512_context     ctx_fugue;
+
+    // two ping-pong buffers of back-to-back 64-byte digests
+    uint512 a[HASH9_MAX_LANES], b[HASH9_MAX_LANES];
+
+    for (unsigned int i = 0; i < nLanes; i++)
+    {
+        sph_blake512_init(&ctx_blake);
+        sph_blake512 (&ctx_blake, static_cast<const void*>(ppData[i]), nLen);
+        sph_blake512_close(&ctx_blake, static_cast<void*>(&a[i]));
+    }
+    HASH9_STAGE(bmw, a, b);
+    for (unsigned int i = 0; i < nLanes; i++)
+        x13_groestl512_64(static_cast<const void*>(&b[i]), static_cast<void*>(&a[i]));
+    HASH9_STAGE(skein, a, b);
+    HASH9_STAGE(jh, b, a);
+    HASH9_STAGE(keccak, a, b);
+    HASH9_STAGE(luffa, b, a);
+    x13_cubehash512_64_n(static_cast<const void*>(&a[0]), static_cast<void*>(&b[0]), nLanes);
+    HASH9_STAGE(shavite, b, a);
+    HASH9_STAGE(simd, a, b);
+    for (unsigned int i = 0; i < nLanes; i++)
+        x13_echo512_64(static_cast<const void*>(&b[i]), static_cast<void*>(&a[i]));
+    HASH9_STAGE(hamsi, a, b);
+    HASH9_STAGE(fugue, b, a);
+
+    for (unsigned int i = 0; i < nLanes; i++)
+        phashOut[i] = a[i].trim256();
+}
+
 
 
 
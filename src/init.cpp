@@ -76,7 +76,9 @@ void Shutdown(void* parg)
         nTransactionsUpdated++;
         bitdb.Flush(false);
         StopNode();
+        DumpMempool();
         bitdb.Flush(true);
+        CloseTxDB();
         boost::filesystem::remove(GetPidFile());
         UnregisterWallet(pwalletMain);
         delete pwalletMain;
@@ -228,6 +230,10 @@ std::string HelpMessage()
         "  -stake=0               " + _("Turn off staking") + "\n" +
         "  -datadir=<dir>         " + _("Specify data directory") + "\n" +
         "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n" +
+        "  -compacttxindex        " + _("Convert the transaction index to a smaller format that older versions cannot read") + "\n" +
+        "  -txdb=<engine>         " + _("Block and transaction index storage engine, log or bdb (default: bdb)") + "\n" +
+        "  -par=<n>               " + _("Set the number of script verification threads (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)") + "\n" +
+        "  -stakethreads=<n>      " + _("Set the number of threads searching for a stake kernel (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)") + "\n" +
         "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n" +
         "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n" +
         "  -socks=<n>             " + _("Select the version of socks proxy to use (4-5, default: 5)") + "\n" +
@@ -245,6 +251,8 @@ std::string HelpMessage()
         "  -bantime=<n>           " + _("Number of seconds to keep misbehaving peers from reconnecting (default: 86400)") + "\n" +
         "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n" +
         "  -maxsendbuffer=<n>     " + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n" +
+        "  -socketengine=<name>   " + _("Wait for socket readiness with epoll or select (default: epoll where available)") + "\n" +
+        "  -maxmempool=<n>        " + _("Keep the transaction memory pool below <n> megabytes (default: 300)") + "\n" +
 #ifdef USE_UPNP
 #if USE_UPNP
         "  -upnp                  " + _("Use UPnP to map the listening port (default: 1 when listening)") + "\n" +
@@ -283,6 +291,7 @@ std::string HelpMessage()
         "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 2500, 0 = all)") + "\n" +
         "  -checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1)") + "\n" +
         "  -loadblock=<file>      " + _("Imports blocks from external blk000?.dat file") + "\n" +
+        "  -x13simd               " + _("Use SIMD/AES-NI hashing code when the CPU supports it (default: 1)") + "\n" +
 
         "\n" + _("Block creation options:") + "\n" +
         "  -blockminsize=<n>      "   + _("Set minimum block size in bytes (default: 0)") + "\n" +
@@ -400,6 +409,27 @@ bool AppInit2()
             nConnectTimeout = nNewTimeout;
     }
 
+    // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
+    nScriptCheckThreads = GetArg("-par", 0);
+    if (nScriptCheckThreads <= 0)
+        nScriptCheckThreads += boost::thread::hardware_concurrency();
+    if (nScriptCheckThreads <= 1)
+        nScriptCheckThreads = 0;
+    else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
+        nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
+
+    if (mapArgs.count("-maxmempool"))
+        nMaxMempoolUsage = max((int64)1, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE)) * 1000000;
+
+    // -stakethreads=0 means autodetect
+    nStakeThreads = GetArg("-stakethreads", 0);
+    if (nStakeThreads <= 0)
+        nStakeThreads += boost::thread::hardware_concurrency();
+    if (nStakeThreads < 1)
+        nStakeThreads = 1;
+    else if (nStakeThreads > MAX_STAKE_THREADS)
+        nStakeThreads = MAX_STAKE_THREADS;
+
     // Continue to put "/P2SH/" in the coinbase to monitor
     // BIP16 support.
     // This can be removed eventually...
@@ -454,6 +484,9 @@ bool AppInit2()
     printf("\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n");
     printf("BlackToken version %s (%s)\n", FormatFullVersion().c_str(), CLIENT_DATE.c_str());
     printf("Using OpenSSL version %s\n", SSLeay_version(SSLEAY_VERSION));
+    if (!GetBoolArg("-x13simd", true))
+        x13_select_backend(X13_BACKEND_SPH);
+    printf("Using %s X13 backend\n", x13_backend_name(x13_get_backend()));
     if (!fLogTimestamps)
         printf("Startup time: %s\n", DateTimeStrFormat("%x %H:%M:%S", GetTime()).c_str());
     printf("Default data directory %s\n", GetDefaultDataDir().string().c_str());
@@ -463,6 +496,23 @@ bool AppInit2()
     if (fDaemon)
         fprintf(stdout, "BlackToken server starting\n");
 
+    // ConnectBlock itself is the last script checking thread
+    if (nScriptCheckThreads)
+    {
+        printf("Using %d threads for script verification\n", nScriptCheckThreads);
+        for (int i = 0; i < nScriptCheckThreads - 1; i++)
+            if (!NewThread(ThreadScriptCheck, NULL))
+                printf("Error: NewThread(ThreadScriptCheck) failed\n");
+    }
+
+    // The stake minter itself is the last kernel search thread
+    if (GetBoolArg("-stake", true))
+    {
+        for (int i = 0; i < nStakeThreads - 1; i++)
+            if (!NewThread(ThreadStakeSearch, NULL))
+                printf("Error: NewThread(ThreadStakeSearch) failed\n");
+    }
+
     int64 nStart;
 
     // ********************************************************* Step 5: verify database integrity
@@ -630,6 +680,9 @@ bool AppInit2()
         return InitError(msg);
     }
 
+    if (!OpenTxDB())
+        return InitError(_("Error opening block database"));
+
     if (GetBoolArg("-loadblockindextest"))
     {
         CTxDB txdb("r");
@@ -762,7 +815,7 @@ bool AppInit2()
         uiInterface.InitMessage(_("Rescanning..."));
         printf("Rescanning last %i blocks (from block %i)...\n", pindexBest->nHeight - pindexRescan->nHeight, pindexRescan->nHeight);
         nStart = GetTimeMillis();
-        pwalletMain->ScanForWalletTransactions(pindexRescan, true);
+        pwalletMain->ScanForWalletTransactions(pindexRescan, true, true);
         printf(" rescan      %15"PRI64d"ms\n", GetTimeMillis() - nStart);
     }
 
@@ -773,25 +826,21 @@ bool AppInit2()
         uiInterface.InitMessage(_("Importing blockchain data file."));
 
         BOOST_FOREACH(string strFile, mapMultiArgs["-loadblock"])
-        {
-            FILE *file = fopen(strFile.c_str(), "rb");
-            if (file)
-                LoadExternalBlockFile(file);
-        }
+            LoadExternalBlockFile(strFile);
     }
 
     filesystem::path pathBootstrap = GetDataDir() / "bootstrap.dat";
     if (filesystem::exists(pathBootstrap)) {
         uiInterface.InitMessage(_("Importing bootstrap blockchain data file."));
 
-        FILE *file = fopen(pathBootstrap.string().c_str(), "rb");
-        if (file) {
-            filesystem::path pathBootstrapOld = GetDataDir() / "bootstrap.dat.old";
-            LoadExternalBlockFile(file);
+        filesystem::path pathBootstrapOld = GetDataDir() / "bootstrap.dat.old";
+        if (LoadExternalBlockFile(pathBootstrap))
             RenameOver(pathBootstrap, pathBootstrapOld);
-        }
     }
 
+    uiInterface.InitMessage(_("Loading memory pool..."));
+    LoadMempool();
+
     // ********************************************************* Step 10: load peers
 
     uiInterface.InitMessage(_("Loading addresses..."));
@@ -824,6 +873,10 @@ bool AppInit2()
     if (!NewThread(StartNode, NULL))
         InitError(_("Error: could not start node"));
 
+    // Deeper -checklevel runs were done by LoadBlockIndex() already
+    if (GetArg("-checklevel", 1) <= 1 && !NewThread(ThreadVerifyBlocks, NULL))
+        printf("Error: NewThread(ThreadVerifyBlocks) failed\n");
+
     if (fServer)
         NewThread(ThreadRPCServer, NULL);
 
@@ -3,6 +3,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <boost/assign/list_of.hpp>
+#include <boost/bind.hpp>
 
 #include "kernel.h"
 #include "db.h"
@@ -17,6 +18,10 @@ extern int nStakeTargetSpacing;
 
 unsigned int nModifierInterval = MODIFIER_INTERVAL;
 
+int nStakeThreads = 1;
+
+CStakeModifierIndex stakeModifierIndex;
+
 // Hard checkpoints of stake modifiers to ensure they are deterministic
 static std::map<int, unsigned int> mapStakeModifierCheckpoints=
     boost::assign::map_list_of
@@ -216,6 +221,85 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64& nStakeModif
     return true;
 }
 
+void CStakeModifierIndex::Clear()
+{
+    vIndex.clear();
+    vTimeMax.clear();
+    nLeaves = 0;
+}
+
+void CStakeModifierIndex::SetTime(unsigned int i, int64 nTime)
+{
+    unsigned int nNode = nLeaves + i;
+    vTimeMax[nNode] = nTime;
+    for (nNode /= 2; nNode > 0; nNode /= 2)
+        vTimeMax[nNode] = max(vTimeMax[2 * nNode], vTimeMax[2 * nNode + 1]);
+}
+
+void CStakeModifierIndex::Connect(const CBlockIndex* pindex)
+{
+    if (!pindex->GeneratedStakeModifier())
+        return;
+    assert(vIndex.empty() || vIndex.back()->nHeight < pindex->nHeight);
+    if (vIndex.size() == nLeaves)
+    {
+        // Out of leaves, rebuild the tree twice as wide
+        nLeaves = max(256U, 2 * nLeaves);
+        vTimeMax.assign(2 * nLeaves, std::numeric_limits<int64>::min());
+        for (unsigned int i = 0; i < vIndex.size(); i++)
+            vTimeMax[nLeaves + i] = vIndex[i]->GetBlockTime();
+        for (unsigned int nNode = nLeaves - 1; nNode > 0; nNode--)
+            vTimeMax[nNode] = max(vTimeMax[2 * nNode], vTimeMax[2 * nNode + 1]);
+    }
+    vIndex.push_back(pindex);
+    SetTime(vIndex.size() - 1, pindex->GetBlockTime());
+}
+
+void CStakeModifierIndex::Disconnect(const CBlockIndex* pindex)
+{
+    while (!vIndex.empty() && vIndex.back()->nHeight >= pindex->nHeight)
+    {
+        vIndex.pop_back();
+        SetTime(vIndex.size(), std::numeric_limits<int64>::min());
+    }
+}
+
+// First entry at or after nFirst in the range [nLow, nHigh) of nNode with a
+// block time of at least nTime, or -1
+int CStakeModifierIndex::Search(unsigned int nNode, unsigned int nLow, unsigned int nHigh, unsigned int nFirst, int64 nTime) const
+{
+    if (nHigh <= nFirst || vTimeMax[nNode] < nTime)
+        return -1;
+    if (nHigh - nLow == 1)
+        return nLow;
+    unsigned int nMid = nLow + (nHigh - nLow) / 2;
+    int nFound = Search(2 * nNode, nLow, nMid, nFirst, nTime);
+    if (nFound < 0)
+        nFound = Search(2 * nNode + 1, nMid, nHigh, nFirst, nTime);
+    return nFound;
+}
+
+const CBlockIndex* CStakeModifierIndex::Find(int nHeightFrom, int64 nTime) const
+{
+    // first entry above nHeightFrom
+    unsigned int nBegin = 0, nEnd = vIndex.size();
+    while (nBegin < nEnd)
+    {
+        unsigned int nMid = nBegin + (nEnd - nBegin) / 2;
+        if (vIndex[nMid]->nHeight <= nHeightFrom)
+            nBegin = nMid + 1;
+        else
+            nEnd = nMid;
+    }
+    if (nBegin == vIndex.size())
+        return NULL;
+
+    // Block times are not monotonic; the tree skips every range whose
+    // latest block is still before nTime
+    int nFound = Search(1, 0, nLeaves, nBegin, nTime);
+    return (nFound >= 0 ? vIndex[nFound] : NULL);
+}
+
 // The stake modifier used to hash for a stake kernel is chosen as the stake
 // modifier about a selection interval later than the coin generating the kernel
 static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64& nStakeModifier, int& nStakeModifierHeight, int64& nStakeModifierTime, bool fPrintProofOfStake)
@@ -227,6 +311,21 @@ static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64& nStakeModifier
     nStakeModifierHeight = pindexFrom->nHeight;
     nStakeModifierTime = pindexFrom->GetBlockTime();
     int64 nStakeModifierSelectionInterval = GetStakeModifierSelectionInterval();
+
+    // blocks of the best chain are looked up in the modifier index; the walk
+    // below is left for side chains and for when the best block is reached
+    if (pindexFrom->pnext && nStakeModifierSelectionInterval > 0)
+    {
+        const CBlockIndex* pindexModifier = stakeModifierIndex.Find(pindexFrom->nHeight, pindexFrom->GetBlockTime() + nStakeModifierSelectionInterval);
+        if (pindexModifier)
+        {
+            nStakeModifierHeight = pindexModifier->nHeight;
+            nStakeModifierTime = pindexModifier->GetBlockTime();
+            nStakeModifier = pindexModifier->nStakeModifier;
+            return true;
+        }
+    }
+
     const CBlockIndex* pindex = pindexFrom;
 
     // loop to find the stake modifier later by a selection interval
@@ -382,6 +481,298 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned
     return true;
 }
 
+// Hash target of a kernel as computed by CheckStakeKernelHash(): the
+// coin-day weight of the output times the target per coin day
+static CBigNum GetKernelHashTarget(const CBigNum& bnTargetPerCoinDay, int64 nValueIn, unsigned int nTimeTxPrev, unsigned int nTimeTx)
+{
+    int64 nTimeWeight = min((int64)nTimeTx - nTimeTxPrev,
+                            (int64)nStakeMaxAge + nStakeMinAge) -
+                        nStakeMinAge;
+    CBigNum bnCoinDayWeight = CBigNum(nValueIn) * nTimeWeight / COIN / (24 * 60 * 60);
+    return bnCoinDayWeight * bnTargetPerCoinDay * 10;
+}
+
+bool SearchStakeKernel(const CStakeKernelInput& input, unsigned int nBits, unsigned int nTimeTx, unsigned int nSearchInterval, unsigned int& nTimeTxRet, uint256& hashProofOfStake)
+{
+    if (!input.fModifier || nSearchInterval == 0)
+        return false;
+
+    CBigNum bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(nBits);
+
+    // The coin-day weight only grows with the timestamp, so the target at
+    // nTimeTx bounds the target of every timestamp tried. Hashes are
+    // compared against that bound and only the rare ones under it get the
+    // exact check.
+    CBigNum bnTargetMax = GetKernelHashTarget(bnTargetPerCoinDay, input.nValueIn, input.nTimeTxPrev, nTimeTx);
+    if (bnTargetMax < 0)
+        return false;
+    uint256 hashTargetMax = bnTargetMax >= (CBigNum(1) << 256) ? ~uint256(0) : bnTargetMax.getuint256();
+
+    // Same bytes CheckStakeKernelHash() serializes: nStakeModifier,
+    // nTimeBlockFrom, nTxPrevOffset, nTimeTxPrev, prevout.n and nTimeTx.
+    // Only nTimeTx changes between tries.
+    unsigned char pch[28];
+    memcpy(&pch[0], &input.nStakeModifier, 8);
+    memcpy(&pch[8], &input.nTimeBlockFrom, 4);
+    memcpy(&pch[12], &input.nTxPrevOffset, 4);
+    memcpy(&pch[16], &input.nTimeTxPrev, 4);
+    memcpy(&pch[20], &input.prevout.n, 4);
+    for (unsigned int n = 0; n < nSearchInterval; n++)
+    {
+        unsigned int nTimeTry = nTimeTx - n;
+        // Timestamp and min age violations only get worse going back
+        if (nTimeTry < input.nTimeTxPrev || input.nTimeBlockFrom + nStakeMinAge > nTimeTry)
+            break;
+        memcpy(&pch[24], &nTimeTry, 4);
+        uint256 hash = Hash(pch, pch + sizeof(pch));
+        if (hash > hashTargetMax)
+            continue;
+        if (CBigNum(hash) > GetKernelHashTarget(bnTargetPerCoinDay, input.nValueIn, input.nTimeTxPrev, nTimeTry))
+            continue;
+        nTimeTxRet = nTimeTry;
+        hashProofOfStake = hash;
+        return true;
+    }
+    return false;
+}
+
+// Fewest candidates worth handing to another search thread
+static const unsigned int STAKE_SEARCH_MIN_PER_THREAD = 32;
+
+// State shared by the threads of one SearchStakeKernels() run. Partition t
+// holds candidates t, t+nThreads, t+2*nThreads, ...
+class CStakeKernelSearch
+{
+public:
+    const std::vector<CStakeKernelInput>* pvInput;
+    unsigned int nBits;
+    unsigned int nTimeTx;
+    unsigned int nSearchInterval;
+    unsigned int nThreads;
+
+    // Set once a kernel is found; read without the lock to stop early
+    volatile bool fFound;
+
+    boost::mutex mutex;
+    unsigned int nIndexBest;
+    unsigned int nTimeTxBest;
+    uint256 hashBest;
+
+    CStakeKernelSearch() : fFound(false), nIndexBest(0), nTimeTxBest(0), hashBest(0) {}
+
+    void Found(unsigned int nIndex, unsigned int nTimeTxFound, const uint256& hashProofOfStake)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (fFound && (nTimeTxFound < nTimeTxBest ||
+                       (nTimeTxFound == nTimeTxBest && (*pvInput)[nIndex].nValueIn <= (*pvInput)[nIndexBest].nValueIn)))
+            return;
+        nIndexBest = nIndex;
+        nTimeTxBest = nTimeTxFound;
+        hashBest = hashProofOfStake;
+        fFound = true;
+    }
+
+    void Run(unsigned int nThread)
+    {
+        for (unsigned int i = nThread; i < pvInput->size() && !fFound && !fShutdown; i += nThreads)
+        {
+            unsigned int nTimeTxFound = 0;
+            uint256 hashProofOfStake = 0;
+            if (SearchStakeKernel((*pvInput)[i], nBits, nTimeTx, nSearchInterval, nTimeTxFound, hashProofOfStake))
+                Found(i, nTimeTxFound, hashProofOfStake);
+        }
+    }
+};
+
+// Hands the partitions of a search to the -stakethreads worker threads,
+// which stay up between searches. The searching thread takes partitions
+// too, so a search completes even without any worker.
+class CStakeSearchQueue
+{
+private:
+    // serializes searches
+    boost::mutex mutexSearch;
+
+    boost::mutex mutex;
+    boost::condition_variable condWorker;
+    boost::condition_variable condMaster;
+    CStakeKernelSearch* psearch; // current search, NULL if none
+    unsigned int nNext;          // next partition of it to hand out
+    unsigned int nRunning;       // partitions being searched
+    bool fQuit;
+
+    bool Claim(CStakeKernelSearch*& psearchRet, unsigned int& nPartitionRet)
+    {
+        if (!psearch || nNext >= psearch->nThreads)
+            return false;
+        psearchRet = psearch;
+        nPartitionRet = nNext++;
+        nRunning++;
+        return true;
+    }
+
+public:
+    CStakeSearchQueue() : psearch(NULL), nNext(0), nRunning(0), fQuit(false) {}
+
+    void Thread()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!fQuit)
+        {
+            CStakeKernelSearch* psearchRun;
+            unsigned int nPartition;
+            if (!Claim(psearchRun, nPartition))
+            {
+                condWorker.wait(lock);
+                continue;
+            }
+            lock.unlock();
+            psearchRun->Run(nPartition);
+            lock.lock();
+            if (--nRunning == 0)
+                condMaster.notify_one();
+        }
+    }
+
+    void Search(CStakeKernelSearch& search)
+    {
+        boost::unique_lock<boost::mutex> lockSearch(mutexSearch);
+        boost::unique_lock<boost::mutex> lock(mutex);
+        psearch = &search;
+        nNext = 0;
+        condWorker.notify_all();
+        CStakeKernelSearch* psearchRun;
+        unsigned int nPartition;
+        while (Claim(psearchRun, nPartition))
+        {
+            lock.unlock();
+            psearchRun->Run(nPartition);
+            lock.lock();
+            nRunning--;
+        }
+        while (nRunning > 0)
+            condMaster.wait(lock);
+        psearch = NULL;
+    }
+
+    void Quit()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fQuit = true;
+        condWorker.notify_all();
+    }
+};
+
+static CStakeSearchQueue stakesearchqueue;
+
+void ThreadStakeSearch(void* parg)
+{
+    RenameThread("bitcoin-stakesrch");
+    vnThreadsRunning[THREAD_STAKESEARCH]++;
+    stakesearchqueue.Thread();
+    vnThreadsRunning[THREAD_STAKESEARCH]--;
+}
+
+void StopStakeSearchThreads()
+{
+    stakesearchqueue.Quit();
+}
+
+bool SearchStakeKernels(const std::vector<CStakeKernelInput>& vInput, unsigned int nBits, unsigned int nTimeTx, unsigned int nSearchInterval, int nThreads, unsigned int& nIndexRet, unsigned int& nTimeTxRet, uint256& hashProofOfStake)
+{
+    if (vInput.empty())
+        return false;
+
+    CStakeKernelSearch search;
+    search.pvInput = &vInput;
+    search.nBits = nBits;
+    search.nTimeTx = nTimeTx;
+    search.nSearchInterval = nSearchInterval;
+    search.nThreads = max(1, min(nThreads, (int)((vInput.size() + STAKE_SEARCH_MIN_PER_THREAD - 1) / STAKE_SEARCH_MIN_PER_THREAD)));
+
+    stakesearchqueue.Search(search);
+
+    if (!search.fFound)
+        return false;
+    nIndexRet = search.nIndexBest;
+    nTimeTxRet = search.nTimeTxBest;
+    hashProofOfStake = search.hashBest;
+    return true;
+}
+
+static void ResolveKernelStakeModifier(CStakeKernelInput& input)
+{
+    int nStakeModifierHeight = 0;
+    int64 nStakeModifierTime = 0;
+    input.fModifier = GetKernelStakeModifier(input.hashBlockFrom, input.nStakeModifier, nStakeModifierHeight, nStakeModifierTime, false);
+}
+
+void CStakeKernelCache::UpdateTip()
+{
+    if (pindexTip == pindexBest)
+        return;
+
+    if (pindexTip && pindexTip->pnext == NULL)
+    {
+        // The old tip left the main chain: any cached block or modifier
+        // may be on the losing side
+        mapInput.clear();
+    }
+    else
+    {
+        // The chain grew: modifiers that were out of reach may be known now
+        for (map<COutPoint, CStakeKernelInput>::iterator mi = mapInput.begin(); mi != mapInput.end(); ++mi)
+            if (!mi->second.fModifier)
+                ResolveKernelStakeModifier(mi->second);
+    }
+    pindexTip = pindexBest;
+}
+
+bool CStakeKernelCache::Get(const CTransaction& txPrev, unsigned int nOut, CStakeKernelInput& input)
+{
+    UpdateTip();
+
+    COutPoint prevout(txPrev.GetHash(), nOut);
+    map<COutPoint, CStakeKernelInput>::iterator mi = mapInput.find(prevout);
+    if (mi == mapInput.end())
+    {
+        CTxDB txdb("r");
+        CTxIndex txindex;
+        if (!txdb.ReadTxIndex(prevout.hash, txindex))
+            return false;
+
+        // Read block header
+        CBlock block;
+        if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+            return false;
+
+        CStakeKernelInput inputNew;
+        inputNew.prevout = prevout;
+        inputNew.hashBlockFrom = block.GetHash();
+        inputNew.nTimeBlockFrom = block.GetBlockTime();
+        inputNew.nTxPrevOffset = txindex.pos.nTxPos - txindex.pos.nBlockPos;
+        inputNew.nTimeTxPrev = txPrev.nTime;
+        inputNew.nValueIn = txPrev.vout[nOut].nValue;
+        ResolveKernelStakeModifier(inputNew);
+        mi = mapInput.insert(make_pair(prevout, inputNew)).first;
+    }
+    input = mi->second;
+    return true;
+}
+
+void CStakeKernelCache::Prune(const set<COutPoint>& setKeep)
+{
+    map<COutPoint, CStakeKernelInput>::iterator mi = mapInput.begin();
+    while (mi != mapInput.end())
+    {
+        if (setKeep.count(mi->first))
+            ++mi;
+        else
+            mapInput.erase(mi++);
+    }
+}
+
 // Check kernel hash target and coinstake signature
 bool CheckProofOfStake(const CTransaction& tx, unsigned int nBits, uint256& hashProofOfStake,
                        bool fIsInitialDownload)
@@ -435,12 +826,23 @@ bool CheckCoinStakeTimestamp(int64 nTimeBlock, int64 nTimeTx)
 unsigned int GetStakeModifierChecksum(const CBlockIndex* pindex)
 {
     assert (pindex->pprev || pindex->GetBlockHash() == (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet));
-    // Hash previous checksum with flags, hashProofOfStake and nStakeModifier
-    CDataStream ss(SER_GETHASH, 0);
+    // Hash previous checksum with flags, hashProofOfStake and nStakeModifier.
+    // This runs for every block at startup, so the fields are serialized
+    // into a fixed buffer rather than a CDataStream.
+    unsigned char pch[sizeof(unsigned int) * 2 + sizeof(uint256) + sizeof(uint64)];
+    unsigned char* p = pch;
     if (pindex->pprev)
-        ss << pindex->pprev->nStakeModifierChecksum;
-    ss << pindex->nFlags << pindex->hashProofOfStake << pindex->nStakeModifier;
-    uint256 hashChecksum = Hash(ss.begin(), ss.end());
+    {
+        memcpy(p, &pindex->pprev->nStakeModifierChecksum, sizeof(unsigned int));
+        p += sizeof(unsigned int);
+    }
+    memcpy(p, &pindex->nFlags, sizeof(unsigned int));
+    p += sizeof(unsigned int);
+    memcpy(p, BEGIN(pindex->hashProofOfStake), sizeof(uint256));
+    p += sizeof(uint256);
+    memcpy(p, &pindex->nStakeModifier, sizeof(uint64));
+    p += sizeof(uint64);
+    uint256 hashChecksum = Hash(pch, p);
     hashChecksum >>= (256 - 32);
     if(fDebug)
 	printf("stake checksum: 0x%016"PRI64x"", hashChecksum.Get64());
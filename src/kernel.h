@@ -10,6 +10,11 @@
 static const unsigned int MODIFIER_INTERVAL = 5 * 60;// * 60; // 20 minutes
 extern unsigned int nModifierInterval;
 
+// Maximum number of threads searching for a stake kernel
+static const int MAX_STAKE_THREADS = 16;
+// Number of threads searching for a stake kernel (-stakethreads)
+extern int nStakeThreads;
+
 // MODIFIER_INTERVAL_RATIO:
 // ratio of group interval length between the last group and the first group
 static const int MODIFIER_INTERVAL_RATIO = 3;
@@ -17,10 +22,110 @@ static const int MODIFIER_INTERVAL_RATIO = 3;
 // Compute the hash modifier for proof-of-stake
 bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64& nStakeModifier, bool& fGeneratedStakeModifier);
 
+// The blocks of the best chain that generated a stake modifier, in height
+// order, kept in step with the pnext links so the modifier of a kernel can
+// be found without walking the chain. Callers hold cs_main.
+class CStakeModifierIndex
+{
+private:
+    std::vector<const CBlockIndex*> vIndex;
+
+    // Latest block time over ranges of vIndex, as a segment tree: node 1
+    // covers nLeaves entries, node n has the children 2n and 2n+1, and the
+    // entry i is node nLeaves+i
+    std::vector<int64> vTimeMax;
+    unsigned int nLeaves;
+
+    void SetTime(unsigned int i, int64 nTime);
+    int Search(unsigned int nNode, unsigned int nLow, unsigned int nHigh, unsigned int nFirst, int64 nTime) const;
+
+public:
+    CStakeModifierIndex() : nLeaves(0) {}
+
+    void Clear();
+
+    // pindex was linked onto the end of the best chain
+    void Connect(const CBlockIndex* pindex);
+
+    // pindex and the blocks after it left the best chain
+    void Disconnect(const CBlockIndex* pindex);
+
+    // First block above nHeightFrom that generated a modifier at or after
+    // nTime, or NULL if the best chain does not reach that far yet
+    const CBlockIndex* Find(int nHeightFrom, int64 nTime) const;
+
+    unsigned int size() const { return vIndex.size(); }
+};
+extern CStakeModifierIndex stakeModifierIndex;
+
 // Check whether stake kernel meets hash target
 // Sets hashProofOfStake on success return
 bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, bool fPrintProofOfStake=false);
 
+// Inputs to the kernel hash of one output that do not depend on the
+// coinstake timestamp being tried
+class CStakeKernelInput
+{
+public:
+    COutPoint prevout;
+    uint256 hashBlockFrom;
+    unsigned int nTimeBlockFrom;
+    unsigned int nTxPrevOffset;
+    unsigned int nTimeTxPrev;
+    int64 nValueIn;
+    bool fModifier; // nStakeModifier is known; false until the chain covers the selection interval
+    uint64 nStakeModifier;
+
+    CStakeKernelInput()
+    {
+        hashBlockFrom = 0;
+        nTimeBlockFrom = 0;
+        nTxPrevOffset = 0;
+        nTimeTxPrev = 0;
+        nValueIn = 0;
+        fModifier = false;
+        nStakeModifier = 0;
+    }
+};
+
+// Try the timestamps nTimeTx, nTimeTx-1, ... (nSearchInterval of them) for a
+// kernel meeting the target. Finds the same kernel as calling
+// CheckStakeKernelHash() for each timestamp in turn.
+// Sets nTimeTxRet and hashProofOfStake on success return
+bool SearchStakeKernel(const CStakeKernelInput& input, unsigned int nBits, unsigned int nTimeTx, unsigned int nSearchInterval, unsigned int& nTimeTxRet, uint256& hashProofOfStake);
+
+// Run SearchStakeKernel() over vInput on up to nThreads threads. The threads
+// stop once any of them finds a kernel; of the kernels found, the one with
+// the latest timestamp and then the largest value is returned.
+// Sets nIndexRet, nTimeTxRet and hashProofOfStake on success return
+bool SearchStakeKernels(const std::vector<CStakeKernelInput>& vInput, unsigned int nBits, unsigned int nTimeTx, unsigned int nSearchInterval, int nThreads, unsigned int& nIndexRet, unsigned int& nTimeTxRet, uint256& hashProofOfStake);
+
+// Run a worker of SearchStakeKernels(); init starts nStakeThreads - 1 of them
+void ThreadStakeSearch(void* parg);
+// Wake the stake search threads so they exit
+void StopStakeSearchThreads();
+
+// Keeps the CStakeKernelInput of a wallet's outputs between minting rounds,
+// so the tx index, block header and stake modifier are only looked up again
+// when the chain tip moves. Callers hold cs_main.
+class CStakeKernelCache
+{
+private:
+    std::map<COutPoint, CStakeKernelInput> mapInput;
+    const CBlockIndex* pindexTip;
+
+    void UpdateTip();
+
+public:
+    CStakeKernelCache() : pindexTip(NULL) {}
+
+    // Fill input for output nOut of txPrev, building the entry on first use
+    bool Get(const CTransaction& txPrev, unsigned int nOut, CStakeKernelInput& input);
+
+    // Forget outputs not in setKeep, e.g. after they were spent
+    void Prune(const std::set<COutPoint>& setKeep);
+};
+
 // Check kernel hash target and coinstake signature
 // Sets hashProofOfStake on success return
 bool CheckProofOfStake(const CTransaction& tx, unsigned int nBits, uint256& hashProofOfStake,
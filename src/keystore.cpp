@@ -15,22 +15,37 @@ bool CKeyStore::GetPubKey(const CKeyID &address, CPubKey &vchPubKeyOut) const
     return true;
 }
 
+void CBasicKeyStore::AddScriptPubKeys(const CPubKey& vchPubKey)
+{
+    CScript script;
+    script.SetDestination(vchPubKey.GetID());
+    setScriptPubKey.insert(script);
+    script.clear();
+    script << vchPubKey << OP_CHECKSIG;
+    setScriptPubKey.insert(script);
+}
+
 bool CBasicKeyStore::AddKey(const CKey& key)
 {
     bool fCompressed = false;
     CSecret secret = key.GetSecret(fCompressed);
+    CPubKey vchPubKey = key.GetPubKey();
     {
         LOCK(cs_KeyStore);
-        mapKeys[key.GetPubKey().GetID()] = make_pair(secret, fCompressed);
+        mapKeys[vchPubKey.GetID()] = make_pair(secret, fCompressed);
+        AddScriptPubKeys(vchPubKey);
     }
     return true;
 }
 
 bool CBasicKeyStore::AddCScript(const CScript& redeemScript)
 {
+    CScript script;
+    script.SetDestination(redeemScript.GetID());
     {
         LOCK(cs_KeyStore);
         mapScripts[redeemScript.GetID()] = redeemScript;
+        setScriptPubKey.insert(script);
     }
     return true;
 }
@@ -60,6 +75,16 @@ bool CBasicKeyStore::GetCScript(const CScriptID &hash, CScript& redeemScriptOut)
     return false;
 }
 
+bool CBasicKeyStore::HaveScriptPubKey(const CScript& scriptPubKey) const
+{
+    bool result;
+    {
+        LOCK(cs_KeyStore);
+        result = (setScriptPubKey.count(scriptPubKey) > 0);
+    }
+    return result;
+}
+
 bool CCryptoKeyStore::SetCrypted()
 {
     {
@@ -148,6 +173,7 @@ bool CCryptoKeyStore::AddCryptedKey(const CPubKey &vchPubKey, const std::vector<
             return false;
 
         mapCryptedKeys[vchPubKey.GetID()] = make_pair(vchPubKey, vchCryptedSecret);
+        AddScriptPubKeys(vchPubKey);
     }
     return true;
 }
@@ -34,6 +34,10 @@ public:
     virtual bool HaveCScript(const CScriptID &hash) const =0;
     virtual bool GetCScript(const CScriptID &hash, CScript& redeemScriptOut) const =0;
 
+    // Check whether a pay to pubkey, pay to pubkey hash or pay to script hash
+    // output script pays a key or script in the store.
+    virtual bool HaveScriptPubKey(const CScript& scriptPubKey) const =0;
+
     virtual bool GetSecret(const CKeyID &address, CSecret& vchSecret, bool &fCompressed) const
     {
         CKey key;
@@ -54,6 +58,13 @@ protected:
     KeyMap mapKeys;
     ScriptMap mapScripts;
 
+    // Output scripts paying the keys and scripts added, including those of
+    // encrypted keys, so outputs can be matched without Solver()
+    std::set<CScript> setScriptPubKey;
+
+    // Caller holds cs_KeyStore
+    void AddScriptPubKeys(const CPubKey& vchPubKey);
+
 public:
     bool AddKey(const CKey& key);
     bool HaveKey(const CKeyID &address) const
@@ -95,6 +106,7 @@ public:
     virtual bool AddCScript(const CScript& redeemScript);
     virtual bool HaveCScript(const CScriptID &hash) const;
     virtual bool GetCScript(const CScriptID &hash, CScript& redeemScriptOut) const;
+    bool HaveScriptPubKey(const CScript& scriptPubKey) const;
 };
 
 typedef std::map<CKeyID, std::pair<CPubKey, std::vector<unsigned char> > > CryptedKeyMap;
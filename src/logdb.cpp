@@ -0,0 +1,373 @@
+// Copyright (c) 2014 The BlackToken developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "logdb.h"
+#include "serialize.h"
+#include "util.h"
+
+#include <boost/filesystem.hpp>
+
+using namespace std;
+
+// On-disk layout: a sequence of batch records
+//   uint32 magic, uint32 payload size, uint32 checksum, payload
+// where the payload is a sequence of entries
+//   uint8 type, string key[, string value]   (strings are compact-size prefixed)
+static const unsigned int LOGDB_MAGIC = 0x564b5442; // "BTKV"
+static const unsigned int LOGDB_HEADER_SIZE = 12;
+static const unsigned int LOGDB_MAX_BATCH = 0x10000000;
+
+enum
+{
+    LOGDB_WRITE = 1,
+    LOGDB_ERASE = 2,
+};
+
+// Overhead counted per live entry when deciding whether to compact
+static const unsigned int LOGDB_ENTRY_OVERHEAD = 8;
+
+// Logs grow past 2GB, beyond what fseek/ftell can address on some platforms
+static int LogSeek(FILE* file, int64 nPos, int nOrigin)
+{
+#ifdef WIN32
+    return _fseeki64(file, nPos, nOrigin);
+#else
+    return fseeko(file, nPos, nOrigin);
+#endif
+}
+
+static int64 LogTell(FILE* file)
+{
+#ifdef WIN32
+    return _ftelli64(file);
+#else
+    return ftello(file);
+#endif
+}
+
+static unsigned int LogChecksum(const char* pbegin, const char* pend)
+{
+    return (unsigned int)Hash(pbegin, pend).Get64();
+}
+
+CLogDB::CLogDB() : file(NULL), nFileSize(0), nLiveSize(0), fFailed(false)
+{
+}
+
+CLogDB::~CLogDB()
+{
+    Close();
+}
+
+bool CLogDB::Open(const boost::filesystem::path& path)
+{
+    LOCK(cs_logdb);
+    if (file)
+        return true;
+
+    pathLog = path;
+    mapIndex.clear();
+    nFileSize = 0;
+    nLiveSize = 0;
+    fFailed = false;
+    if (pathLog.empty())
+        file = tmpfile();
+    else
+        file = fopen(pathLog.string().c_str(), "a+b");
+    if (!file)
+        return error("CLogDB::Open() : cannot open %s", pathLog.string().c_str());
+
+    if (!Replay())
+    {
+        fclose(file);
+        file = NULL;
+        return false;
+    }
+
+    // Rewrite the log when less than half of it is live data
+    if (!pathLog.empty() && nFileSize > 16 * 1024 * 1024 && nFileSize > 2 * nLiveSize && !Compact())
+    {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+void CLogDB::Close()
+{
+    LOCK(cs_logdb);
+    if (!file)
+        return;
+    fflush(file);
+    FileCommit(file);
+    fclose(file);
+    file = NULL;
+    mapIndex.clear();
+}
+
+bool CLogDB::Replay()
+{
+    int64 nPos = 0;
+    vector<char> vPayload;
+    loop
+    {
+        if (LogSeek(file, nPos, SEEK_SET) != 0)
+            break;
+        unsigned int header[3];
+        if (fread(header, sizeof(header), 1, file) != 1)
+            break;
+        if (header[0] != LOGDB_MAGIC || header[1] > LOGDB_MAX_BATCH)
+            break;
+        vPayload.resize(header[1]);
+        if (header[1] > 0 && fread(&vPayload[0], header[1], 1, file) != 1)
+            break;
+        if (LogChecksum(vPayload.empty() ? NULL : &vPayload[0], vPayload.empty() ? NULL : &vPayload[0] + vPayload.size()) != header[2])
+            break;
+
+        // Apply the batch
+        try {
+            CDataStream ss(vPayload, SER_DISK, CLIENT_VERSION);
+            while (!ss.empty())
+            {
+                unsigned char nType;
+                string strKey;
+                ss >> nType >> strKey;
+                map<string, CValuePos>::iterator mi = mapIndex.find(strKey);
+                if (mi != mapIndex.end())
+                {
+                    nLiveSize -= strKey.size() + mi->second.nSize + LOGDB_ENTRY_OVERHEAD;
+                    mapIndex.erase(mi);
+                }
+                if (nType == LOGDB_WRITE)
+                {
+                    unsigned int nSize = ReadCompactSize(ss);
+                    CValuePos pos;
+                    pos.nPos = nPos + LOGDB_HEADER_SIZE + (vPayload.size() - ss.size());
+                    pos.nSize = nSize;
+                    if (ss.size() < nSize)
+                        throw runtime_error("value past end of batch");
+                    ss.ignore(nSize);
+                    mapIndex.insert(make_pair(strKey, pos));
+                    nLiveSize += strKey.size() + nSize + LOGDB_ENTRY_OVERHEAD;
+                }
+                else if (nType != LOGDB_ERASE)
+                    throw runtime_error("unknown entry type");
+            }
+        }
+        catch (std::exception &e) {
+            // The checksum matched, so this is not a torn write
+            return error("CLogDB::Replay() : corrupt batch at %"PRI64d" in %s", nPos, pathLog.string().c_str());
+        }
+        nPos += LOGDB_HEADER_SIZE + header[1];
+    }
+
+    // Drop a torn batch left by a crash so new batches follow the last good one
+    LogSeek(file, 0, SEEK_END);
+    int64 nEnd = LogTell(file);
+    if (nEnd > nPos)
+    {
+        printf("CLogDB::Replay() : discarding %"PRI64d" bytes of incomplete batch in %s\n", nEnd - nPos, pathLog.string().c_str());
+        if (pathLog.empty())
+            return error("CLogDB::Replay() : temporary log is corrupt");
+        fclose(file);
+        file = NULL;
+        boost::filesystem::resize_file(pathLog, nPos);
+        file = fopen(pathLog.string().c_str(), "a+b");
+        if (!file)
+            return error("CLogDB::Replay() : cannot reopen %s", pathLog.string().c_str());
+    }
+    nFileSize = nPos;
+    return true;
+}
+
+bool CLogDB::Append(const CBatch& batch)
+{
+    if (batch.IsEmpty())
+        return true;
+
+    // Replay() stops at a torn record, so nothing written after one would
+    // be read back
+    if (fFailed)
+        return error("CLogDB::Append() : an earlier write to %s failed", pathLog.string().c_str());
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss.reserve(LOGDB_HEADER_SIZE + 100 * batch.mapWrites.size());
+    unsigned int header[3] = { LOGDB_MAGIC, 0, 0 };
+    ss.write((const char*)header, sizeof(header));
+
+    // Value offsets are only known once the entries are laid out
+    vector<pair<map<string, CValuePos>::key_type, CValuePos> > vWritten;
+    vWritten.reserve(batch.mapWrites.size());
+    for (map<string, pair<bool, string> >::const_iterator mi = batch.mapWrites.begin(); mi != batch.mapWrites.end(); ++mi)
+    {
+        const string& strKey = mi->first;
+        bool fErase = mi->second.first;
+        const string& strValue = mi->second.second;
+        ss << (unsigned char)(fErase ? LOGDB_ERASE : LOGDB_WRITE) << strKey;
+        if (!fErase)
+        {
+            CValuePos pos;
+            pos.nPos = nFileSize + ss.size() + GetSizeOfCompactSize(strValue.size());
+            pos.nSize = strValue.size();
+            ss << strValue;
+            vWritten.push_back(make_pair(strKey, pos));
+        }
+    }
+
+    unsigned int nPayload = ss.size() - LOGDB_HEADER_SIZE;
+    if (nPayload > LOGDB_MAX_BATCH)
+        return error("CLogDB::Append() : batch too large");
+    header[1] = nPayload;
+    header[2] = LogChecksum(&ss[LOGDB_HEADER_SIZE], &ss[0] + ss.size());
+    memcpy(&ss[0], header, sizeof(header));
+
+    LogSeek(file, 0, SEEK_END);
+    if (fwrite(&ss[0], ss.size(), 1, file) != 1 || fflush(file) != 0)
+    {
+        // Leave the index untouched; a partial record is dropped on Replay(),
+        // and stays the last one until the log is reopened or compacted
+        fFailed = true;
+        return error("CLogDB::Append() : write to %s failed", pathLog.string().c_str());
+    }
+    FileCommit(file);
+    nFileSize += ss.size();
+
+    // Update the index
+    for (map<string, pair<bool, string> >::const_iterator mi = batch.mapWrites.begin(); mi != batch.mapWrites.end(); ++mi)
+    {
+        map<string, CValuePos>::iterator it = mapIndex.find(mi->first);
+        if (it != mapIndex.end())
+        {
+            nLiveSize -= it->first.size() + it->second.nSize + LOGDB_ENTRY_OVERHEAD;
+            mapIndex.erase(it);
+        }
+    }
+    for (unsigned int i = 0; i < vWritten.size(); i++)
+    {
+        mapIndex.insert(vWritten[i]);
+        nLiveSize += vWritten[i].first.size() + vWritten[i].second.nSize + LOGDB_ENTRY_OVERHEAD;
+    }
+    return true;
+}
+
+bool CLogDB::Compact()
+{
+    LOCK(cs_logdb);
+    if (!file)
+        return false;
+    if (pathLog.empty())
+        return true;
+
+    int64 nStart = GetTimeMillis();
+    boost::filesystem::path pathTmp = pathLog.string() + ".new";
+    boost::filesystem::remove(pathTmp);
+
+    // Copy the live entries into a fresh log in moderately sized batches
+    {
+        CLogDB logdbNew;
+        if (!logdbNew.Open(pathTmp))
+            return false;
+        CBatch batch;
+        for (map<string, CValuePos>::const_iterator mi = mapIndex.begin(); mi != mapIndex.end(); ++mi)
+        {
+            string strValue;
+            if (!ReadValue(mi->second, strValue))
+                return error("CLogDB::Compact() : read failed");
+            batch.Write(mi->first, strValue);
+            if (batch.mapWrites.size() >= 10000)
+            {
+                if (!logdbNew.WriteBatch(batch))
+                    return false;
+                batch.Clear();
+            }
+        }
+        if (!logdbNew.WriteBatch(batch))
+            return false;
+        logdbNew.Close();
+    }
+
+    int64 nOldSize = nFileSize;
+    fclose(file);
+    file = NULL;
+    if (!RenameOver(pathTmp, pathLog))
+        return error("CLogDB::Compact() : rename of %s failed", pathTmp.string().c_str());
+    file = fopen(pathLog.string().c_str(), "a+b");
+    if (!file)
+        return error("CLogDB::Compact() : cannot reopen %s", pathLog.string().c_str());
+    mapIndex.clear();
+    nLiveSize = 0;
+    if (!Replay())
+        return false;
+    fFailed = false;
+    printf("CLogDB::Compact() : %s %"PRI64d" -> %"PRI64d" bytes in %"PRI64d"ms\n", pathLog.string().c_str(), nOldSize, nFileSize, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool CLogDB::ReadValue(const CValuePos& pos, std::string& strValue) const
+{
+    strValue.resize(pos.nSize);
+    if (pos.nSize == 0)
+        return true;
+    if (LogSeek(file, pos.nPos, SEEK_SET) != 0)
+        return false;
+    return fread(&strValue[0], pos.nSize, 1, file) == 1;
+}
+
+bool CLogDB::Read(const std::string& strKey, std::string& strValue) const
+{
+    LOCK(cs_logdb);
+    if (!file)
+        return false;
+    map<string, CValuePos>::const_iterator mi = mapIndex.find(strKey);
+    if (mi == mapIndex.end())
+        return false;
+    return ReadValue(mi->second, strValue);
+}
+
+bool CLogDB::Exists(const std::string& strKey) const
+{
+    LOCK(cs_logdb);
+    return mapIndex.count(strKey) > 0;
+}
+
+bool CLogDB::WriteBatch(const CBatch& batch)
+{
+    LOCK(cs_logdb);
+    if (!file)
+        return false;
+    return Append(batch);
+}
+
+bool CLogDB::Seek(const std::string& strKey, bool fInclusive, std::string& strKeyRet, std::string& strValueRet) const
+{
+    LOCK(cs_logdb);
+    if (!file)
+        return false;
+    map<string, CValuePos>::const_iterator mi = fInclusive ? mapIndex.lower_bound(strKey) : mapIndex.upper_bound(strKey);
+    if (mi == mapIndex.end())
+        return false;
+    strKeyRet = mi->first;
+    return ReadValue(mi->second, strValueRet);
+}
+
+void CLogDB::Flush()
+{
+    LOCK(cs_logdb);
+    if (!file)
+        return;
+    fflush(file);
+    FileCommit(file);
+}
+
+unsigned int CLogDB::GetCount() const
+{
+    LOCK(cs_logdb);
+    return mapIndex.size();
+}
+
+int64 CLogDB::GetFileSize() const
+{
+    LOCK(cs_logdb);
+    return nFileSize;
+}
@@ -0,0 +1,90 @@
+// Copyright (c) 2014 The BlackToken developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_LOGDB_H
+#define BITCOIN_LOGDB_H
+
+#include "sync.h"
+#include "util.h"
+
+#include <map>
+#include <string>
+
+#include <boost/filesystem/path.hpp>
+
+/** Log-structured key/value store used as the CTxDB storage engine.
+ *
+ * Each committed batch of writes is appended to a single log file as one
+ * checksummed record.  An in-memory ordered index maps every live key to
+ * the file position of its latest value, so a read is one seek and a write
+ * never touches existing data.  A batch torn by a crash fails its checksum
+ * and is dropped on the next Open(), which makes batches atomic.  Open()
+ * also rewrites the log when most of it is superseded data.
+ */
+class CLogDB
+{
+public:
+    /** Uncommitted writes of one database handle */
+    class CBatch
+    {
+    public:
+        // key -> (fErase, value)
+        std::map<std::string, std::pair<bool, std::string> > mapWrites;
+
+        void Write(const std::string& strKey, const std::string& strValue) { mapWrites[strKey] = std::make_pair(false, strValue); }
+        void Erase(const std::string& strKey) { mapWrites[strKey] = std::make_pair(true, std::string()); }
+        void Clear() { mapWrites.clear(); }
+        bool IsEmpty() const { return mapWrites.empty(); }
+    };
+
+private:
+    struct CValuePos
+    {
+        int64 nPos;
+        unsigned int nSize;
+    };
+
+    mutable CCriticalSection cs_logdb;
+    FILE* file;
+    boost::filesystem::path pathLog;
+    std::map<std::string, CValuePos> mapIndex;
+    int64 nFileSize;
+    int64 nLiveSize;
+    bool fFailed; // a write failed part way; append nothing after it
+
+    bool Replay();
+    bool Append(const CBatch& batch);
+    bool ReadValue(const CValuePos& pos, std::string& strValue) const;
+
+    CLogDB(const CLogDB&);
+    void operator=(const CLogDB&);
+
+public:
+    CLogDB();
+    ~CLogDB();
+
+    /** Open the log at path, creating it if needed.  An empty path opens an
+     *  anonymous temporary log that disappears on Close(). */
+    bool Open(const boost::filesystem::path& path);
+    void Close();
+    bool IsOpen() const { return file != NULL; }
+
+    bool Read(const std::string& strKey, std::string& strValue) const;
+    bool Exists(const std::string& strKey) const;
+    bool WriteBatch(const CBatch& batch);
+
+    /** Find the first key >= strKey (> strKey if !fInclusive) */
+    bool Seek(const std::string& strKey, bool fInclusive, std::string& strKeyRet, std::string& strValueRet) const;
+
+    /** Force committed batches to stable storage */
+    void Flush();
+
+    /** Rewrite the log with only the live entries.  Open() does this by
+     *  itself when most of the log is superseded data. */
+    bool Compact();
+
+    unsigned int GetCount() const;
+    int64 GetFileSize() const;
+};
+
+#endif
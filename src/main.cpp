@@ -5,12 +5,15 @@
 
 #include "alert.h"
 #include "checkpoints.h"
+#include "checkqueue.h"
 #include "db.h"
 #include "net.h"
 #include "init.h" 
 #include "ui_interface.h"
 #include "kernel.h"
+#include "txcache.h"
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/random/mersenne_twister.hpp>
@@ -35,6 +38,7 @@ map<uint256, CBlockIndex*> mapBlockIndex;
 set<pair<COutPoint, unsigned int> > setStakeSeen;
 uint256 hashGenesisBlock = hashGenesisBlockOfficial;
 static CBigNum bnProofOfWorkLimit(~uint256(0) >> 20);
+static uint256 nProofOfWorkLimit(~uint256(0) >> 20); // bnProofOfWorkLimit for GetBlockTrust()
 static CBigNum bnProofOfStakeLimit(~uint256(0) >> 2);
 
 static CBigNum bnProofOfWorkLimitTestNet(~uint256(0) >> 16);
@@ -49,11 +53,17 @@ int64 nChainStartTime = 1407547785;
 int nCoinbaseMaturity = 40;
 CBlockIndex* pindexGenesisBlock = NULL;
 int nBestHeight = -1;
-CBigNum bnBestChainTrust = 0;
-CBigNum bnBestInvalidTrust = 0;
+uint256 nBestChainTrust = 0;
+uint256 nBestInvalidTrust = 0;
 uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
+CChain chainActive;
 int64 nTimeBestReceived = 0;
+CStatCounter nBlockHashComputed; // X13 block header hashes computed
+CStatCounter nBlockHashCached;   // X13 block header hashes served from cache
+bool fTxIndexCompact = false;    // write CTxIndex records in the compact format
+int nScriptCheckThreads = 0;
+uint64 nMaxMempoolUsage = DEFAULT_MAX_MEMPOOL_SIZE * 1000000ULL;
 
 
 CMedianFilter<int> cPeerBlockCounts(5, 0); // Amount of blocks that other nodes claim to have
@@ -139,6 +149,8 @@ void SyncWithWallets(const CTransaction& tx, const CBlock* pblock, bool fUpdate,
                 if (pwallet->IsFromMe(tx))
                     pwallet->DisableTransaction(tx);
         }
+        BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
+            pwallet->TransactionDisconnected(tx.GetHash());
         return;
     }
 
@@ -535,7 +547,7 @@ int64 CTransaction::GetMinFee(unsigned int nBlockSize, bool fAllowFree,
 
 
 bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
-                        bool* pfMissingInputs)
+                        bool* pfMissingInputs, bool fCheckScripts)
 {
     if (pfMissingInputs)
         *pfMissingInputs = false;
@@ -598,9 +610,9 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
         }
     }
 
+    MapPrevTx mapInputs;
     if (fCheckInputs)
     {
-        MapPrevTx mapInputs;
         map<uint256, CTxIndex> mapUnused;
         bool fInvalid = false;
         if (!tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
@@ -657,7 +669,9 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
 
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!tx.ConnectInputs(txdb, mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false))
+        // Script checks that are not wanted are collected and dropped.
+        vector<CScriptCheck> vChecks;
+        if (!tx.ConnectInputs(txdb, mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false, true, fCheckScripts ? NULL : &vChecks))
         {
             return error("CTxMemPool::accept() : ConnectInputs failed %s", hash.ToString().substr(0,10).c_str());
         }
@@ -671,7 +685,19 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
             printf("CTxMemPool::accept() : replacing tx %s with new version\n", ptxOld->GetHash().ToString().c_str());
             remove(*ptxOld);
         }
-        addUnchecked(hash, tx);
+        if (fCheckInputs)
+            addUnchecked(hash, tx, mapInputs);
+        else
+            addUnchecked(hash, tx);
+
+        // Stay within -maxmempool
+        if (nTotalUsage > nMaxMempoolUsage)
+        {
+            unsigned int nEvicted = TrimToSize(nMaxMempoolUsage);
+            printf("CTxMemPool::accept() : memory pool full, evicted %u tx\n", nEvicted);
+            if (!mapTx.count(hash))
+                return error("CTxMemPool::accept() : memory pool full, %s fee rate too low", hash.ToString().substr(0,10).c_str());
+        }
     }
 
     ///// are we sure this is ok when loading transactions or restoring block txes
@@ -690,6 +716,60 @@ bool CTransaction::AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs, bool* pfMi
     return mempool.accept(txdb, *this, fCheckInputs, pfMissingInputs);
 }
 
+void CTxMemPoolEntry::SetInputs(const CTransaction& tx, MapPrevTx& mapInputs)
+{
+    int64 nValueIn = 0;
+    nValueInChain = 0;
+    dPriorityInChain = 0;
+    nHeight = nBestHeight;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        const CTxIndex& txindex = mapInputs[txin.prevout.hash].first;
+        int64 nValue = mapInputs[txin.prevout.hash].second.vout[txin.prevout.n].nValue;
+        nValueIn += nValue;
+
+        // Inputs still in the memory pool have no confirmations
+        if (txindex.pos.IsNull() || txindex.pos == CDiskTxPos(1,1,1))
+            continue;
+        nValueInChain += nValue;
+        dPriorityInChain += (double)nValue * txindex.GetDepthInMainChain();
+    }
+    nFee = nValueIn - tx.GetValueOut();
+    fInputs = true;
+}
+
+// Estimated heap memory used by a memory pool transaction: the transaction,
+// its scripts, and the nodes of mapTx, mapNextTx, mapEntry and setFeePerKb
+static uint64 GetMemPoolUsage(const CTransaction& tx)
+{
+    static const uint64 nNodeOverhead = 4 * sizeof(void*);
+    uint64 nUsage = sizeof(std::pair<const uint256, CTransaction>) + nNodeOverhead;
+    nUsage += sizeof(std::pair<const uint256, CTxMemPoolEntry>) + nNodeOverhead;
+    nUsage += sizeof(std::pair<double, uint256>) + nNodeOverhead;
+    nUsage += tx.vin.capacity() * sizeof(CTxIn) + tx.vout.capacity() * sizeof(CTxOut);
+    nUsage += tx.vin.size() * (sizeof(std::pair<const COutPoint, CInPoint>) + nNodeOverhead);
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        nUsage += txin.scriptSig.capacity();
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        nUsage += txout.scriptPubKey.capacity();
+    return nUsage;
+}
+
+// Place of an entry in setFeePerKb; entries whose inputs were never filled
+// in have no fee yet and rank at 0, so TrimToSize evicts them first
+static pair<double, uint256> GetFeePerKbKey(const CTxMemPoolEntry& entry, const uint256& hash)
+{
+    return make_pair(entry.GetFeePerKb(), hash);
+}
+
+// The inputs of a memory pool transaction moved between the block chain and
+// the pool; work its priority out again when it is next needed. The fee
+// stays the same, and so does its place in setFeePerKb.
+static void ClearEntryInputs(CTxMemPoolEntry& entry)
+{
+    entry.fInputs = false;
+}
+
 bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
 {
     // Add to memory pool without checking anything.  Don't call this directly,
@@ -698,11 +778,50 @@ bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
         mapTx[hash] = tx;
         for (unsigned int i = 0; i < tx.vin.size(); i++)
             mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
+
+        CTxMemPoolEntry& entry = mapEntry[hash];
+        entry.nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+        entry.nUsage = GetMemPoolUsage(mapTx[hash]);
+        nTotalUsage += entry.nUsage;
+        setFeePerKb.insert(GetFeePerKbKey(entry, hash));
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.find(txin.prevout.hash);
+            if (mi != mapEntry.end() && txin.prevout.hash != hash)
+            {
+                entry.setDependsOn.insert(txin.prevout.hash);
+                (*mi).second.setDependers.insert(hash);
+            }
+        }
+
+        // Transactions already in the pool may spend this one, e.g. when a
+        // reorganization brings back the transactions of a disconnected block
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+        {
+            map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
+            if (it == mapNextTx.end())
+                continue;
+            uint256 hashDepender = (*it).second.ptx->GetHash();
+            CTxMemPoolEntry& entryDepender = mapEntry[hashDepender];
+            entry.setDependers.insert(hashDepender);
+            entryDepender.setDependsOn.insert(hash);
+            ClearEntryInputs(entryDepender);
+        }
         nTransactionsUpdated++;
     }
     return true;
 }
 
+bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx, MapPrevTx& mapInputs)
+{
+    addUnchecked(hash, tx);
+    CTxMemPoolEntry& entry = mapEntry[hash];
+    setFeePerKb.erase(GetFeePerKbKey(entry, hash));
+    entry.SetInputs(tx, mapInputs);
+    setFeePerKb.insert(GetFeePerKbKey(entry, hash));
+    return true;
+}
+
 
 bool CTxMemPool::remove(CTransaction &tx)
 {
@@ -714,6 +833,31 @@ bool CTxMemPool::remove(CTransaction &tx)
         {
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
                 mapNextTx.erase(txin.prevout);
+
+            map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.find(hash);
+            if (mi != mapEntry.end())
+            {
+                CTxMemPoolEntry& entry = (*mi).second;
+                BOOST_FOREACH(const uint256& hashDependsOn, entry.setDependsOn)
+                {
+                    map<uint256, CTxMemPoolEntry>::iterator miDependsOn = mapEntry.find(hashDependsOn);
+                    if (miDependsOn != mapEntry.end())
+                        (*miDependsOn).second.setDependers.erase(hash);
+                }
+
+                // The outputs its dependers spend are now in a block, or gone
+                BOOST_FOREACH(const uint256& hashDepender, entry.setDependers)
+                {
+                    map<uint256, CTxMemPoolEntry>::iterator miDepender = mapEntry.find(hashDepender);
+                    if (miDepender == mapEntry.end())
+                        continue;
+                    (*miDepender).second.setDependsOn.erase(hash);
+                    ClearEntryInputs((*miDepender).second);
+                }
+                setFeePerKb.erase(GetFeePerKbKey(entry, hash));
+                nTotalUsage -= entry.nUsage;
+                mapEntry.erase(mi);
+            }
             mapTx.erase(hash);
             nTransactionsUpdated++;
         }
@@ -726,9 +870,74 @@ void CTxMemPool::clear()
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
+    mapEntry.clear();
+    setFeePerKb.clear();
+    nTotalUsage = 0;
     ++nTransactionsUpdated;
 }
 
+unsigned int CTxMemPool::removeWithDependers(const uint256& hash)
+{
+    LOCK(cs);
+    vector<uint256> vRemove(1, hash);
+    set<uint256> setRemove(vRemove.begin(), vRemove.end());
+    for (unsigned int i = 0; i < vRemove.size(); i++)
+    {
+        map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.find(vRemove[i]);
+        if (mi == mapEntry.end())
+            continue;
+        BOOST_FOREACH(const uint256& hashDepender, (*mi).second.setDependers)
+            if (setRemove.insert(hashDepender).second)
+                vRemove.push_back(hashDepender);
+    }
+
+    // Dependers first, so no removal leaves a parent's links dangling
+    unsigned int nRemoved = 0;
+    BOOST_REVERSE_FOREACH(const uint256& hashRemove, vRemove)
+    {
+        map<uint256, CTransaction>::iterator mi = mapTx.find(hashRemove);
+        if (mi == mapTx.end())
+            continue;
+        CTransaction tx = (*mi).second;
+        remove(tx);
+        nRemoved++;
+    }
+    return nRemoved;
+}
+
+unsigned int CTxMemPool::TrimToSize(uint64 nUsageLimit)
+{
+    LOCK(cs);
+    unsigned int nEvicted = 0;
+
+    // Transactions whose inputs are not filled in rank lowest and go first
+    while (nTotalUsage > nUsageLimit && !setFeePerKb.empty())
+        nEvicted += removeWithDependers((*setFeePerKb.begin()).second);
+    return nEvicted;
+}
+
+bool CTxMemPool::FetchEntryInputs(CTxDB& txdb, const uint256& hash)
+{
+    LOCK(cs);
+    map<uint256, CTxMemPoolEntry>::iterator mi = mapEntry.find(hash);
+    if (mi == mapEntry.end())
+        return false;
+    CTxMemPoolEntry& entry = (*mi).second;
+    if (entry.fInputs)
+        return true;
+
+    CTransaction& tx = mapTx[hash];
+    MapPrevTx mapInputs;
+    map<uint256, CTxIndex> mapUnused;
+    bool fInvalid = false;
+    if (!tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
+        return false;
+    setFeePerKb.erase(GetFeePerKbKey(entry, hash));
+    entry.SetInputs(tx, mapInputs);
+    setFeePerKb.insert(GetFeePerKbKey(entry, hash));
+    return true;
+}
+
 void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
 {
     vtxid.clear();
@@ -874,22 +1083,47 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
 // CBlock and CBlockIndex
 //
 
-static CBlockIndex* pblockindexFBBHLast;
 CBlockIndex* FindBlockByHeight(int nHeight)
 {
-    CBlockIndex *pblockindex;
-    if (nHeight < nBestHeight / 2)
-        pblockindex = pindexGenesisBlock;
-    else
-        pblockindex = pindexBest;
-    if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
-        pblockindex = pblockindexFBBHLast;
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-    while (pblockindex->nHeight < nHeight)
-        pblockindex = pblockindex->pnext;
-    pblockindexFBBHLast = pblockindex;
-    return pblockindex;
+    return chainActive[nHeight];
+}
+
+const CBlockIndex* CChain::GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfStake) const
+{
+    int nHeight = (fProofOfStake ? vLastProofOfStake : vLastProofOfWork)[pindex->nHeight];
+    return vChain[nHeight < 0 ? 0 : nHeight];
+}
+
+void CChain::SetTip(CBlockIndex* pindex)
+{
+    if (pindex == NULL)
+    {
+        vChain.clear();
+        vLastProofOfStake.clear();
+        vLastProofOfWork.clear();
+        return;
+    }
+
+    // Replace the blocks after the fork
+    vChain.resize(pindex->nHeight + 1);
+    while (pindex && vChain[pindex->nHeight] != pindex)
+    {
+        vChain[pindex->nHeight] = pindex;
+        pindex = pindex->pprev;
+    }
+
+    int nFork = (pindex ? pindex->nHeight + 1 : 0);
+    vLastProofOfStake.resize(vChain.size());
+    vLastProofOfWork.resize(vChain.size());
+    for (int nHeight = nFork; nHeight < (int)vChain.size(); nHeight++)
+    {
+        vLastProofOfStake[nHeight] = (nHeight > 0 ? vLastProofOfStake[nHeight - 1] : -1);
+        vLastProofOfWork[nHeight] = (nHeight > 0 ? vLastProofOfWork[nHeight - 1] : -1);
+        if (vChain[nHeight]->IsProofOfStake())
+            vLastProofOfStake[nHeight] = nHeight;
+        else
+            vLastProofOfWork[nHeight] = nHeight;
+    }
 }
 
 
@@ -1039,7 +1273,11 @@ unsigned int ComputeMinStake(unsigned int nBase, int64 nTime, unsigned int nBloc
 const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfStake)
 {
     while (pindex && pindex->pprev && (pindex->IsProofOfStake() != fProofOfStake))
+    {
+        if (chainActive.Contains(pindex))
+            return chainActive.GetLastBlockIndex(pindex, fProofOfStake);
         pindex = pindex->pprev;
+    }
     return pindex;
 }
 
@@ -1138,19 +1376,19 @@ bool IsInitialBlockDownload()
 
 void static InvalidChainFound(CBlockIndex* pindexNew)
 {
-    if (pindexNew->bnChainTrust > bnBestInvalidTrust)
+    if (pindexNew->nChainTrust > nBestInvalidTrust)
     {
-        bnBestInvalidTrust = pindexNew->bnChainTrust;
-        CTxDB().WriteBestInvalidTrust(bnBestInvalidTrust);
+        nBestInvalidTrust = pindexNew->nChainTrust;
+        CTxDB().WriteBestInvalidTrust(nBestInvalidTrust);
         uiInterface.NotifyBlocksChanged();
     }
 
     printf("InvalidChainFound: invalid block=%s  height=%d  trust=%s  date=%s\n",
       pindexNew->GetBlockHash().ToString().substr(0,20).c_str(), pindexNew->nHeight,
-      pindexNew->bnChainTrust.ToString().c_str(), DateTimeStrFormat("%x %H:%M:%S",
+      pindexNew->nChainTrust.ToString().c_str(), DateTimeStrFormat("%x %H:%M:%S",
       pindexNew->GetBlockTime()).c_str());
     printf("InvalidChainFound:  current best=%s  height=%d  trust=%s  date=%s\n",
-      hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, bnBestChainTrust.ToString().c_str(),
+      hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, nBestChainTrust.ToString().c_str(),
       DateTimeStrFormat("%x %H:%M:%S", pindexBest->GetBlockTime()).c_str());
 }
 
@@ -1244,11 +1482,12 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
             if (!fFound)
                 txindex.vSpent.resize(txPrev.vout.size());
         }
-        else
+        else if (!txcache.GetOutputs(txindex.pos, txPrev))
         {
             // Get prev tx from disk
             if (!txPrev.ReadFromDisk(txindex.pos))
                 return error("FetchInputs() : %s ReadFromDisk prev tx %s failed", GetHash().ToString().substr(0,10).c_str(),  prevout.hash.ToString().substr(0,10).c_str());
+            txcache.AddOutputs(txindex.pos, txPrev);
         }
     }
 
@@ -1317,9 +1556,48 @@ unsigned int CTransaction::GetP2SHSigOpCount(const MapPrevTx& inputs) const
 }
 
 
+bool CScriptCheck::operator()() const
+{
+    const CScript& scriptSig = ptxTo->vin[nIn].scriptSig;
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, fStrictPayToScriptHash, nHashType))
+        return error("CScriptCheck() : %s VerifySignature failed", ptxTo->GetHash().ToString().substr(0,10).c_str());
+    return true;
+}
+
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+void ThreadScriptCheck(void* parg)
+{
+    RenameThread("bitcoin-scriptch");
+    vnThreadsRunning[THREAD_SCRIPTCHECK]++;
+    scriptcheckqueue.Thread();
+    vnThreadsRunning[THREAD_SCRIPTCHECK]--;
+}
+
+void StopScriptCheckThreads()
+{
+    scriptcheckqueue.Quit();
+}
+
+void ThreadVerifyBlocks(void* parg)
+{
+    RenameThread("bitcoin-verify");
+    vnThreadsRunning[THREAD_VERIFYBLOCKS]++;
+    try
+    {
+        CTxDB txdb("r");
+        txdb.VerifyBlocks(GetArg("-checklevel", 1), GetArg("-checkblocks", 2500));
+    }
+    catch (std::exception& e) {
+        PrintExceptionContinue(&e, "ThreadVerifyBlocks()");
+    }
+    vnThreadsRunning[THREAD_VERIFYBLOCKS]--;
+}
+
 bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
                                  map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                                 const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash)
+                                 const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash,
+                                 std::vector<CScriptCheck>* pvChecks)
 {
     // Take over previous transactions' spent pointers
     // fBlock is true when this is called from AcceptBlock when a new best-block is added to the blockchain
@@ -1376,12 +1654,20 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
             // still computed and checked, and any change will be caught at the next checkpoint.
             if (!(fBlock && (nBestHeight < Checkpoints::GetTotalBlocksEstimate())))
             {
-                // Verify signature
-                if (!VerifySignature(txPrev, *this, i, fStrictPayToScriptHash, 0))
+                // Defer the check to the caller's worker pool
+                if (pvChecks)
+                {
+                    pvChecks->push_back(CScriptCheck());
+                    CScriptCheck check(txPrev, *this, i, fStrictPayToScriptHash, 0);
+                    check.swap(pvChecks->back());
+                }
+                // Verify signature.  txPrev may only hold the outputs (see
+                // CTxOutputs), FetchInputs already matched it to prevout.hash
+                else if (!CScriptCheck(txPrev, *this, i, fStrictPayToScriptHash, 0)())
                 {
                     // only during transition phase for P2SH: do not invoke anti-DoS code for
                     // potentially old clients relaying bad P2SH transactions
-                    if (fStrictPayToScriptHash && VerifySignature(txPrev, *this, i, false, 0))
+                    if (fStrictPayToScriptHash && CScriptCheck(txPrev, *this, i, false, 0)())
                         return error("ConnectInputs() : %s P2SH VerifySignature failed", GetHash().ToString().substr(0,10).c_str());
 
                     return DoS(100,error("ConnectInputs() : %s VerifySignature failed", GetHash().ToString().substr(0,10).c_str()));
@@ -1532,6 +1818,10 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     else
         nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(vtx.size());
 
+    // Script checks are queued to the -par worker threads while the rest of
+    // the block is connected; nothing is written before they all pass
+    CCheckQueueControl<CScriptCheck> control(nScriptCheckThreads ? &scriptcheckqueue : NULL);
+
     map<uint256, CTxIndex> mapQueuedChanges;
     int64 nFees = 0;
     int64 nValueIn = 0;
@@ -1584,13 +1874,22 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             if (!tx.IsCoinStake())
                 nFees += nTxValueIn - nTxValueOut;
 
-            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, fStrictPayToScriptHash))
+            vector<CScriptCheck> vChecks;
+            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, fStrictPayToScriptHash, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
+            control.Add(vChecks);
         }
 
         mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
+
+        // New outputs are usually spent soon; keep them for FetchInputs
+        if (!fJustCheck)
+            txcache.AddOutputs(posThisTx, tx);
     }
 
+    if (!control.Wait())
+        return DoS(100, error("ConnectBlock() : script verification failed"));
+
     // ppcoin: track money supply and mint amount info
     pindex->nMint = nValueOut - nValueIn + nFees;
     pindex->nMoneySupply = (pindex->pprev? pindex->pprev->nMoneySupply : 0) + nValueOut - nValueIn;
@@ -1714,13 +2013,20 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
 
     // Disconnect shorter branch
     BOOST_FOREACH(CBlockIndex* pindex, vDisconnect)
+    {
         if (pindex->pprev)
             pindex->pprev->pnext = NULL;
+        stakeModifierIndex.Disconnect(pindex);
+    }
 
     // Connect longer branch
     BOOST_FOREACH(CBlockIndex* pindex, vConnect)
+    {
         if (pindex->pprev)
             pindex->pprev->pnext = pindex;
+        stakeModifierIndex.Connect(pindex);
+    }
+    chainActive.SetTip(pindexNew);
 
     // Resurrect memory transactions that were in the disconnected branch
     BOOST_FOREACH(CTransaction& tx, vResurrect)
@@ -1753,6 +2059,8 @@ bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
 
     // Add to current best branch
     pindexNew->pprev->pnext = pindexNew;
+    chainActive.SetTip(pindexNew);
+    stakeModifierIndex.Connect(pindexNew);
 
     // Delete redundant memory transactions
     BOOST_FOREACH(CTransaction& tx, vtx)
@@ -1775,6 +2083,8 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
         if (!txdb.TxnCommit())
             return error("SetBestChain() : TxnCommit failed");
         pindexGenesisBlock = pindexNew;
+        chainActive.SetTip(pindexNew);
+        stakeModifierIndex.Connect(pindexNew);
     }
     else if (hashPrevBlock == hashBestChain)
     {
@@ -1791,7 +2101,7 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
 
         // Reorganize is costly in terms of db load, as it works in a single db transaction.
         // Try to limit how much needs to be done inside
-        while (pindexIntermediate->pprev && pindexIntermediate->pprev->bnChainTrust > pindexBest->bnChainTrust)
+        while (pindexIntermediate->pprev && pindexIntermediate->pprev->nChainTrust > pindexBest->nChainTrust)
         {
             vpindexSecondary.push_back(pindexIntermediate);
             pindexIntermediate = pindexIntermediate->pprev;
@@ -1827,8 +2137,13 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
         }
     }
 
-    // Update best block in wallet (so we can detect restored wallets)
+    // Write the cached txdb records out at a block boundary: every block
+    // once synced, during the initial download only when the cache is full
     bool fIsInitialDownload = IsInitialBlockDownload();
+    if (!FlushTxDBCache(!fIsInitialDownload))
+        printf("SetBestChain() : FlushTxDBCache failed\n");
+
+    // Update best block in wallet (so we can detect restored wallets)
     if (!fIsInitialDownload)
     {
         const CBlockLocator locator(pindexNew);
@@ -1838,13 +2153,12 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     // New best block
     hashBestChain = hash;
     pindexBest = pindexNew;
-    pblockindexFBBHLast = NULL;
     nBestHeight = pindexBest->nHeight;
-    bnBestChainTrust = pindexNew->bnChainTrust;
+    nBestChainTrust = pindexNew->nChainTrust;
     nTimeBestReceived = GetTime();
     nTransactionsUpdated++;
     printf("SetBestChain: new best=%s  height=%d  trust=%s  date=%s\n",
-      hashBestChain.ToString().c_str(), nBestHeight, bnBestChainTrust.ToString().c_str(),
+      hashBestChain.ToString().c_str(), nBestHeight, nBestChainTrust.ToString().c_str(),
       DateTimeStrFormat("%x %H:%M:%S", pindexBest->GetBlockTime()).c_str());
 
 	printf("Stake checkpoint: %x\n", pindexBest->nStakeModifierChecksum);
@@ -1970,7 +2284,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
     }
 
     // ppcoin: compute chain trust score
-    pindexNew->bnChainTrust = (pindexNew->pprev ? pindexNew->pprev->bnChainTrust : 0) + pindexNew->GetBlockTrust();
+    pindexNew->nChainTrust = (pindexNew->pprev ? pindexNew->pprev->nChainTrust : uint256(0)) + pindexNew->GetBlockTrust();
 
     // ppcoin: compute stake entropy bit for stake modifier
     if (!pindexNew->SetStakeEntropyBit(GetStakeEntropyBit(pindexNew->nHeight)))
@@ -2009,7 +2323,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
         return false;
 
     // New best
-    if (pindexNew->bnChainTrust > bnBestChainTrust)
+    if (pindexNew->nChainTrust > nBestChainTrust)
         if (!SetBestChain(txdb, pindexNew))
             return false;
 
@@ -2032,6 +2346,8 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot) const
 {
     // These are checks that are independent of context
     // that can be verified before saving an orphan block.
+    if (fChecked)
+        return true;
 
     // Size limits
     if (vtx.empty() || vtx.size() > MAX_BLOCK_SIZE || ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION) > MAX_BLOCK_SIZE)
@@ -2112,6 +2428,7 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot) const
     if (!CheckBlockSignature())
         return DoS(100, error("CheckBlock() : bad block signature"));
 
+    fChecked = (fCheckPOW && fCheckMerkleRoot);
     return true;
 }
 
@@ -2199,25 +2516,57 @@ bool CBlock::AcceptBlock()
 }
 
 
-CBigNum CBlockIndex::GetBlockTrust() const
+// Expand a compact target the way CBigNum::SetCompact does, without the
+// bignum allocation. fOverflow is set if the target needs more than 256 bits.
+static uint256 GetTargetFromCompact(unsigned int nCompact, bool& fNegative, bool& fOverflow)
 {
-    CBigNum bnTarget;
-    bnTarget.SetCompact(nBits);
-    if (bnTarget <= 0)
+    unsigned int nSize = nCompact >> 24;
+    unsigned int nWord = nCompact & 0x007fffff;
+    uint256 nTarget;
+    if (nSize <= 3)
+        nTarget = nWord >> 8 * (3 - nSize);
+    else
+    {
+        nTarget = nWord;
+        nTarget <<= 8 * (nSize - 3);
+    }
+    fNegative = (nCompact & 0x00800000) != 0;
+    fOverflow = nWord != 0 && (nSize > 34 ||
+                               (nWord > 0xff && nSize > 33) ||
+                               (nWord > 0xffff && nSize > 32));
+    return nTarget;
+}
+
+uint256 CBlockIndex::GetBlockTrust() const
+{
+    bool fNegative, fOverflow;
+    uint256 nTarget = GetTargetFromCompact(nBits, fNegative, fOverflow);
+    if (fNegative || (nTarget == 0 && !fOverflow))
         return 0;
 
     if (IsProofOfStake())
     {
-        // Return trust score as usual
-        return (CBigNum(1)<<256) / (bnTarget+1);
+        // Return trust score as usual: 2**256 / (nTarget+1), computed as
+        // ~nTarget / (nTarget+1) + 1 so that it fits in 256 bits
+        if (fOverflow)
+            return 0;
+        uint256 nTargetPlusOne = nTarget;
+        ++nTargetPlusOne;
+        uint256 nTrust = uint256(~nTarget) / nTargetPlusOne;
+        ++nTrust;
+        return nTrust;
     }
     else
     {
         // Calculate work amount for block
-        CBigNum bnPoWTrust = (bnProofOfWorkLimit / (bnTarget+1));
-        return bnPoWTrust > 1 ? bnPoWTrust : 1;
+        if (fOverflow)
+            return 1;
+        uint256 nTargetPlusOne = nTarget;
+        ++nTargetPlusOne;
+        uint256 nPoWTrust = nProofOfWorkLimit / nTargetPlusOne;
+        return nPoWTrust > uint256(1) ? nPoWTrust : uint256(1);
     }
-} 
+}
 
 bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, unsigned int nRequired, unsigned int nToCheck)
 {
@@ -2264,15 +2613,8 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
             mapProofOfStake.insert(make_pair(hash, hashProofOfStake));
     }
 
-    CBlockLocator locator;
-    unsigned int nHeight = locator.GetBlockIndex()->nHeight;
-
-    if (pblock->IsProofOfWork() && (nHeight >= CUTOFF_POW_BLOCK)) {
-        if (pfrom)
-              pfrom->Misbehaving(100);
-        printf("Proof of work on or after block %d.\n", (int) CUTOFF_POW_BLOCK);
-        return error("Proof of work on or after block %d.\n", (int) CUTOFF_POW_BLOCK);
-    }
+    // The proof-of-work cutoff is enforced by AcceptBlock() at the block's
+    // own height
 
     CBlockIndex* pcheckpoint = Checkpoints::GetLastSyncCheckpoint();
 
@@ -2516,7 +2858,7 @@ bool CheckDiskSpace(uint64 nAdditionalBytes)
 }
 
 
-static filesystem::path BlockFilePath(unsigned int nFile)
+filesystem::path BlockFilePath(unsigned int nFile)
 {
     string strBlockFn = strprintf("blk%04u.dat", nFile);
     return GetDataDir() / strBlockFn;
@@ -2577,6 +2919,7 @@ bool LoadBlockIndex(bool fAllowNew)
 
         bnProofOfStakeLimit = bnProofOfStakeLimitTestNet; // 0x00000fff PoS base target is fixed in testnet
         bnProofOfWorkLimit = bnProofOfWorkLimitTestNet; // 0x0000ffff PoW base target is fixed in testnet
+        nProofOfWorkLimit = bnProofOfWorkLimit.getuint256();
         nStakeMinAge = 15 * 60; // test net min age is 20 min
         nStakeMaxAge = 60 * 60; // test net min age is 60 min
 		nModifierInterval = 60; // test modifier interval is 2 minutes
@@ -2754,7 +3097,8 @@ void PrintBlockTree()
     }
 }
 
-bool LoadExternalBlockFile(FILE* fileIn)
+// Scan and import a file that cannot be mapped one block at a time
+static bool LoadExternalBlockFileStream(FILE* fileIn)
 {
     int64 nStart = GetTimeMillis();
 
@@ -2814,6 +3158,306 @@ bool LoadExternalBlockFile(FILE* fileIn)
     return nLoaded > 0;
 }
 
+// Blocks of an external block file on their way from the reader, through
+// the decoding threads, to the thread connecting them in file order
+class CBlockImportQueue
+{
+public:
+    boost::mutex mutex;
+    boost::condition_variable condRead;    // room in the queue
+    boost::condition_variable condDecode;  // a record to decode, or the end
+    boost::condition_variable condConnect; // a decoded block, or the end
+
+    std::deque<std::pair<unsigned int, std::pair<const char*, unsigned int> > > dequeRecord; // sequence, data, size
+    std::map<unsigned int, std::pair<CBlock*, unsigned int> > mapDecoded; // sequence -> block (NULL if invalid), size
+    unsigned int nRead;      // records read
+    unsigned int nConnected; // records taken by the connecting thread
+    uint64 nQueuedBytes;     // size of the records read but not taken
+    bool fEnd;               // reader found no more records
+    bool fStop;              // connecting thread stopped early
+
+    CBlockImportQueue() : nRead(0), nConnected(0), nQueuedBytes(0), fEnd(false), fStop(false) {}
+};
+
+// Bound on the blocks between the reader and the connecting thread
+static const unsigned int IMPORT_QUEUE_BLOCKS = 1024;
+static const uint64 IMPORT_QUEUE_BYTES = 64 * 1024 * 1024;
+
+static void ThreadImportRead(CBlockImportQueue* pqueue, const char* pbegin, const char* pend)
+{
+    const char* p = pbegin;
+    while (true)
+    {
+        // Find the next message start; what follows is the block size
+        p = std::search(p, pend, pchMessageStart, pchMessageStart + sizeof(pchMessageStart));
+        if (pend - p < (ptrdiff_t)(sizeof(pchMessageStart) + sizeof(unsigned int)))
+            break;
+        p += sizeof(pchMessageStart);
+        unsigned int nSize;
+        CBufferReader(p, pend, SER_DISK, CLIENT_VERSION) >> nSize;
+        if (nSize == 0 || nSize > MAX_BLOCK_SIZE || (uint64)(pend - p) < sizeof(nSize) + nSize)
+            continue;
+        p += sizeof(nSize);
+
+        boost::unique_lock<boost::mutex> lock(pqueue->mutex);
+        while (!pqueue->fStop && (pqueue->nRead - pqueue->nConnected >= IMPORT_QUEUE_BLOCKS || pqueue->nQueuedBytes >= IMPORT_QUEUE_BYTES))
+            pqueue->condRead.wait(lock);
+        if (pqueue->fStop)
+            break;
+        pqueue->dequeRecord.push_back(make_pair(pqueue->nRead++, make_pair(p, nSize)));
+        pqueue->nQueuedBytes += nSize;
+        pqueue->condDecode.notify_one();
+        p += nSize;
+    }
+
+    boost::unique_lock<boost::mutex> lock(pqueue->mutex);
+    pqueue->fEnd = true;
+    pqueue->condDecode.notify_all();
+    pqueue->condConnect.notify_all();
+}
+
+// Deserialize blocks and run the checks that need no chain context, which
+// also computes and caches the X13 header hash
+static void ThreadImportDecode(CBlockImportQueue* pqueue)
+{
+    while (true)
+    {
+        std::pair<unsigned int, std::pair<const char*, unsigned int> > record;
+        {
+            boost::unique_lock<boost::mutex> lock(pqueue->mutex);
+            while (!pqueue->fStop && !pqueue->fEnd && pqueue->dequeRecord.empty())
+                pqueue->condDecode.wait(lock);
+            if (pqueue->fStop || pqueue->dequeRecord.empty())
+                return;
+            record = pqueue->dequeRecord.front();
+            pqueue->dequeRecord.pop_front();
+        }
+
+        const char* pdata = record.second.first;
+        unsigned int nSize = record.second.second;
+        CBlock* pblock = new CBlock();
+        try {
+            CBufferReader(pdata, pdata + nSize, SER_DISK, CLIENT_VERSION) >> *pblock;
+        }
+        catch (std::exception &e) {
+            printf("LoadExternalBlockFile() : deserialize error in block of %u bytes\n", nSize);
+            delete pblock;
+            pblock = NULL;
+        }
+        if (pblock && !pblock->CheckBlock())
+        {
+            delete pblock;
+            pblock = NULL;
+        }
+
+        boost::unique_lock<boost::mutex> lock(pqueue->mutex);
+        pqueue->mapDecoded[record.first] = make_pair(pblock, nSize);
+        if (record.first == pqueue->nConnected)
+            pqueue->condConnect.notify_one();
+    }
+}
+
+// False if the file could not be opened; true once it was imported, even if
+// it held no new blocks
+bool LoadExternalBlockFile(const boost::filesystem::path& path)
+{
+    boost::shared_ptr<CMappedFile> mapping = CMappedFile::Open(path);
+    if (!mapping)
+    {
+        FILE* file = fopen(path.string().c_str(), "rb");
+        if (!file)
+            return false;
+        LoadExternalBlockFileStream(file);
+        return true;
+    }
+
+    int64 nStart = GetTimeMillis();
+    int nThreads = boost::thread::hardware_concurrency() - 1;
+    nThreads = std::max(1, std::min(nThreads, MAX_SCRIPTCHECK_THREADS));
+    printf("Importing %s with %d decoding threads\n", path.string().c_str(), nThreads);
+
+    CBlockImportQueue queue;
+    boost::thread_group threadGroup;
+    threadGroup.create_thread(boost::bind(&ThreadImportRead, &queue, mapping->begin(), mapping->end()));
+    for (int i = 0; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&ThreadImportDecode, &queue));
+
+    // Connect in file order, holding cs_main for one block at a time
+    int nLoaded = 0;
+    int nRecords = 0;
+    uint64 nBytes = 0;
+    int64 nLastStats = nStart;
+    while (!fRequestShutdown)
+    {
+        std::pair<CBlock*, unsigned int> decoded;
+        {
+            boost::unique_lock<boost::mutex> lock(queue.mutex);
+            while (!queue.mapDecoded.count(queue.nConnected) && !(queue.fEnd && queue.nConnected == queue.nRead))
+                queue.condConnect.wait(lock);
+            std::map<unsigned int, std::pair<CBlock*, unsigned int> >::iterator mi = queue.mapDecoded.find(queue.nConnected);
+            if (mi == queue.mapDecoded.end())
+                break;
+            decoded = (*mi).second;
+            queue.mapDecoded.erase(mi);
+            queue.nConnected++;
+            queue.nQueuedBytes -= decoded.second;
+            queue.condRead.notify_one();
+        }
+
+        if (decoded.first)
+        {
+            LOCK(cs_main);
+            if (ProcessBlock(NULL, decoded.first))
+                nLoaded++;
+        }
+        delete decoded.first;
+        nRecords++;
+        nBytes += decoded.second;
+
+        int64 nNow = GetTimeMillis();
+        if (nNow - nLastStats >= 10000)
+        {
+            double dSeconds = (nNow - nStart) / 1000.0;
+            printf("Imported %d blocks (%.1f%% of file), %.1f blocks/s, %.2f MB/s\n",
+                   nLoaded, 100.0 * nBytes / mapping->size(), nRecords / dSeconds, nBytes / dSeconds / 1000000.0);
+            nLastStats = nNow;
+        }
+    }
+
+    {
+        boost::unique_lock<boost::mutex> lock(queue.mutex);
+        queue.fStop = true;
+        queue.condRead.notify_all();
+        queue.condDecode.notify_all();
+    }
+    threadGroup.join_all();
+    for (std::map<unsigned int, std::pair<CBlock*, unsigned int> >::iterator mi = queue.mapDecoded.begin(); mi != queue.mapDecoded.end(); ++mi)
+        delete (*mi).second.first;
+
+    int64 nElapsed = std::max(GetTimeMillis() - nStart, (int64)1);
+    printf("Loaded %i blocks from external file in %"PRI64d"ms, %.1f blocks/s, %.2f MB/s\n",
+           nLoaded, nElapsed, nRecords * 1000.0 / nElapsed, nBytes / 1000.0 / nElapsed);
+    return true;
+}
+
+// Set once LoadMempool() ran, so a shutdown during startup does not
+// overwrite mempool.dat with an empty pool
+static bool fMempoolLoaded = false;
+
+// Append hash to vtx after the memory pool transactions it spends
+static void SortMempoolForDump(const uint256& hash, set<uint256>& setDone, vector<CTransaction>& vtx)
+{
+    if (!setDone.insert(hash).second)
+        return;
+    BOOST_FOREACH(const uint256& hashDependsOn, mempool.mapEntry[hash].setDependsOn)
+        SortMempoolForDump(hashDependsOn, setDone, vtx);
+    vtx.push_back(mempool.mapTx[hash]);
+}
+
+bool DumpMempool()
+{
+    if (!fMempoolLoaded)
+        return false;
+    int64 nStart = GetTimeMillis();
+
+    vector<CTransaction> vtx;
+    {
+        LOCK(mempool.cs);
+        set<uint256> setDone;
+        vtx.reserve(mempool.mapTx.size());
+        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+            SortMempoolForDump((*mi).first, setDone, vtx);
+    }
+
+    // serialize transactions, checksum data up to that point, then append csum
+    CDataStream ssMempool(SER_DISK, CLIENT_VERSION);
+    ssMempool << FLATDATA(pchMessageStart);
+    ssMempool << vtx;
+    uint256 hash = Hash(ssMempool.begin(), ssMempool.end());
+    ssMempool << hash;
+
+    boost::filesystem::path pathMempool = GetDataDir() / "mempool.dat";
+    boost::filesystem::path pathTmp = GetDataDir() / "mempool.dat.new";
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("DumpMempool() : open failed");
+    try {
+        fileout << ssMempool;
+    }
+    catch (std::exception &e) {
+        return error("DumpMempool() : I/O error");
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+    if (!RenameOver(pathTmp, pathMempool))
+        return error("DumpMempool() : Rename-into-place failed");
+
+    printf("Dumped %"PRIszu" memory pool transactions in %"PRI64d"ms\n", vtx.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+bool LoadMempool()
+{
+    int64 nStart = GetTimeMillis();
+    fMempoolLoaded = true;
+
+    boost::filesystem::path pathMempool = GetDataDir() / "mempool.dat";
+    FILE *file = fopen(pathMempool.string().c_str(), "rb");
+    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return false;
+
+    int nFileSize = GetFilesize(filein);
+    int nDataSize = nFileSize - sizeof(uint256);
+    if (nDataSize < (int)sizeof(pchMessageStart))
+        return error("LoadMempool() : file too short");
+    vector<unsigned char> vchData(nDataSize);
+    uint256 hashIn;
+    try {
+        filein.read((char *)&vchData[0], nDataSize);
+        filein >> hashIn;
+    }
+    catch (std::exception &e) {
+        return error("LoadMempool() : I/O error or stream data corrupted");
+    }
+    filein.fclose();
+
+    CDataStream ssMempool(vchData, SER_DISK, CLIENT_VERSION);
+    if (hashIn != Hash(ssMempool.begin(), ssMempool.end()))
+        return error("LoadMempool() : checksum mismatch; data corrupted");
+
+    vector<CTransaction> vtx;
+    unsigned char pchMsgTmp[4];
+    try {
+        ssMempool >> FLATDATA(pchMsgTmp);
+        if (memcmp(pchMsgTmp, pchMessageStart, sizeof(pchMsgTmp)))
+            return error("LoadMempool() : invalid network magic number");
+        ssMempool >> vtx;
+    }
+    catch (std::exception &e) {
+        return error("LoadMempool() : I/O error or stream data corrupted");
+    }
+
+    // These passed the signature checks when they first entered the pool and
+    // the file is checksummed, so only the inputs are checked again: they
+    // may have been spent by blocks since
+    int nLoaded = 0;
+    {
+        LOCK(cs_main);
+        CTxDB txdb("r");
+        BOOST_FOREACH(CTransaction& tx, vtx)
+        {
+            if (fRequestShutdown)
+                break;
+            if (mempool.accept(txdb, tx, true, NULL, false))
+                nLoaded++;
+        }
+    }
+    printf("Loaded %d of %"PRIszu" memory pool transactions in %"PRI64d"ms\n", nLoaded, vtx.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
 
 
 
@@ -3112,7 +3756,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
     else if (strCommand == "verack")
     {
-        pfrom->vRecv.SetVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+        pfrom->SetRecvVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
     }
 
 
@@ -3625,89 +4269,22 @@ bool ProcessMessages(CNode* pfrom)
           printf("ProcessMessages: %s\n",
                  pfrom->addr.ToString().c_str());
     }
-    CDataStream& vRecv = pfrom->vRecv;
-    if (vRecv.empty()) {
-        /*
-        if (fDebug) {
-             printf("ProcessMessages: %s message empty\n",
-                    pfrom->addr.ToString().c_str());
-        }
-        */
-        return true;
-    }
-    //if (fDebug)
-    //    printf("ProcessMessages(%u bytes)\n", vRecv.size());
-
-    //
-    // Message format
-    //  (4) message start
-    //  (12) command
-    //  (4) size
-    //  (4) checksum
-    //  (x) data
-    //
-
-    loop
+    // The socket thread splits the received bytes into messages and checks
+    // their checksums; only complete messages at the front are handled here.
+    // The last one in the queue may still be arriving.
+    deque<CNetMessage>& vRecvMsg = pfrom->vRecvMsg;
+    while (!vRecvMsg.empty() && vRecvMsg.front().fComplete)
     {
         // Don't bother if send buffer is too full to respond anyway
         if (pfrom->vSend.size() >= SendBufferSize())
             break;
 
-        // Scan for message start
-        CDataStream::iterator pstart = search(vRecv.begin(), vRecv.end(), BEGIN(pchMessageStart), END(pchMessageStart));
-        int nHeaderSize = vRecv.GetSerializeSize(CMessageHeader());
-        if (vRecv.end() - pstart < nHeaderSize)
-        {
-            if ((int)vRecv.size() > nHeaderSize)
-            {
-                printf("\n\nPROCESSMESSAGE MESSAGESTART NOT FOUND\n\n");
-                vRecv.erase(vRecv.begin(), vRecv.end() - nHeaderSize);
-            }
-            break;
-        }
-        if (pstart - vRecv.begin() > 0)
-            printf("\n\nPROCESSMESSAGE SKIPPED %"PRIpdd" BYTES\n\n", pstart - vRecv.begin());
-        vRecv.erase(vRecv.begin(), pstart);
-
-        // Read header
-        vector<char> vHeaderSave(vRecv.begin(), vRecv.begin() + nHeaderSize);
-        CMessageHeader hdr;
-        vRecv >> hdr;
-        if (!hdr.IsValid())
-        {
-            printf("\n\nPROCESSMESSAGE: ERRORS IN HEADER %s\n\n\n", hdr.GetCommand().c_str());
-            continue;
-        }
-        string strCommand = hdr.GetCommand();
-
-        // Message size
-        unsigned int nMessageSize = hdr.nMessageSize;
-        if (nMessageSize > MAX_SIZE)
-        {
-            printf("ProcessMessages(%s, %u bytes) : nMessageSize > MAX_SIZE\n", strCommand.c_str(), nMessageSize);
-            continue;
-        }
-        if (nMessageSize > vRecv.size())
-        {
-            // Rewind and wait for rest of message
-            vRecv.insert(vRecv.begin(), vHeaderSave.begin(), vHeaderSave.end());
-            break;
-        }
-
-        // Checksum
-        uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        if (nChecksum != hdr.nChecksum)
-        {
-            printf("ProcessMessages(%s, %u bytes) : CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n",
-               strCommand.c_str(), nMessageSize, nChecksum, hdr.nChecksum);
-            continue;
-        }
-
-        // Copy message to its own buffer
-        CDataStream vMsg(vRecv.begin(), vRecv.begin() + nMessageSize, vRecv.nType, vRecv.nVersion);
-        vRecv.ignore(nMessageSize);
+        CNetMessage& msg = vRecvMsg.front();
+        string strCommand = msg.strCommand;
+        unsigned int nMessageSize = msg.vRecv.size();
+        CDataStream& vMsg = msg.vRecv;
+        // A version negotiated after the message arrived applies to it too
+        vMsg.SetVersion(pfrom->nRecvVersion);
 
         // Process message
         bool fRet = false;
@@ -3745,9 +4322,15 @@ bool ProcessMessages(CNode* pfrom)
 
         if (!fRet)
             printf("ProcessMessage(%s, %u bytes) FAILED\n", strCommand.c_str(), nMessageSize);
+
+        vRecvMsg.pop_front();
+
+        // Misbehaving() may have disconnected the peer; the socket thread
+        // drops the rest of its queue
+        if (pfrom->fDisconnect)
+            break;
     }
 
-    vRecv.Compact();
     return true;
 }
 
@@ -4104,63 +4687,36 @@ CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake)
             if (tx.IsCoinBase() || tx.IsCoinStake() || !tx.IsFinal())
                 continue;
 
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            int64 nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            // Fee and priority inputs were worked out when the transaction
+            // entered the pool; only those whose inputs moved since are read
+            if (!mempool.FetchEntryInputs(txdb, (*mi).first))
             {
-                // Read prev transaction
-                CTransaction txPrev;
-                CTxIndex txindex;
-                if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        printf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                int64 nValueIn = txPrev.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = txindex.GetDepthInMainChain();
-                dPriority += (double)nValueIn * nConf;
+                // This should never happen; all transactions in the memory
+                // pool should connect to either transactions in the chain
+                // or other transactions in the memory pool.
+                printf("ERROR: mempool transaction missing input\n");
+                if (fDebug) assert("mempool transaction missing input" == 0);
+                continue;
             }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority /= nTxSize;
+            const CTxMemPoolEntry& entry = mempool.mapEntry[(*mi).first];
+            double dPriority = entry.GetPriority(pindexPrev->nHeight);
 
             // This is a more accurate fee-per-kilobyte than is used by the client code, because the
             // client code rounds up the size to the nearest 1K. That's good, because it gives an
             // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
+            double dFeePerKb = entry.GetFeePerKb();
 
-            if (porphan)
+            if (!entry.setDependsOn.empty())
             {
+                // Has to wait for dependencies
+                // Use list for automatic deletion
+                vOrphan.push_back(COrphan(&tx));
+                COrphan* porphan = &vOrphan.back();
+                porphan->setDependsOn = entry.setDependsOn;
                 porphan->dPriority = dPriority;
                 porphan->dFeePerKb = dFeePerKb;
+                BOOST_FOREACH(const uint256& hashDependsOn, entry.setDependsOn)
+                    mapDependers[hashDependsOn].push_back(porphan);
             }
             else
                 vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second));
@@ -4483,10 +5039,37 @@ void BitcoinMiner(CWallet *pwallet, bool fProofOfStake)
         uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
 	uint256 hash;
 
+        // Nonces are tried HASH9_MAX_LANES at a time so Hash9xN can run the
+        // X13 stages across all of them at once
+        static const unsigned int nHeaderSize = CBlock::HEADER_SIZE;
+        unsigned char pheaders[HASH9_MAX_LANES][nHeaderSize];
+        const unsigned char* ppheaders[HASH9_MAX_LANES];
+        uint256 phashes[HASH9_MAX_LANES];
+        for (unsigned int i = 0; i < HASH9_MAX_LANES; i++)
+            ppheaders[i] = pheaders[i];
+
         loop
         {
-	    hash = pblock->GetHash();
-            if (hash <= hashTarget){
+            bool fFound = false;
+            for (unsigned int i = 0; i < HASH9_MAX_LANES; i++)
+            {
+                unsigned int nNonce = pblock->nNonce + i;
+                memcpy(pheaders[i], BEGIN(pblock->nVersion), nHeaderSize);
+                memcpy(pheaders[i] + nHeaderSize - sizeof(nNonce), &nNonce, sizeof(nNonce));
+            }
+            Hash9xN(ppheaders, nHeaderSize, HASH9_MAX_LANES, phashes);
+            for (unsigned int i = 0; i < HASH9_MAX_LANES; i++)
+            {
+                if (phashes[i] <= hashTarget)
+                {
+                    pblock->nNonce += i;
+                    hash = phashes[i];
+                    fFound = true;
+                    break;
+                }
+            }
+
+            if (fFound){
                 // nHashesDone += pblock->nNonce;
                 if (!pblock->SignBlock(*pwalletMain))
                     break;
@@ -4500,7 +5083,6 @@ void BitcoinMiner(CWallet *pwallet, bool fProofOfStake)
                 SetThreadPriority(THREAD_PRIORITY_LOWEST);
                 break;
             }
-            ++pblock->nNonce;
 
 
             // Meter hashes/sec
@@ -4511,7 +5093,7 @@ void BitcoinMiner(CWallet *pwallet, bool fProofOfStake)
                 nHashCounter = 0;
             }
             else
-                nHashCounter += 1;
+                nHashCounter += HASH9_MAX_LANES;
 
             if (GetTimeMillis() - nHPSTimerStart > 4000)
             {
@@ -4539,7 +5121,8 @@ void BitcoinMiner(CWallet *pwallet, bool fProofOfStake)
                 return;
             if (vNodes.empty())
                 break;
-            if (++pblock->nNonce >= 0xffff0000)
+            pblock->nNonce += HASH9_MAX_LANES;
+            if (pblock->nNonce >= 0xffff0000)
                 break;
             if (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60)
                 break;
@@ -11,6 +11,7 @@
 #include "script.h"
 #include "scrypt.h"
 #include "hashblock.h"
+#include "blockfile.h"
 
 #include <list>
 
@@ -33,6 +34,8 @@ static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
 static const unsigned int MAX_INV_SZ = 50000;
 static const int64 MIN_TX_FEE = 1 * CENT;
 static const int64 MIN_RELAY_TX_FEE = 1 * CENT;
+/** Default for -maxmempool, the memory pool size limit in megabytes */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
 // MAX_MONEY is for consistency checking
 // The actual PoW coins is about 23,300,000
 // This number will go up over time.
@@ -64,6 +67,9 @@ static const uint256 hashGenesisBlockTestNet ("0x000001cb93b0d2049c9882f62cc1f84
 
 static const int64 nMaxClockDrift = 2 * 60 * 60;        // two hours
 
+// Maximum number of script-checking threads allowed
+static const int MAX_SCRIPTCHECK_THREADS = 16;
+
 
 extern CScript COINBASE_FLAGS;
 
@@ -76,8 +82,8 @@ extern CBlockIndex* pindexGenesisBlock;
 extern unsigned int nStakeMinAge;
 extern int nCoinbaseMaturity;
 extern int nBestHeight;
-extern CBigNum bnBestChainTrust;
-extern CBigNum bnBestInvalidTrust;
+extern uint256 nBestChainTrust;
+extern uint256 nBestInvalidTrust;
 extern uint256 hashBestChain;
 extern CBlockIndex* pindexBest;
 extern unsigned int nTransactionsUpdated;
@@ -88,6 +94,11 @@ extern const std::string strMessageMagic;
 extern double dHashesPerSec;
 extern int64 nHPSTimerStart;
 extern int64 nTimeBestReceived;
+extern int nScriptCheckThreads;
+extern uint64 nMaxMempoolUsage;
+extern bool fTxIndexCompact;
+extern CStatCounter nBlockHashComputed;
+extern CStatCounter nBlockHashCached;
 extern CCriticalSection cs_setpwalletRegistered;
 extern std::set<CWallet*> setpwalletRegistered;
 extern unsigned char pchMessageStart[4];
@@ -106,12 +117,14 @@ static const CBigNum MAX_COIN_SECONDS = 9 * 24 * 60 * 60;
 class CReserveKey;
 class CTxDB;
 class CTxIndex;
+class CScriptCheck;
 
 void RegisterWallet(CWallet* pwalletIn);
 void UnregisterWallet(CWallet* pwalletIn);
 void SyncWithWallets(const CTransaction& tx, const CBlock* pblock = NULL, bool fUpdate = false, bool fConnect = true);
 bool ProcessBlock(CNode* pfrom, CBlock* pblock);
 bool CheckDiskSpace(uint64 nAdditionalBytes=0);
+boost::filesystem::path BlockFilePath(unsigned int nFile);
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
 FILE* AppendBlockFile(unsigned int& nFileRet);
 bool LoadBlockIndex(bool fAllowNew=true);
@@ -119,7 +132,9 @@ void PrintBlockTree();
 CBlockIndex* FindBlockByHeight(int nHeight);
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
-bool LoadExternalBlockFile(FILE* fileIn);
+bool LoadExternalBlockFile(const boost::filesystem::path& path);
+bool LoadMempool();
+bool DumpMempool();
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet);
 CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake=false);
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
@@ -138,6 +153,12 @@ uint256 WantedByOrphan(const CBlock* pblockOrphan);
 const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfStake);
 void BitcoinMiner(CWallet *pwallet, bool fProofOfStake);
 void ResendWalletTransactions();
+/** Run an instance of the script checking thread */
+void ThreadScriptCheck(void* parg);
+/** Wake the script checking threads so they exit */
+void StopScriptCheckThreads();
+/** Verify the last -checkblocks blocks while the node is running */
+void ThreadVerifyBlocks(void* parg);
 
 
 
@@ -186,6 +207,36 @@ public:
         return !(a == b);
     }
 
+    // Varint form used by CTxIndex: a transaction normally follows its block
+    // header closely, so nTxPos is stored relative to nBlockPos
+    uint64 GetCompactTxPos() const
+    {
+        return nTxPos >= nBlockPos ? (uint64)(nTxPos - nBlockPos) << 1 : ((uint64)nTxPos << 1) | 1;
+    }
+
+    unsigned int GetCompactSize() const
+    {
+        return GetSizeOfVarInt(nFile + 1) + GetSizeOfVarInt(nBlockPos) + GetSizeOfVarInt(GetCompactTxPos());
+    }
+
+    template<typename Stream>
+    void WriteCompact(Stream& s) const
+    {
+        WriteVarInt(s, nFile + 1); // null becomes 0
+        WriteVarInt(s, nBlockPos);
+        WriteVarInt(s, GetCompactTxPos());
+    }
+
+    template<typename Stream>
+    void ReadCompact(Stream& s)
+    {
+        nFile = ReadVarInt<Stream, unsigned int>(s) - 1;
+        nBlockPos = ReadVarInt<Stream, unsigned int>(s);
+        uint64 nCompactTxPos = ReadVarInt<Stream, uint64>(s);
+        if ((nCompactTxPos >> 1) > std::numeric_limits<unsigned int>::max())
+            THROW_WITH_STACKTRACE(std::ios_base::failure("CDiskTxPos::ReadCompact() : position out of range"));
+        nTxPos = (nCompactTxPos & 1) ? (nCompactTxPos >> 1) : nBlockPos + (nCompactTxPos >> 1);
+    }
 
     std::string ToString() const
     {
@@ -617,6 +668,9 @@ public:
 
     bool ReadFromDisk(CDiskTxPos pos, FILE** pfileRet=NULL)
     {
+        if (!pfileRet && blockfilemap.Read(pos.nFile, pos.nTxPos, *this))
+            return true;
+
         CAutoFile filein = CAutoFile(OpenBlockFile(pos.nFile, 0, pfileRet ? "rb+" : "rb"), SER_DISK, CLIENT_VERSION);
         if (!filein)
             return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
@@ -717,11 +771,13 @@ public:
         @param[in] fBlock	true if called from ConnectBlock
         @param[in] fMiner	true if called from CreateNewBlock
         @param[in] fStrictPayToScriptHash	true if fully validating p2sh transactions
+        @param[out] pvChecks	if not NULL, script checks are appended here instead of being executed
         @return Returns true if all checks succeed
      */
     bool ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
                        std::map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash=true);
+                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, bool fStrictPayToScriptHash=true,
+                       std::vector<CScriptCheck>* pvChecks = NULL);
     bool ClientConnectInputs();
     bool CheckTransaction() const;
     bool AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs=true, bool* pfMissingInputs=NULL);
@@ -732,6 +788,36 @@ protected:
 };
 
 
+/** Closure representing one script verification.
+ *  Note that this stores references to the spending transaction. */
+class CScriptCheck
+{
+private:
+    CScript scriptPubKey;
+    const CTransaction* ptxTo;
+    unsigned int nIn;
+    bool fStrictPayToScriptHash;
+    int nHashType;
+
+public:
+    CScriptCheck() {}
+    CScriptCheck(const CTransaction& txFromIn, const CTransaction& txToIn, unsigned int nInIn, bool fStrictPayToScriptHashIn, int nHashTypeIn) :
+        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
+        ptxTo(&txToIn), nIn(nInIn), fStrictPayToScriptHash(fStrictPayToScriptHashIn), nHashType(nHashTypeIn) { }
+
+    bool operator()() const;
+
+    void swap(CScriptCheck& check)
+    {
+        scriptPubKey.swap(check.scriptPubKey);
+        std::swap(ptxTo, check.ptxTo);
+        std::swap(nIn, check.nIn);
+        std::swap(fStrictPayToScriptHash, check.fStrictPayToScriptHash);
+        std::swap(nHashType, check.nHashType);
+    }
+};
+
+
 
 
 
@@ -790,10 +876,20 @@ public:
 /**  A txdb record that contains the disk location of a transaction and the
  * locations of transactions that spend its outputs.  vSpent is really only
  * used as a flag, but having the location is very helpful for debugging.
+ *
+ * On disk the record is compact: a marker, the varint position, the number
+ * of outputs, a bitmap of the spent ones and the positions of only those.
+ * A fresh record for a two-output transaction takes about 13 bytes
+ * instead of 41.
+ * Records in the original format (client version, pos, vSpent) are still
+ * read, and written until the index is converted with -compacttxindex
+ * (fTxIndexCompact); CTxDB::CompactTxIndex() converts them.
  */
 class CTxIndex
 {
 public:
+    static const int COMPACT_MARKER = -1;
+
     CDiskTxPos pos;
     std::vector<CDiskTxPos> vSpent;
 
@@ -808,13 +904,101 @@ public:
         vSpent.resize(nOutputs);
     }
 
-    IMPLEMENT_SERIALIZE
-    (
-        if (!(nType & SER_GETHASH))
-            READWRITE(nVersion);
-        READWRITE(pos);
-        READWRITE(vSpent);
-    )
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        if (nType & SER_GETHASH)
+            return ::GetSerializeSize(pos, nType, nVersion) + ::GetSerializeSize(vSpent, nType, nVersion);
+        if (!fTxIndexCompact)
+            return sizeof(int) + ::GetSerializeSize(pos, nType, nVersion) + ::GetSerializeSize(vSpent, nType, nVersion);
+        unsigned int nSize = sizeof(int) + pos.GetCompactSize() + GetSizeOfVarInt(vSpent.size()) + (vSpent.size() + 7) / 8;
+        BOOST_FOREACH(const CDiskTxPos& posSpent, vSpent)
+            if (!posSpent.IsNull())
+                nSize += posSpent.GetCompactSize();
+        return nSize;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        if (nType & SER_GETHASH)
+        {
+            ::Serialize(s, pos, nType, nVersion);
+            ::Serialize(s, vSpent, nType, nVersion);
+            return;
+        }
+        if (!fTxIndexCompact)
+        {
+            // Original format, readable by older clients
+            WRITEDATA(s, nVersion);
+            ::Serialize(s, pos, nType, nVersion);
+            ::Serialize(s, vSpent, nType, nVersion);
+            return;
+        }
+        int nMarker = COMPACT_MARKER;
+        WRITEDATA(s, nMarker);
+        pos.WriteCompact(s);
+        WriteVarInt(s, vSpent.size());
+        for (unsigned int i = 0; i < vSpent.size(); i += 8)
+        {
+            unsigned char chBits = 0;
+            for (unsigned int j = i; j < i + 8 && j < vSpent.size(); j++)
+                if (!vSpent[j].IsNull())
+                    chBits |= 1 << (j - i);
+            WRITEDATA(s, chBits);
+        }
+        BOOST_FOREACH(const CDiskTxPos& posSpent, vSpent)
+            if (!posSpent.IsNull())
+                posSpent.WriteCompact(s);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        if (nType & SER_GETHASH)
+        {
+            ::Unserialize(s, pos, nType, nVersion);
+            ::Unserialize(s, vSpent, nType, nVersion);
+            return;
+        }
+        int nMarker;
+        READDATA(s, nMarker);
+        if (nMarker != COMPACT_MARKER)
+        {
+            // Original format, nMarker is the version that wrote it
+            ::Unserialize(s, pos, nType, nMarker);
+            ::Unserialize(s, vSpent, nType, nMarker);
+            return;
+        }
+        pos.ReadCompact(s);
+        uint64 nOutputs = ReadVarInt<Stream, uint64>(s);
+        if (nOutputs > MAX_BLOCK_SIZE)
+            THROW_WITH_STACKTRACE(std::ios_base::failure("CTxIndex::Unserialize() : too many outputs"));
+        vSpent.assign(nOutputs, CDiskTxPos());
+        unsigned char pchBits[32];
+        std::vector<unsigned char> vSpentBits;
+        unsigned char* pBits = pchBits;
+        if (nOutputs > 8 * sizeof(pchBits))
+        {
+            vSpentBits.resize((nOutputs + 7) / 8);
+            pBits = &vSpentBits[0];
+        }
+        if (nOutputs > 0)
+            s.read((char*)pBits, (nOutputs + 7) / 8);
+        for (unsigned int i = 0; i < nOutputs; i++)
+            if (pBits[i / 8] & (1 << (i % 8)))
+                vSpent[i].ReadCompact(s);
+    }
+
+    /** Whether a serialized record is in the original, uncompacted format */
+    template<typename Stream>
+    static bool IsLegacyFormat(const Stream& s)
+    {
+        int nMarker;
+        if (s.size() < sizeof(nMarker))
+            return false;
+        memcpy(&nMarker, &s[0], sizeof(nMarker));
+        return nMarker != COMPACT_MARKER;
+    }
 
     void SetNull()
     {
@@ -876,6 +1060,19 @@ public:
     // memory only
     mutable std::vector<uint256> vMerkleTree;
 
+    // memory only: last header hashed by GetHash() and its hash.  The header
+    // fields are public and assigned directly all over the code, so the cache
+    // is validated against a copy of the header instead of being invalidated
+    // by setters.
+    static const unsigned int HEADER_SIZE = 80;
+    mutable bool fHashCached;
+    mutable unsigned char pchHashedHeader[HEADER_SIZE];
+    mutable uint256 hashCached;
+
+    // memory only: CheckBlock() passed with all its checks.  Cleared when a
+    // block is read into the object.
+    mutable bool fChecked;
+
     // Denial-of-service detection:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
@@ -887,6 +1084,8 @@ public:
 
     IMPLEMENT_SERIALIZE
     (
+        if (fRead)
+            fChecked = false;
         READWRITE(this->nVersion);
         nVersion = this->nVersion;
         READWRITE(hashPrevBlock);
@@ -919,6 +1118,8 @@ public:
         vtx.clear();
         vchBlockSig.clear();
         vMerkleTree.clear();
+        fHashCached = false;
+        fChecked = false;
         nDoS = 0;
     }
 
@@ -929,7 +1130,16 @@ public:
 
     uint256 GetHash() const
     {
-        return Hash9(BEGIN(nVersion), END(nNonce));
+        if (fHashCached && memcmp(pchHashedHeader, BEGIN(nVersion), HEADER_SIZE) == 0)
+        {
+            nBlockHashCached.inc();
+            return hashCached;
+        }
+        memcpy(pchHashedHeader, BEGIN(nVersion), HEADER_SIZE);
+        hashCached = Hash9(BEGIN(nVersion), END(nNonce));
+        fHashCached = true;
+        nBlockHashComputed.inc();
+        return hashCached;
     }
 
     int64 GetBlockTime() const
@@ -1055,6 +1265,15 @@ public:
     {
         SetNull();
 
+        // Read straight from the mapped file, unless it cannot be mapped
+        if (blockfilemap.Read(nFile, nBlockPos, *this, fReadTransactions ? SER_DISK : SER_DISK | SER_BLOCKHEADERONLY))
+        {
+            if (fReadTransactions && IsProofOfWork() && !CheckProofOfWork(GetHash(), nBits))
+                return error("CBlock::ReadFromDisk() : errors in block header");
+            return true;
+        }
+        SetNull();
+
         // Open history file to read
         CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), SER_DISK, CLIENT_VERSION);
         if (!filein)
@@ -1136,7 +1355,7 @@ public:
     CBlockIndex* pnext;
     unsigned int nFile;
     unsigned int nBlockPos;
-    CBigNum bnChainTrust; // ppcoin: trust score of block chain
+    uint256 nChainTrust; // ppcoin: trust score of block chain
     int nHeight;
 
     int64 nMint;
@@ -1173,7 +1392,7 @@ public:
         nFile = 0;
         nBlockPos = 0;
         nHeight = 0;
-        bnChainTrust = 0;
+        nChainTrust = 0;
         nMint = 0;
         nMoneySupply = 0;
         nFlags = 0;
@@ -1198,7 +1417,7 @@ public:
         nFile = nFileIn;
         nBlockPos = nBlockPosIn;
         nHeight = 0;
-        bnChainTrust = 0;
+        nChainTrust = 0;
         nMint = 0;
         nMoneySupply = 0;
         nFlags = 0;
@@ -1247,7 +1466,7 @@ public:
         return (int64)nTime;
     }
 
-    CBigNum GetBlockTrust() const;
+    uint256 GetBlockTrust() const;
 
     bool IsInMainChain() const
     {
@@ -1412,6 +1631,13 @@ public:
 
     uint256 GetBlockHash() const
     {
+        // Records built from a live CBlockIndex already know their hash
+        if (phashBlock)
+        {
+            nBlockHashCached.inc();
+            return *phashBlock;
+        }
+
         CBlock block;
         block.nVersion        = nVersion;
         block.hashPrevBlock   = hashPrev;
@@ -1442,8 +1668,54 @@ public:
 
 
 
+/** The blocks of the best chain indexed by height, kept in step with the
+ * pnext links, so height and ancestor lookups on it need no chain walk.
+ * Callers hold cs_main.
+ */
+class CChain
+{
+private:
+    std::vector<CBlockIndex*> vChain;
+    std::vector<int> vLastProofOfStake; // height of the last proof-of-stake block up to each height, -1 if none
+    std::vector<int> vLastProofOfWork;
+
+public:
+    CBlockIndex* Genesis() const
+    {
+        return vChain.empty() ? NULL : vChain[0];
+    }
+
+    CBlockIndex* Tip() const
+    {
+        return vChain.empty() ? NULL : vChain.back();
+    }
+
+    int Height() const
+    {
+        return vChain.size() - 1;
+    }
+
+    CBlockIndex* operator[](int nHeight) const
+    {
+        if (nHeight < 0 || nHeight >= (int)vChain.size())
+            return NULL;
+        return vChain[nHeight];
+    }
+
+    bool Contains(const CBlockIndex* pindex) const
+    {
+        return (*this)[pindex->nHeight] == pindex;
+    }
+
+    // Last block up to pindex of the given kind, or the genesis block if
+    // there is none; as the pprev walk of GetLastBlockIndex()
+    const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfStake) const;
 
+    // Make pindex the tip, dropping the blocks after the fork
+    void SetTip(CBlockIndex* pindex);
+};
 
+extern CChain chainActive;
 
 
 
@@ -1503,9 +1775,15 @@ public:
         {
             vHave.push_back(pindex->GetBlockHash());
 
-            // Exponentially larger steps back
-            for (int i = 0; pindex && i < nStep; i++)
+            // Exponentially larger steps back; once on the best chain the
+            // step is a lookup by height
+            int nHeight = pindex->nHeight - nStep;
+            if (nHeight < 0)
+                break;
+            while (pindex->nHeight > nHeight && !chainActive.Contains(pindex))
                 pindex = pindex->pprev;
+            if (pindex->nHeight > nHeight)
+                pindex = chainActive[nHeight];
             if (vHave.size() > 10)
                 nStep *= 2;
         }
@@ -1581,20 +1859,84 @@ public:
 
 
 
+/** What block assembly needs to know about a memory pool transaction,
+ * worked out once when it enters the pool instead of from disk for every
+ * new block.
+ */
+class CTxMemPoolEntry
+{
+public:
+    unsigned int nTxSize;
+    uint64 nUsage;           // estimated memory used by the transaction and its pool entries
+    bool fInputs;            // the fields below are up to date; nFee stays
+                             // valid once filled in
+    int64 nFee;
+    int64 nValueInChain;     // value of the inputs from the block chain
+    double dPriorityInChain; // sum of their value * confirmations at nHeight
+    int nHeight;
+    std::set<uint256> setDependsOn; // memory pool transactions this one spends
+    std::set<uint256> setDependers; // memory pool transactions spending this one
+
+    CTxMemPoolEntry()
+    {
+        nTxSize = 0;
+        nUsage = 0;
+        fInputs = false;
+        nFee = 0;
+        nValueInChain = 0;
+        dPriorityInChain = 0;
+        nHeight = 0;
+    }
+
+    // Fill in the fee and priority inputs from the inputs of tx
+    void SetInputs(const CTransaction& tx, MapPrevTx& mapInputs);
+
+    // Priority is sum(valuein * age) / txsize; the chain inputs age a block
+    // per block since nHeight, the memory pool inputs do not count
+    double GetPriority(int nBestHeightIn) const
+    {
+        return (dPriorityInChain + (double)nValueInChain * (nBestHeightIn - nHeight)) / nTxSize;
+    }
+
+    double GetFeePerKb() const
+    {
+        return double(nFee) / (double(nTxSize) / 1000.0);
+    }
+};
+
 class CTxMemPool
 {
 public:
     mutable CCriticalSection cs;
     std::map<uint256, CTransaction> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
+    std::map<uint256, CTxMemPoolEntry> mapEntry;
+    std::set<std::pair<double, uint256> > setFeePerKb; // all entries by fee rate, those never filled in at 0
+    uint64 nTotalUsage;
 
+    CTxMemPool()
+    {
+        nTotalUsage = 0;
+    }
+
+    // fCheckScripts=false skips the signature checks of a transaction this
+    // node verified before, as when reloading mempool.dat
     bool accept(CTxDB& txdb, CTransaction &tx,
-                bool fCheckInputs, bool* pfMissingInputs);
+                bool fCheckInputs, bool* pfMissingInputs, bool fCheckScripts=true);
     bool addUnchecked(const uint256& hash, CTransaction &tx);
+    bool addUnchecked(const uint256& hash, CTransaction &tx, MapPrevTx& mapInputs);
     bool remove(CTransaction &tx);
+    unsigned int removeWithDependers(const uint256& hash);
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
 
+    // Fill in the entry of a transaction added without its inputs
+    bool FetchEntryInputs(CTxDB& txdb, const uint256& hash);
+
+    // Evict the lowest fee rate transactions, with the transactions spending
+    // them, until the pool uses no more than nUsageLimit bytes
+    unsigned int TrimToSize(uint64 nUsageLimit);
+
     unsigned long size()
     {
         LOCK(cs);
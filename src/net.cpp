@@ -5,6 +5,7 @@
 
 #include "irc.h"
 #include "db.h"
+#include "kernel.h"
 #include "net.h"
 #include "init.h"
 #include "strlcpy.h"
@@ -16,6 +17,13 @@
 #include <string.h>
 #endif
 
+#ifdef __linux__
+#include <sys/epoll.h>
+#define USE_EPOLL
+#endif
+
+#include <boost/scoped_ptr.hpp>
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniwget.h>
 #include <miniupnpc/miniupnpc.h>
@@ -83,6 +91,20 @@ CCriticalSection cs_setservAddNodeAddresses;
 
 static CSemaphore *semOutbound = NULL;
 
+// Set when the message handler has work, cleared when it picks it up
+static boost::mutex mutexMsgHandler;
+static boost::condition_variable condMsgHandler;
+static bool fMsgHandlerWake = false;
+
+void WakeMessageHandler()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutexMsgHandler);
+        fMsgHandlerWake = true;
+    }
+    condMsgHandler.notify_one();
+}
+
 void AddOneShot(string strDest)
 {
     LOCK(cs_vOneShots);
@@ -541,6 +563,102 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest, int64 nTimeout)
     }
 }
 
+unsigned int CMessageAssembler::ReadHeader(const char* pch, unsigned int nBytes, int nVersion)
+{
+    unsigned int nRead = min(nBytes, (unsigned int)CMessageHeader::HEADER_SIZE - nHeaderPos);
+    memcpy(&pchHeader[nHeaderPos], pch, nRead);
+    nHeaderPos += nRead;
+
+    // Drop bytes until the buffer starts with (a prefix of) the message start
+    unsigned int nSkip = 0;
+    while (nSkip < nHeaderPos &&
+           memcmp(&pchHeader[nSkip], pchMessageStart, min(nHeaderPos - nSkip, (unsigned int)sizeof(pchMessageStart))) != 0)
+        nSkip++;
+    if (nSkip > 0)
+    {
+        memmove(pchHeader, &pchHeader[nSkip], nHeaderPos - nSkip);
+        nHeaderPos -= nSkip;
+        nSkipRun += nSkip;
+        nSkippedBytes += nSkip;
+    }
+    if (nHeaderPos < CMessageHeader::HEADER_SIZE)
+        return nRead;
+
+    if (nSkipRun > 0)
+        printf("\n\nPROCESSMESSAGE SKIPPED %u BYTES\n\n", nSkipRun);
+    nSkipRun = 0;
+    nHeaderPos = 0;
+
+    CDataStream ssHeader(pchHeader, pchHeader + CMessageHeader::HEADER_SIZE, SER_NETWORK, nVersion);
+    ssHeader >> hdr;
+    if (!hdr.IsValid())
+    {
+        printf("\n\nPROCESSMESSAGE: ERRORS IN HEADER %s\n\n\n", hdr.GetCommand().c_str());
+        nBadMessages++;
+        return nRead;
+    }
+
+    fInData = true;
+    nDataPos = 0;
+    SHA256_Init(&ctxChecksum);
+    return nRead;
+}
+
+unsigned int CMessageAssembler::Receive(const char* pch, unsigned int nBytes, deque<CNetMessage>& vMsg, int nVersion)
+{
+    unsigned int nComplete = 0;
+    while (nBytes > 0 || fInData)
+    {
+        if (!fInData)
+        {
+            unsigned int nRead = ReadHeader(pch, nBytes, nVersion);
+            pch += nRead;
+            nBytes -= nRead;
+            if (fInData)
+            {
+                vMsg.push_back(CNetMessage(SER_NETWORK, nVersion));
+                vMsg.back().strCommand = hdr.GetCommand();
+                // Grow with the data rather than trusting the stated size
+                vMsg.back().vRecv.reserve(min(hdr.nMessageSize, (unsigned int)0x10000));
+            }
+            continue;
+        }
+
+        CNetMessage& msg = vMsg.back();
+        unsigned int nRead = min(nBytes, hdr.nMessageSize - nDataPos);
+        if (nRead > 0)
+        {
+            msg.vRecv.write(pch, nRead);
+            SHA256_Update(&ctxChecksum, pch, nRead);
+            nDataPos += nRead;
+            pch += nRead;
+            nBytes -= nRead;
+        }
+        if (nDataPos < hdr.nMessageSize)
+            break;
+        fInData = false;
+
+        // Checksum
+        uint256 hash1;
+        SHA256_Final((unsigned char*)&hash1, &ctxChecksum);
+        uint256 hash2;
+        SHA256((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
+        unsigned int nChecksum = 0;
+        memcpy(&nChecksum, &hash2, sizeof(nChecksum));
+        if (nChecksum != hdr.nChecksum)
+        {
+            printf("ProcessMessages(%s, %u bytes) : CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n",
+               msg.strCommand.c_str(), hdr.nMessageSize, nChecksum, hdr.nChecksum);
+            vMsg.pop_back();
+            nBadMessages++;
+            continue;
+        }
+        msg.fComplete = true;
+        nComplete++;
+    }
+    return nComplete;
+}
+
 void CNode::CloseSocketDisconnect()
 {
     fDisconnect = true;
@@ -549,7 +667,6 @@ void CNode::CloseSocketDisconnect()
         printf("disconnecting node %s\n", addrName.c_str());
         closesocket(hSocket);
         hSocket = INVALID_SOCKET;
-        vRecv.clear();
     }
 }
 
@@ -675,6 +792,237 @@ void CNode::copyStats(CNodeStats &stats)
 
 
 
+//
+// Socket readiness. The select() engine rebuilds its descriptor sets on
+// every pass and is limited to FD_SETSIZE descriptors. The epoll engine
+// registers each socket once, edge-triggered, and only hears about the
+// sockets whose state changed. Both set fRecvReady and fSendReady on the
+// nodes that can make progress; the socket thread clears them when a call
+// would block.
+//
+class CSocketEngine
+{
+public:
+    virtual ~CSocketEngine() {}
+    virtual const char* GetName() const = 0;
+    virtual void Wait(const vector<CNode*>& vNodesCopy, set<SOCKET>& setListenReady, int nTimeoutMS) = 0;
+};
+
+class CSelectSocketEngine : public CSocketEngine
+{
+public:
+    const char* GetName() const { return "select"; }
+
+    void Wait(const vector<CNode*>& vNodesCopy, set<SOCKET>& setListenReady, int nTimeoutMS)
+    {
+        struct timeval timeout;
+        timeout.tv_sec  = 0;
+        timeout.tv_usec = nTimeoutMS * 1000;
+
+        fd_set fdsetRecv;
+        fd_set fdsetSend;
+        fd_set fdsetError;
+        FD_ZERO(&fdsetRecv);
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        SOCKET hSocketMax = 0;
+        bool have_fds = false;
+
+        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
+            FD_SET(hListenSocket, &fdsetRecv);
+            hSocketMax = max(hSocketMax, hListenSocket);
+            have_fds = true;
+        }
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        {
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            FD_SET(pnode->hSocket, &fdsetRecv);
+            FD_SET(pnode->hSocket, &fdsetError);
+            hSocketMax = max(hSocketMax, pnode->hSocket);
+            have_fds = true;
+            {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend && !pnode->vSend.empty())
+                    FD_SET(pnode->hSocket, &fdsetSend);
+            }
+        }
+
+        vnThreadsRunning[THREAD_SOCKETHANDLER]--;
+        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+        vnThreadsRunning[THREAD_SOCKETHANDLER]++;
+        if (fShutdown)
+            return;
+        if (nSelect == SOCKET_ERROR)
+        {
+            if (have_fds)
+            {
+                int nErr = WSAGetLastError();
+                printf("socket select error %d\n", nErr);
+                for (unsigned int i = 0; i <= hSocketMax; i++)
+                    FD_SET(i, &fdsetRecv);
+            }
+            FD_ZERO(&fdsetSend);
+            FD_ZERO(&fdsetError);
+            Sleep(timeout.tv_usec/1000);
+        }
+
+        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+            if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+                setListenReady.insert(hListenSocket);
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        {
+            SOCKET hSocket = pnode->hSocket;
+            if (hSocket == INVALID_SOCKET)
+                continue;
+            pnode->fRecvReady = FD_ISSET(hSocket, &fdsetRecv) || FD_ISSET(hSocket, &fdsetError);
+            pnode->fSendReady = FD_ISSET(hSocket, &fdsetSend);
+        }
+    }
+};
+
+#ifdef USE_EPOLL
+class CEpollSocketEngine : public CSocketEngine
+{
+private:
+    int hEpoll;
+    vector<struct epoll_event> vEvents;
+
+public:
+    CEpollSocketEngine()
+    {
+        hEpoll = -1;
+    }
+
+    ~CEpollSocketEngine()
+    {
+        if (hEpoll != -1)
+            close(hEpoll);
+    }
+
+    bool Init()
+    {
+        hEpoll = epoll_create(256); // only a hint
+        if (hEpoll == -1)
+            return error("CEpollSocketEngine::Init() : epoll_create failed, error %d", errno);
+
+        // Listen sockets stay level-triggered: one accept per pass
+        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+        {
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLIN;
+            ev.data.ptr = NULL;
+            if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket, &ev) == -1)
+                return error("CEpollSocketEngine::Init() : adding listen socket failed, error %d", errno);
+        }
+        return true;
+    }
+
+    const char* GetName() const { return "epoll"; }
+
+    void Wait(const vector<CNode*>& vNodesCopy, set<SOCKET>& setListenReady, int nTimeoutMS)
+    {
+        // Register new sockets. Closing a socket drops it from the set, so
+        // an event can only name a node whose socket is still open.
+        bool fPending = false;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        {
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            if (!pnode->fPolled)
+            {
+                struct epoll_event ev;
+                memset(&ev, 0, sizeof(ev));
+                ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                ev.data.ptr = pnode;
+                if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, pnode->hSocket, &ev) == -1)
+                {
+                    printf("socket epoll_ctl error %d\n", errno);
+                    pnode->fDisconnect = true;
+                    continue;
+                }
+                pnode->fPolled = true;
+                pnode->fRecvReady = true;
+                pnode->fSendReady = true;
+            }
+            // An edge is only reported once, so don't sleep while a socket
+            // that has not yet blocked still has work. A buffer held by the
+            // message handler can't be worked on; leave it to the timeout.
+            if (fPending)
+                continue;
+            if (pnode->fRecvReady)
+            {
+                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                if (lockRecv)
+                    fPending = true;
+            }
+            if (pnode->fSendReady && !fPending)
+            {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend && !pnode->vSend.empty())
+                    fPending = true;
+            }
+        }
+
+        vEvents.resize(max((size_t)64, vNodesCopy.size() + vhListenSocket.size()));
+        vnThreadsRunning[THREAD_SOCKETHANDLER]--;
+        int nEvents = epoll_wait(hEpoll, &vEvents[0], vEvents.size(), fPending ? 0 : nTimeoutMS);
+        vnThreadsRunning[THREAD_SOCKETHANDLER]++;
+        if (fShutdown)
+            return;
+        if (nEvents == -1)
+        {
+            if (errno != EINTR)
+            {
+                printf("socket epoll_wait error %d\n", errno);
+                Sleep(nTimeoutMS);
+            }
+            return;
+        }
+
+        for (int i = 0; i < nEvents; i++)
+        {
+            CNode* pnode = (CNode*)vEvents[i].data.ptr;
+            if (pnode == NULL)
+            {
+                // Accepting on a listen socket without a pending
+                // connection just fails with EWOULDBLOCK
+                BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+                    setListenReady.insert(hListenSocket);
+                continue;
+            }
+            if (vEvents[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                pnode->fRecvReady = true;
+            if (vEvents[i].events & EPOLLOUT)
+                pnode->fSendReady = true;
+        }
+    }
+};
+#endif
+
+static CSocketEngine* CreateSocketEngine()
+{
+    string strEngine = GetArg("-socketengine", "epoll");
+#ifdef USE_EPOLL
+    if (strEngine == "epoll")
+    {
+        CEpollSocketEngine* pengine = new CEpollSocketEngine();
+        if (pengine->Init())
+            return pengine;
+        delete pengine;
+        printf("Falling back to the select socket engine\n");
+    }
+#else
+    if (strEngine == "epoll")
+        printf("epoll is not available, using the select socket engine\n");
+#endif
+    else if (strEngine != "select")
+        printf("Unknown -socketengine=%s, using select\n", strEngine.c_str());
+    return new CSelectSocketEngine();
+}
+
 void ThreadSocketHandler(void* parg)
 {
     // Make this thread recognisable as the networking thread
@@ -701,6 +1049,8 @@ void ThreadSocketHandler2(void* parg)
     printf("ThreadSocketHandler started\n");
     list<CNode*> vNodesDisconnected;
     unsigned int nPrevNodeCount = 0;
+    boost::scoped_ptr<CSocketEngine> pengine(CreateSocketEngine());
+    printf("Using the %s socket engine\n", pengine->GetName());
 
     loop
     {
@@ -714,7 +1064,7 @@ void ThreadSocketHandler2(void* parg)
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
             {
                 if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecv.empty() && pnode->vSend.empty()))
+                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->vSend.empty()))
                 {
                     // remove from vNodes
                     vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
@@ -726,6 +1076,17 @@ void ThreadSocketHandler2(void* parg)
                     pnode->CloseSocketDisconnect();
                     pnode->Cleanup();
 
+                    // drop its queued messages, unless the message handler
+                    // is still reading one; they go with the node otherwise
+                    {
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv)
+                        {
+                            pnode->vRecvMsg.clear();
+                            pnode->recvAssembler.Reset();
+                        }
+                    }
+
                     // hold in disconnected pool until all refs are released
                     pnode->nReleaseTime = max(pnode->nReleaseTime, GetTime() + 15 * 60);
                     if (pnode->fNetworkNode || pnode->fInbound)
@@ -746,7 +1107,7 @@ void ThreadSocketHandler2(void* parg)
                         TRY_LOCK(pnode->cs_vSend, lockSend);
                         if (lockSend)
                         {
-                            TRY_LOCK(pnode->cs_vRecv, lockRecv);
+                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                             if (lockRecv)
                             {
                                 TRY_LOCK(pnode->cs_mapRequests, lockReq);
@@ -800,70 +1161,25 @@ void ThreadSocketHandler2(void* parg)
 
 
         //
-        // Find which sockets have data to receive
+        // Find which sockets are ready
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket);
-            have_fds = true;
-        }
+        vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
-            {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetRecv);
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSend.empty())
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                }
-            }
+            vNodesCopy = vNodes;
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->AddRef();
         }
-
-        vnThreadsRunning[THREAD_SOCKETHANDLER]--;
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        vnThreadsRunning[THREAD_SOCKETHANDLER]++;
+        set<SOCKET> setListenReady;
+        pengine->Wait(vNodesCopy, setListenReady, 50); // frequency to poll pnode->vSend
         if (fShutdown)
             return;
-        if (nSelect == SOCKET_ERROR)
-        {
-            if (have_fds)
-            {
-                int nErr = WSAGetLastError();
-                printf("socket select error %d\n", nErr);
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            Sleep(timeout.tv_usec/1000);
-        }
 
 
         //
         // Accept new connections
         //
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+        BOOST_FOREACH(SOCKET hListenSocket, setListenReady)
         {
 #ifdef USE_IPV6
             struct sockaddr_storage sockaddr;
@@ -916,13 +1232,6 @@ void ThreadSocketHandler2(void* parg)
         //
         // Service each socket
         //
-        vector<CNode*> vNodesCopy;
-        {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->AddRef();
-        }
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
             if (fShutdown)
@@ -933,17 +1242,16 @@ void ThreadSocketHandler2(void* parg)
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            if (pnode->fRecvReady)
             {
-                TRY_LOCK(pnode->cs_vRecv, lockRecv);
+                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
                 {
-                    CDataStream& vRecv = pnode->vRecv;
-                    unsigned int nPos = vRecv.size();
+                    unsigned int nRecvSize = pnode->GetTotalRecvSize();
 
-                    if (nPos > ReceiveBufferSize()) {
+                    if (nRecvSize > ReceiveBufferSize()) {
                         if (!pnode->fDisconnect)
-                            printf("socket recv flood control disconnect (%"PRIszu" bytes)\n", vRecv.size());
+                            printf("socket recv flood control disconnect (%u bytes)\n", nRecvSize);
                         pnode->CloseSocketDisconnect();
                     }
                     else {
@@ -952,8 +1260,8 @@ void ThreadSocketHandler2(void* parg)
                         int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
                         if (nBytes > 0)
                         {
-                            vRecv.resize(nPos + nBytes);
-                            memcpy(&vRecv[nPos], pchBuf, nBytes);
+                            if (pnode->ReceiveMsgBytes(pchBuf, nBytes))
+                                WakeMessageHandler();
                             pnode->nLastRecv = GetTime();
                         }
                         else if (nBytes == 0)
@@ -967,7 +1275,9 @@ void ThreadSocketHandler2(void* parg)
                         {
                             // error
                             int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                            if (nErr == WSAEWOULDBLOCK)
+                                pnode->fRecvReady = false;
+                            else if (nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
                             {
                                 if (!pnode->fDisconnect)
                                     printf("socket recv error %d\n", nErr);
@@ -983,7 +1293,7 @@ void ThreadSocketHandler2(void* parg)
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            if (pnode->fSendReady)
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
@@ -994,14 +1304,31 @@ void ThreadSocketHandler2(void* parg)
                         int nBytes = send(pnode->hSocket, &vSend[0], vSend.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
                         if (nBytes > 0)
                         {
-                            vSend.erase(vSend.begin(), vSend.begin() + nBytes);
+                            // Skip the sent bytes instead of moving the rest
+                            // down, and compact once they outweigh the rest
+                            vSend.ignore(nBytes);
+                            pnode->nSendOffset += nBytes;
+                            if (vSend.empty())
+                            {
+                                // The handler may be holding back replies
+                                // to this peer until there is room
+                                pnode->nSendOffset = 0;
+                                WakeMessageHandler();
+                            }
+                            else if (pnode->nSendOffset > vSend.size())
+                            {
+                                vSend.Compact();
+                                pnode->nSendOffset = 0;
+                            }
                             pnode->nLastSend = GetTime();
                         }
                         else if (nBytes < 0)
                         {
                             // error
                             int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                            if (nErr == WSAEWOULDBLOCK)
+                                pnode->fSendReady = false;
+                            else if (nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
                             {
                                 printf("socket send error %d\n", nErr);
                                 pnode->CloseSocketDisconnect();
@@ -1615,13 +1942,32 @@ void ThreadMessageHandler2(void* parg)
         CNode* pnodeTrickle = NULL;
         if (!vNodesCopy.empty())
             pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
+        bool fMoreWork = false;
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
+            // Waiting for the socket thread to remove it
+            if (pnode->fDisconnect)
+                continue;
+
             // Receive messages
             {
-                TRY_LOCK(pnode->cs_vRecv, lockRecv);
+                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
+                {
+                    unsigned int nQueued = pnode->vRecvMsg.size();
                     ProcessMessages(pnode);
+
+                    // Come straight back if messages were left while there
+                    // is room to reply, and so replies and relayed
+                    // inventory go out to the peers already visited
+                    if (pnode->vRecvMsg.size() != nQueued)
+                        fMoreWork = true;
+                    else if (!pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().fComplete &&
+                             !pnode->fDisconnect && pnode->vSend.size() < SendBufferSize())
+                        fMoreWork = true;
+                }
+                else
+                    fMoreWork = true;
             }
             if (fShutdown)
                 return;
@@ -1642,11 +1988,17 @@ void ThreadMessageHandler2(void* parg)
                 pnode->Release();
         }
 
-        // Wait and allow messages to bunch up.
+        // Wait until the socket thread has a complete message or a drained
+        // send buffer, or for the next round of trickled inventory.
         // Reduce vnThreadsRunning so StopNode has permission to exit while
         // we're sleeping, but we must always check fShutdown after doing this.
         vnThreadsRunning[THREAD_MESSAGEHANDLER]--;
-        Sleep(100);
+        {
+            boost::unique_lock<boost::mutex> lock(mutexMsgHandler);
+            if (!fMoreWork && !fMsgHandlerWake)
+                condMsgHandler.timed_wait(lock, boost::posix_time::milliseconds(100));
+            fMsgHandlerWake = false;
+        }
         if (fRequestShutdown)
             StartShutdown();
         vnThreadsRunning[THREAD_MESSAGEHANDLER]++;
@@ -1887,6 +2239,9 @@ bool StopNode()
     printf("StopNode()\n");
     fShutdown = true;
     nTransactionsUpdated++;
+    WakeMessageHandler();
+    StopScriptCheckThreads();
+    StopStakeSearchThreads();
     int64 nStart = GetTime();
     if (semOutbound)
         for (int i=0; i<MAX_OUTBOUND_CONNECTIONS; i++)
@@ -1915,6 +2270,9 @@ bool StopNode()
     if (vnThreadsRunning[THREAD_ADDEDCONNECTIONS] > 0) printf("ThreadOpenAddedConnections still running\n");
     if (vnThreadsRunning[THREAD_DUMPADDRESS] > 0) printf("ThreadDumpAddresses still running\n");
     if (vnThreadsRunning[THREAD_STEALTHER] > 0) printf("ThreadStakeMinter still running\n");
+    if (vnThreadsRunning[THREAD_SCRIPTCHECK] > 0) printf("ThreadScriptCheck still running\n");
+    if (vnThreadsRunning[THREAD_VERIFYBLOCKS] > 0) printf("ThreadVerifyBlocks still running\n");
+    if (vnThreadsRunning[THREAD_STAKESEARCH] > 0) printf("ThreadStakeSearch still running\n");
     while (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0 || vnThreadsRunning[THREAD_RPCHANDLER] > 0)
         Sleep(20);
     Sleep(50);
@@ -41,6 +41,7 @@ bool BindListenPort(const CService &bindAddr, std::string& strError=REF(std::str
 void StartNode(void* parg);
 void StartTor(void* parg);
 bool StopNode();
+void WakeMessageHandler();
 
 enum
 {
@@ -107,6 +108,9 @@ enum threadId
     THREAD_DUMPADDRESS,
     THREAD_RPCHANDLER,
     THREAD_STEALTHER,
+    THREAD_SCRIPTCHECK,
+    THREAD_VERIFYBLOCKS,
+    THREAD_STAKESEARCH,
 
     THREAD_MAX
 };
@@ -147,6 +151,74 @@ public:
 
 
 
+/** A message received from a peer */
+class CNetMessage
+{
+public:
+    std::string strCommand;
+    CDataStream vRecv;
+    bool fComplete; // the whole payload arrived and its checksum matched
+
+    CNetMessage(int nTypeIn, int nVersionIn) : vRecv(nTypeIn, nVersionIn)
+    {
+        fComplete = false;
+    }
+};
+
+/** Splits the bytes received from a peer into messages.
+ *
+ *  Message format
+ *   (4) message start
+ *   (12) command
+ *   (4) size
+ *   (4) checksum
+ *   (x) data
+ *
+ *  The header collects in a fixed buffer. The payload is written once,
+ *  straight into the message being assembled at the back of the queue, and
+ *  hashed as it arrives. A message is marked complete only after its
+ *  checksum matched, so consuming messages from the front never moves the
+ *  bytes of the ones behind.
+ */
+class CMessageAssembler
+{
+private:
+    char pchHeader[CMessageHeader::HEADER_SIZE];
+    unsigned int nHeaderPos;
+    unsigned int nSkipRun;
+    CMessageHeader hdr;
+    bool fInData;
+    unsigned int nDataPos;
+    SHA256_CTX ctxChecksum;
+
+    unsigned int ReadHeader(const char* pch, unsigned int nBytes, int nVersion);
+
+public:
+    uint64 nSkippedBytes;
+    unsigned int nBadMessages;
+
+    CMessageAssembler()
+    {
+        Reset();
+        nSkippedBytes = 0;
+        nBadMessages = 0;
+    }
+
+    void Reset()
+    {
+        nHeaderPos = 0;
+        nSkipRun = 0;
+        fInData = false;
+        nDataPos = 0;
+    }
+
+    // Returns the number of messages completed
+    unsigned int Receive(const char* pch, unsigned int nBytes, std::deque<CNetMessage>& vMsg, int nVersion);
+};
+
+
+
+
 
 /** Information about a peer */
 class CNode
@@ -156,13 +228,20 @@ public:
     uint64 nServices;
     SOCKET hSocket;
     CDataStream vSend;
-    CDataStream vRecv;
+    unsigned int nSendOffset; // bytes sent since vSend was last compacted
+    std::deque<CNetMessage> vRecvMsg;
+    CMessageAssembler recvAssembler;
+    int nRecvVersion;
     CCriticalSection cs_vSend;
-    CCriticalSection cs_vRecv;
+    CCriticalSection cs_vRecvMsg;
     int64 nLastSend;
     int64 nLastRecv;
     int64 nLastSendEmpty;
     int64 nTimeConnected;
+    // socket readiness, only used by the socket thread
+    bool fPolled;
+    bool fRecvReady;
+    bool fSendReady;
     int nHeaderStart;
     unsigned int nMessageStart;
     CAddress addr;
@@ -213,14 +292,19 @@ public:
     CCriticalSection cs_inventory;
     std::multimap<int64, CInv> mapAskFor;
 
-    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : vSend(SER_NETWORK, MIN_PROTO_VERSION), vRecv(SER_NETWORK, MIN_PROTO_VERSION)
+    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : vSend(SER_NETWORK, MIN_PROTO_VERSION)
     {
         nServices = 0;
         hSocket = hSocketIn;
+        nRecvVersion = MIN_PROTO_VERSION;
         nLastSend = 0;
         nLastRecv = 0;
         nLastSendEmpty = GetTime();
         nTimeConnected = GetTime();
+        nSendOffset = 0;
+        fPolled = false;
+        fRecvReady = false;
+        fSendReady = false;
         nHeaderStart = -1;
         nMessageStart = -1;
         addr = addrIn;
@@ -285,6 +369,27 @@ public:
         nRefCount--;
     }
 
+    // requires LOCK(cs_vRecvMsg)
+    unsigned int GetTotalRecvSize()
+    {
+        unsigned int nTotal = 0;
+        BOOST_FOREACH(const CNetMessage& msg, vRecvMsg)
+            nTotal += msg.vRecv.size();
+        return nTotal;
+    }
+
+    // requires LOCK(cs_vRecvMsg)
+    // Returns true if a message was completed
+    bool ReceiveMsgBytes(const char* pch, unsigned int nBytes)
+    {
+        return recvAssembler.Receive(pch, nBytes, vRecvMsg, nRecvVersion) > 0;
+    }
+
+    void SetRecvVersion(int nVersionIn)
+    {
+        nRecvVersion = nVersionIn;
+    }
+
 
 
     void AddAddressKnown(const CAddress& addr)
@@ -314,9 +419,12 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
-                vInventoryToSend.push_back(inv);
+            if (setInventoryKnown.count(inv))
+                return;
+            vInventoryToSend.push_back(inv);
         }
+        // SendMessages() in the message handler sends it
+        WakeMessageHandler();
     }
 
     void AskFor(const CInv& inv)
@@ -70,6 +70,8 @@ Value getmininginfo(const Array& params, bool fHelp)
 
     Object obj;
     obj.push_back(Pair("blocks",        (int)nBestHeight));
+    obj.push_back(Pair("blockhashes",   (uint64_t)nBlockHashComputed.get()));
+    obj.push_back(Pair("blockhashescached", (uint64_t)nBlockHashCached.get()));
     obj.push_back(Pair("currentblocksize",(uint64_t)nLastBlockSize));
     obj.push_back(Pair("currentblocktx",(uint64_t)nLastBlockTx));
     obj.push_back(Pair("difficulty",    (double)GetDifficulty()));
@@ -79,6 +81,12 @@ Value getmininginfo(const Array& params, bool fHelp)
     obj.push_back(Pair("hashespersec",  gethashespersec(params, false)));
 	obj.push_back(Pair("networkhashps", getnetworkhashps(params, false)));
     obj.push_back(Pair("pooledtx",      (uint64_t)mempool.size()));
+    uint64 nSigCacheSize, nSigCacheHits, nSigCacheMisses;
+    GetSignatureCacheStats(nSigCacheSize, nSigCacheHits, nSigCacheMisses);
+    obj.push_back(Pair("sigcachesize",  (uint64_t)nSigCacheSize));
+    obj.push_back(Pair("sigcachehits",  (uint64_t)nSigCacheHits));
+    obj.push_back(Pair("sigcachemisses",(uint64_t)nSigCacheMisses));
+    obj.push_back(Pair("sigcachehitrate", nSigCacheHits + nSigCacheMisses ? (double)nSigCacheHits / (nSigCacheHits + nSigCacheMisses) : 0.0));
     obj.push_back(Pair("testnet",       fTestNet));
     return obj;
 }
@@ -93,6 +93,25 @@ Value getinfo(const Array& params, bool fHelp)
 }
 
 
+// Runs without cs_main and cs_wallet, which importprivkey holds while it rescans
+Value getrescaninfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getrescaninfo\n"
+            "Returns the progress of the running, or else the last, wallet rescan.");
+
+    CRescanProgress progress = pwalletMain->GetRescanProgress();
+    Object obj;
+    obj.push_back(Pair("active",        progress.fActive));
+    obj.push_back(Pair("startheight",   progress.nStartHeight));
+    obj.push_back(Pair("height",        progress.nHeight));
+    obj.push_back(Pair("endheight",     progress.nEndHeight));
+    obj.push_back(Pair("blockspersec",  progress.dBlocksPerSecond));
+    return obj;
+}
+
+
 Value getnewpubkey(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 1)
@@ -649,6 +668,9 @@ Value movecmd(const Array& params, bool fHelp)
     if (!walletdb.TxnCommit())
         throw JSONRPCError(RPC_DATABASE_ERROR, "database error");
 
+    pwalletMain->AddAccountingEntry(debit);
+    pwalletMain->AddAccountingEntry(credit);
+
     return true;
 }
 
@@ -1090,10 +1112,8 @@ Value listtransactions(const Array& params, bool fHelp)
 
     Array ret;
 
-    std::list<CAccountingEntry> acentries;
-    CWallet::TxItems txOrdered = pwalletMain->OrderedTxItems(acentries, strAccount);
-
     // iterate backwards until we have nCount items to return:
+    CWallet::TxItems& txOrdered = pwalletMain->wtxOrdered;
     for (CWallet::TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
     {
         CWalletTx *const pwtx = (*it).second.first;
@@ -1216,12 +1236,19 @@ Value listsinceblock(const Array& params, bool fHelp)
 
     Array transactions;
 
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
+    if (pindex)
     {
-        CWalletTx tx = (*it).second;
-
-        if (depth == -1 || tx.GetDepthInMainChain() < depth)
-            ListTransactions(tx, "*", 0, true, transactions);
+        // Only transactions above the block or without one can qualify
+        vector<const CWalletTx*> vwtx;
+        pwalletMain->GetTransactionsSince(pindex->nHeight, vwtx);
+        BOOST_FOREACH(const CWalletTx* pwtx, vwtx)
+            if (pwtx->GetDepthInMainChain() < depth)
+                ListTransactions(*pwtx, "*", 0, true, transactions);
+    }
+    else
+    {
+        for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
+            ListTransactions((*it).second, "*", 0, true, transactions);
     }
 
     uint256 lastblock;
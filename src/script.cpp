@@ -1123,7 +1123,8 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
 
 // Valid signature cache, to avoid doing expensive ECDSA signature checking
 // twice for every transaction (once when accepted into memory pool, and
-// again when accepted into the block chain)
+// again when accepted into the block chain).  Shared by all threads,
+// including the -par script check threads.
 
 class CSignatureCache
 {
@@ -1131,9 +1132,14 @@ private:
      // sigdata_type is (signature hash, signature, public key):
     typedef boost::tuple<uint256, std::vector<unsigned char>, std::vector<unsigned char> > sigdata_type;
     std::set< sigdata_type> setValid;
+    int64 nMaxCacheSize;
+    uint64 nHits;
+    uint64 nMisses;
     CCriticalSection cs_sigcache;
 
 public:
+    CSignatureCache() : nMaxCacheSize(-1), nHits(0), nMisses(0) {}
+
     bool
     Get(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
     {
@@ -1142,21 +1148,26 @@ public:
         sigdata_type k(hash, vchSig, pubKey);
         std::set<sigdata_type>::iterator mi = setValid.find(k);
         if (mi != setValid.end())
+        {
+            nHits++;
             return true;
+        }
+        nMisses++;
         return false;
     }
 
     void Set(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
     {
+        LOCK(cs_sigcache);
+
         // DoS prevention: limit cache size to less than 10MB
         // (~200 bytes per cache entry times 50,000 entries)
         // Since there are a maximum of 20,000 signature operations per block
         // 50,000 is a reasonable default.
-        int64 nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
+        if (nMaxCacheSize < 0)
+            nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
         if (nMaxCacheSize <= 0) return;
 
-        LOCK(cs_sigcache);
-
         while (static_cast<int64>(setValid.size()) > nMaxCacheSize)
         {
             // Evict a random entry. Random because that helps
@@ -1175,13 +1186,26 @@ public:
         sigdata_type k(hash, vchSig, pubKey);
         setValid.insert(k);
     }
+
+    void GetStats(uint64& nSizeRet, uint64& nHitsRet, uint64& nMissesRet)
+    {
+        LOCK(cs_sigcache);
+        nSizeRet = setValid.size();
+        nHitsRet = nHits;
+        nMissesRet = nMisses;
+    }
 };
 
+static CSignatureCache signatureCache;
+
+void GetSignatureCacheStats(uint64& nSize, uint64& nHits, uint64& nMisses)
+{
+    signatureCache.GetStats(nSize, nHits, nMisses);
+}
+
 bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode,
               const CTransaction& txTo, unsigned int nIn, int nHashType)
 {
-    static CSignatureCache signatureCache;
-
     // Hash type is one byte tacked on to the end of the signature
     if (vchSig.empty())
         return false;
@@ -1476,6 +1500,14 @@ bool IsMine(const CKeyStore &keystore, const CTxDestination &dest)
 
 bool IsMine(const CKeyStore &keystore, const CScript& scriptPubKey)
 {
+    // The common forms are looked up whole among the scripts the keystore
+    // built for its keys and scripts, so outputs paying others are turned
+    // down without running Solver()
+    if (scriptPubKey.IsPayToPubKeyHash() || scriptPubKey.IsPayToPubKey())
+        return keystore.HaveScriptPubKey(scriptPubKey);
+    if (scriptPubKey.IsPayToScriptHash() && !keystore.HaveScriptPubKey(scriptPubKey))
+        return false;
+
     vector<valtype> vSolutions;
     txnouttype whichType;
     if (!Solver(scriptPubKey, whichType, vSolutions))
@@ -1844,6 +1876,23 @@ bool CScript::IsPayToScriptHash() const
             this->at(22) == OP_EQUAL);
 }
 
+bool CScript::IsPayToPubKeyHash() const
+{
+    return (this->size() == 25 &&
+            this->at(0) == OP_DUP &&
+            this->at(1) == OP_HASH160 &&
+            this->at(2) == 0x14 &&
+            this->at(23) == OP_EQUALVERIFY &&
+            this->at(24) == OP_CHECKSIG);
+}
+
+bool CScript::IsPayToPubKey() const
+{
+    return (((this->size() == 35 && this->at(0) == 0x21) ||
+             (this->size() == 67 && this->at(0) == 0x41)) &&
+            this->back() == OP_CHECKSIG);
+}
+
 class CScriptVisitor : public boost::static_visitor<bool>
 {
 private:
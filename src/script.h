@@ -521,6 +521,9 @@ public:
     unsigned int GetSigOpCount(const CScript& scriptSig) const;
 
     bool IsPayToScriptHash() const;
+    bool IsPayToPubKeyHash() const;
+    // A push of a compressed or uncompressed public key, then OP_CHECKSIG
+    bool IsPayToPubKey() const;
 
     // Called by CTransaction::IsStandard
     bool IsPushOnly() const
@@ -598,6 +601,8 @@ bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTrans
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
                   bool fValidatePayToScriptHash, int nHashType);
 bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, bool fValidatePayToScriptHash, int nHashType);
+/** Size and hit/miss counts of the valid signature cache used by CheckSig */
+void GetSignatureCacheStats(uint64& nSize, uint64& nHits, uint64& nMisses);
 
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
 // combine them intelligently and return the result.
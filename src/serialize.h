@@ -243,6 +243,74 @@ uint64 ReadCompactSize(Stream& is)
     return nSizeRet;
 }
 
+// Variable-length integers: bytes are a MSB base-128 encoding of the number.
+// The high bit in each byte signifies whether another digit follows. To make
+// the encoding one-to-one, one is subtracted from all but the last digit.
+// Small numbers take little space (0-127: 1 byte, 128-16511: 2 bytes,
+// 16512-2113663: 3 bytes) and the encoding does not depend on the size of
+// the original integer type.
+//
+// 0:         [0x00]  256:        [0x81 0x00]
+// 1:         [0x01]  16383:      [0xFE 0x7F]
+// 127:       [0x7F]  16384:      [0xFF 0x00]
+// 128:  [0x80 0x00]  16511:      [0xFF 0x7F]
+// 255:  [0x80 0x7F]  65535: [0x82 0xFE 0x7F]
+// 2^32:           [0x8E 0xFE 0xFE 0xFF 0x00]
+
+template<typename I>
+inline unsigned int GetSizeOfVarInt(I n)
+{
+    int nRet = 0;
+    while (true)
+    {
+        nRet++;
+        if (n <= 0x7F)
+            break;
+        n = (n >> 7) - 1;
+    }
+    return nRet;
+}
+
+template<typename Stream, typename I>
+void WriteVarInt(Stream& os, I n)
+{
+    unsigned char tmp[(sizeof(n)*8+6)/7];
+    int len = 0;
+    while (true)
+    {
+        tmp[len] = (n & 0x7F) | (len ? 0x80 : 0x00);
+        if (n <= 0x7F)
+            break;
+        n = (n >> 7) - 1;
+        len++;
+    }
+    do {
+        WRITEDATA(os, tmp[len]);
+    } while (len--);
+}
+
+template<typename Stream, typename I>
+I ReadVarInt(Stream& is)
+{
+    I n = 0;
+    while (true)
+    {
+        unsigned char chData;
+        READDATA(is, chData);
+        if (n > (std::numeric_limits<I>::max() >> 7))
+            throw std::ios_base::failure("ReadVarInt() : size too large");
+        n = (n << 7) | (chData & 0x7F);
+        if (chData & 0x80)
+        {
+            if (n == std::numeric_limits<I>::max())
+                throw std::ios_base::failure("ReadVarInt() : size too large");
+            n++;
+        }
+        else
+            return n;
+    }
+}
+
 
 
 #define FLATDATA(obj)   REF(CFlatData((char*)&(obj), (char*)&(obj) + sizeof(obj)))
@@ -1004,6 +1072,70 @@ public:
 
 
 
+/** Read-only stream over memory owned by someone else, such as a mapped
+ * file.  Objects are deserialized in place, without copying the bytes into
+ * a CDataStream first.  The memory must outlive the reader.
+ */
+class CBufferReader
+{
+private:
+    const char* pcur;
+    const char* pend;
+
+public:
+    int nType;
+    int nVersion;
+
+    CBufferReader(const char* pbegin, const char* pendIn, int nTypeIn, int nVersionIn) :
+        pcur(pbegin), pend(pendIn), nType(nTypeIn), nVersion(nVersionIn)
+    {
+    }
+
+    size_t size() const          { return pend - pcur; }
+    bool empty() const           { return pcur == pend; }
+    bool eof() const             { return pcur == pend; }
+    const char* pos() const      { return pcur; }
+
+    void SetType(int n)          { nType = n; }
+    int GetType()                { return nType; }
+    void SetVersion(int n)       { nVersion = n; }
+    int GetVersion()             { return nVersion; }
+
+    CBufferReader& read(char* pch, size_t nSize)
+    {
+        if (nSize > size())
+        {
+            memset(pch, 0, nSize);
+            pcur = pend;
+            throw std::ios_base::failure("CBufferReader::read() : end of data");
+        }
+        memcpy(pch, pcur, nSize);
+        pcur += nSize;
+        return (*this);
+    }
+
+    CBufferReader& ignore(size_t nSize)
+    {
+        if (nSize > size())
+        {
+            pcur = pend;
+            throw std::ios_base::failure("CBufferReader::ignore() : end of data");
+        }
+        pcur += nSize;
+        return (*this);
+    }
+
+    template<typename T>
+    CBufferReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
+
+
 
 
 
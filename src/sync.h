@@ -9,6 +9,7 @@
 #include <boost/thread/recursive_mutex.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/condition_variable.hpp>
+#include <boost/cstdint.hpp>
 
 
 
@@ -208,5 +209,26 @@ public:
         return fHaveGrant;
     }
 };
+
+/** Statistics counter that may be bumped from any thread */
+class CStatCounter
+{
+private:
+    mutable boost::mutex mutex;
+    boost::uint64_t value;
+
+public:
+    CStatCounter() : value(0) {}
+
+    void inc() {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        value++;
+    }
+
+    boost::uint64_t get() const {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return value;
+    }
+};
 #endif
 
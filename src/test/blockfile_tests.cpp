@@ -0,0 +1,168 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/filesystem.hpp>
+
+#include "blockfile.h"
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(blockfile_tests)
+
+static CTransaction RandomTransaction(int nOutputs)
+{
+    CTransaction tx;
+    tx.nTime = GetRand(1000000000);
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 1);
+    tx.vin[0].scriptSig = CScript() << vector<unsigned char>(72, 1);
+    tx.vout.resize(nOutputs);
+    for (int i = 0; i < nOutputs; i++)
+        tx.vout[i].nValue = GetRand(100 * COIN);
+    return tx;
+}
+
+static void AppendToFile(const boost::filesystem::path& path, const CTransaction& tx, unsigned int& nPosRet)
+{
+    CAutoFile file(fopen(path.string().c_str(), "ab"), SER_DISK, CLIENT_VERSION);
+    BOOST_REQUIRE(file != NULL);
+    fseek(file, 0, SEEK_END);
+    nPosRet = ftell(file);
+    file << tx;
+}
+
+BOOST_AUTO_TEST_CASE(blockfile_bufferreader)
+{
+    CTransaction tx = RandomTransaction(3);
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << tx << 12345;
+
+    CBufferReader reader(&ss[0], &ss[0] + ss.size(), SER_DISK, CLIENT_VERSION);
+    CTransaction tx2;
+    int n;
+    reader >> tx2 >> n;
+    BOOST_CHECK(tx2 == tx);
+    BOOST_CHECK_EQUAL(n, 12345);
+    BOOST_CHECK(reader.eof());
+
+    // Running out of data throws and leaves the reader at the end
+    CBufferReader reader2(&ss[0], &ss[0] + 10, SER_DISK, CLIENT_VERSION);
+    BOOST_CHECK_THROW(reader2 >> tx2, std::ios_base::failure);
+    BOOST_CHECK(reader2.eof());
+}
+
+BOOST_AUTO_TEST_CASE(blockfile_read_and_grow)
+{
+    // A block file number far beyond the ones in use
+    const unsigned int nFile = 9999;
+    boost::filesystem::path path = BlockFilePath(nFile);
+    boost::filesystem::remove(path);
+
+    CBlockFileMap map;
+    CTransaction tx;
+    BOOST_CHECK(!map.Read(nFile, 0, tx));
+
+    vector<CTransaction> vtx;
+    vector<unsigned int> vPos;
+    for (int i = 0; i < 10; i++)
+    {
+        vtx.push_back(RandomTransaction(1 + i));
+        vPos.push_back(0);
+        AppendToFile(path, vtx.back(), vPos.back());
+    }
+    for (int i = 9; i >= 0; i--)
+        BOOST_CHECK(map.Read(nFile, vPos[i], tx) && tx == vtx[i]);
+    unsigned int nMaps;
+    uint64 nMapped;
+    map.GetStats(nMaps, nMapped);
+    BOOST_CHECK_EQUAL(nMaps, 1U);
+    BOOST_CHECK_EQUAL(nMapped, 1U);
+
+    // Data appended after the file was mapped is found by mapping it again
+    CTransaction txNew = RandomTransaction(2);
+    unsigned int nPosNew;
+    AppendToFile(path, txNew, nPosNew);
+    BOOST_CHECK(map.Read(nFile, nPosNew, tx) && tx == txNew);
+    BOOST_CHECK(map.Read(nFile, vPos[0], tx) && tx == vtx[0]);
+    map.GetStats(nMaps, nMapped);
+    BOOST_CHECK_EQUAL(nMaps, 1U);
+    BOOST_CHECK_EQUAL(nMapped, 2U);
+
+    // Nothing is read past the end of the file
+    BOOST_CHECK(!map.Read(nFile, boost::filesystem::file_size(path), tx));
+
+    // Least recently used mappings are dropped
+    map.SetMaxMaps(0);
+    map.GetStats(nMaps, nMapped);
+    BOOST_CHECK_EQUAL(nMaps, 0U);
+    BOOST_CHECK(!map.Read(nFile, vPos[0], tx));
+
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_CASE(blockfile_genesis)
+{
+    // The fixture wrote the genesis block to blk0001.dat
+    BOOST_REQUIRE(pindexGenesisBlock != NULL);
+    CBlock block;
+    BOOST_CHECK(blockfilemap.Read(pindexGenesisBlock->nFile, pindexGenesisBlock->nBlockPos, block));
+    BOOST_CHECK(block.GetHash() == pindexGenesisBlock->GetBlockHash());
+    BOOST_CHECK_EQUAL(block.vtx.size(), 1U);
+
+    CBlock header;
+    BOOST_CHECK(header.ReadFromDisk(pindexGenesisBlock->nFile, pindexGenesisBlock->nBlockPos, false));
+    BOOST_CHECK(header.GetHash() == block.GetHash());
+    BOOST_CHECK(header.vtx.empty());
+
+    CTransaction tx;
+    // 80 byte header and a one byte transaction count
+    unsigned int nTxPos = pindexGenesisBlock->nBlockPos + 80 + 1;
+    BOOST_CHECK(tx.ReadFromDisk(CDiskTxPos(pindexGenesisBlock->nFile, pindexGenesisBlock->nBlockPos, nTxPos)));
+    BOOST_CHECK(tx == block.vtx[0]);
+}
+
+BOOST_AUTO_TEST_CASE(blockfile_checked)
+{
+    BOOST_REQUIRE(pindexGenesisBlock != NULL);
+    CBlock block;
+    BOOST_REQUIRE(block.ReadFromDisk(pindexGenesisBlock));
+    BOOST_CHECK(!block.fChecked);
+    BOOST_CHECK(block.CheckBlock());
+    BOOST_CHECK(block.fChecked);
+
+    // Reading another block into the object drops the result
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << block;
+    ss >> block;
+    BOOST_CHECK(!block.fChecked);
+
+    // Partial checks are not remembered
+    BOOST_CHECK(block.CheckBlock(true, false));
+    BOOST_CHECK(!block.fChecked);
+}
+
+BOOST_AUTO_TEST_CASE(blockfile_import)
+{
+    BOOST_REQUIRE(pindexGenesisBlock != NULL);
+    CBlock block;
+    BOOST_REQUIRE(block.ReadFromDisk(pindexGenesisBlock));
+
+    // Garbage, the genesis block a few times, then a truncated record
+    boost::filesystem::path path = GetDataDir() / "import_test.dat";
+    {
+        CAutoFile file(fopen(path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        BOOST_REQUIRE(file != NULL);
+        file << (unsigned int)0xdeadbeef;
+        for (int i = 0; i < 3; i++)
+            file << FLATDATA(pchMessageStart) << (unsigned int)::GetSerializeSize(block, SER_DISK, CLIENT_VERSION) << block;
+        file << FLATDATA(pchMessageStart) << (unsigned int)1000;
+    }
+
+    // Every block is already known, so none is loaded; the import ends
+    BOOST_CHECK(LoadExternalBlockFile(path));
+    BOOST_CHECK(pindexBest == pindexGenesisBlock);
+    BOOST_CHECK(!LoadExternalBlockFile(GetDataDir() / "import_missing.dat"));
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,78 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(chain_tests)
+
+// Link vBlock[nBegin..] after pindexPrev, each block proof-of-stake with
+// chance 1 in nStakeOdds
+static void LinkBlocks(vector<CBlockIndex>& vBlock, unsigned int nBegin, CBlockIndex* pindexPrev, int nStakeOdds)
+{
+    for (unsigned int i = nBegin; i < vBlock.size(); i++)
+    {
+        CBlockIndex* pindex = &vBlock[i];
+        pindex->pprev = (i == nBegin ? pindexPrev : &vBlock[i - 1]);
+        pindex->nHeight = (pindex->pprev ? pindex->pprev->nHeight + 1 : 0);
+        if (pindex->pprev && GetRand(nStakeOdds) == 0)
+            pindex->SetProofOfStake();
+    }
+}
+
+// The pprev walk GetLastBlockIndex() did before the chain view
+static const CBlockIndex* WalkLastBlockIndex(const CBlockIndex* pindex, bool fProofOfStake)
+{
+    while (pindex && pindex->pprev && (pindex->IsProofOfStake() != fProofOfStake))
+        pindex = pindex->pprev;
+    return pindex;
+}
+
+BOOST_AUTO_TEST_CASE(chain_view)
+{
+    vector<CBlockIndex> vMain(400);
+    LinkBlocks(vMain, 0, NULL, 3);
+    CChain chain;
+    BOOST_CHECK(chain.Tip() == NULL);
+    BOOST_CHECK_EQUAL(chain.Height(), -1);
+
+    // Grow block by block, as SetBestChain does
+    for (unsigned int i = 0; i < vMain.size(); i++)
+        chain.SetTip(&vMain[i]);
+    BOOST_CHECK(chain.Genesis() == &vMain[0]);
+    BOOST_CHECK(chain.Tip() == &vMain.back());
+    BOOST_CHECK_EQUAL(chain.Height(), 399);
+    BOOST_CHECK(chain[400] == NULL);
+    BOOST_CHECK(chain[-1] == NULL);
+    for (unsigned int i = 0; i < vMain.size(); i++)
+    {
+        BOOST_CHECK(chain[i] == &vMain[i]);
+        BOOST_CHECK(chain.GetLastBlockIndex(&vMain[i], true) == WalkLastBlockIndex(&vMain[i], true));
+        BOOST_CHECK(chain.GetLastBlockIndex(&vMain[i], false) == WalkLastBlockIndex(&vMain[i], false));
+    }
+
+    // Reorganize onto a longer fork from height 250, mostly proof-of-stake
+    vector<CBlockIndex> vFork(200);
+    LinkBlocks(vFork, 0, &vMain[250], 50);
+    chain.SetTip(&vFork.back());
+    BOOST_CHECK_EQUAL(chain.Height(), 450);
+    BOOST_CHECK(chain.Contains(&vMain[250]));
+    BOOST_CHECK(!chain.Contains(&vMain[251]));
+    BOOST_CHECK(chain[251] == &vFork[0]);
+    for (unsigned int i = 0; i < vFork.size(); i++)
+    {
+        BOOST_CHECK(chain.Contains(&vFork[i]));
+        BOOST_CHECK(chain.GetLastBlockIndex(&vFork[i], true) == WalkLastBlockIndex(&vFork[i], true));
+        BOOST_CHECK(chain.GetLastBlockIndex(&vFork[i], false) == WalkLastBlockIndex(&vFork[i], false));
+    }
+
+    // Back to an ancestor
+    chain.SetTip(&vMain[100]);
+    BOOST_CHECK(chain.Tip() == &vMain[100]);
+    BOOST_CHECK(!chain.Contains(&vFork[0]));
+
+    chain.SetTip(NULL);
+    BOOST_CHECK(chain.Genesis() == NULL);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,87 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include "checkqueue.h"
+
+BOOST_AUTO_TEST_SUITE(checkqueue_tests)
+
+// Check that counts how often it ran and returns a preset result
+struct CCountingCheck
+{
+    static boost::mutex mutex;
+    static int nRuns;
+    bool fResult;
+
+    CCountingCheck(bool fResultIn = true) : fResult(fResultIn) {}
+
+    bool operator()()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nRuns++;
+        return fResult;
+    }
+
+    void swap(CCountingCheck& check)
+    {
+        std::swap(fResult, check.fResult);
+    }
+};
+
+boost::mutex CCountingCheck::mutex;
+int CCountingCheck::nRuns = 0;
+
+static void QueueThread(CCheckQueue<CCountingCheck>* pqueue)
+{
+    pqueue->Thread();
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_all_checks_run)
+{
+    CCheckQueue<CCountingCheck> queue(16);
+    boost::thread_group threads;
+    for (int i = 0; i < 3; i++)
+        threads.create_thread(boost::bind(QueueThread, &queue));
+
+    for (int nBatches = 0; nBatches < 20; nBatches++)
+    {
+        CCountingCheck::nRuns = 0;
+        CCheckQueueControl<CCountingCheck> control(&queue);
+        for (int i = 0; i < nBatches; i++)
+        {
+            std::vector<CCountingCheck> vChecks(i + 1);
+            control.Add(vChecks);
+        }
+        BOOST_CHECK(control.Wait());
+        BOOST_CHECK_EQUAL(CCountingCheck::nRuns, nBatches * (nBatches + 1) / 2);
+    }
+
+    {
+        CCheckQueueControl<CCountingCheck> control(&queue);
+        std::vector<CCountingCheck> vChecks(100);
+        vChecks[57] = CCountingCheck(false);
+        control.Add(vChecks);
+        BOOST_CHECK(!control.Wait());
+    }
+
+    // The failure must not leak into the next block
+    {
+        CCheckQueueControl<CCountingCheck> control(&queue);
+        std::vector<CCountingCheck> vChecks(10);
+        control.Add(vChecks);
+        BOOST_CHECK(control.Wait());
+    }
+
+    queue.Quit();
+    threads.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_null_control)
+{
+    // Without a queue nothing is deferred; ConnectInputs verifies inline then
+    CCheckQueueControl<CCountingCheck> control(NULL);
+    std::vector<CCountingCheck> vChecks(5);
+    control.Add(vChecks);
+    BOOST_CHECK(control.Wait());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
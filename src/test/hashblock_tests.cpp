@@ -0,0 +1,156 @@
+#include <boost/test/unit_test.hpp>
+
+#include <string.h>
+#include <vector>
+
+#include "hashblock.h"
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(hashblock_tests)
+
+// Genesis block header, serialized the way CBlock::GetHash() hashes it
+static uint256 GenesisHash()
+{
+    struct
+    {
+        int nVersion;
+        uint256 hashPrevBlock;
+        uint256 hashMerkleRoot;
+        unsigned int nTime;
+        unsigned int nBits;
+        unsigned int nNonce;
+    } header;
+
+    header.nVersion = 1;
+    header.hashPrevBlock = 0;
+    header.hashMerkleRoot = uint256("0xa3e2c050dda5178062a8f9b4834cfb4c6754c33ae7c7679b9d7481b1aa17d854");
+    header.nTime = 1407547785;
+    header.nBits = 0x1e0fffff;
+    header.nNonce = 557934;
+    return Hash9(BEGIN(header.nVersion), END(header.nNonce));
+}
+
+BOOST_AUTO_TEST_CASE(hashblock_backends_agree)
+{
+    // The AES-NI kernels fault on CPUs without the instructions
+    if (!x13_backend_supported(X13_BACKEND_AESNI))
+    {
+        BOOST_TEST_MESSAGE("AES-NI not supported, skipped");
+        return;
+    }
+
+    unsigned char in[64], ref[64], out[64];
+    for (int i = 0; i < 256; i++)
+    {
+        for (unsigned int j = 0; j < sizeof(in); j++)
+            in[j] = (unsigned char)(i * 31 + j * 7 + (i ^ j));
+
+        x13_groestl512_64_sph(in, ref);
+        x13_groestl512_64_aesni(in, out);
+        BOOST_CHECK(memcmp(ref, out, sizeof(ref)) == 0);
+
+        x13_echo512_64_sph(in, ref);
+        x13_echo512_64_aesni(in, out);
+        BOOST_CHECK(memcmp(ref, out, sizeof(ref)) == 0);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(hashblock_genesis_known_answer)
+{
+    const uint256 hashGenesis("0x000001cb93b0d2049c9882f62cc1f847cc4d57c89b6213137d840654cc3e1465");
+    int nBackend = x13_get_backend();
+    for (int i = 0; i < X13_BACKEND_COUNT; i++)
+    {
+        if (!x13_select_backend(i))
+            continue;
+        BOOST_CHECK_MESSAGE(GenesisHash() == hashGenesis, x13_backend_name(i));
+    }
+    x13_select_backend(nBackend);
+}
+
+BOOST_AUTO_TEST_CASE(hashblock_cubehash_lanes_agree)
+{
+    if (!x13_backend_supported(X13_BACKEND_AVX2))
+    {
+        BOOST_TEST_MESSAGE("AVX2 not supported, skipped");
+        return;
+    }
+
+    unsigned char in[64 * HASH9_MAX_LANES], ref[64 * HASH9_MAX_LANES], out[64 * HASH9_MAX_LANES];
+    for (unsigned int j = 0; j < sizeof(in); j++)
+        in[j] = (unsigned char)(j * 13 + (j >> 6));
+
+    for (unsigned int n = 1; n <= HASH9_MAX_LANES; n++)
+    {
+        x13_cubehash512_64_n_sph(in, ref, n);
+        x13_cubehash512_64_n_avx2(in, out, n);
+        BOOST_CHECK(memcmp(ref, out, 64 * n) == 0);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(hashblock_batch_matches_single)
+{
+    // 80-byte headers differing only in the nonce, like the miner hashes them
+    const unsigned int nCount = 2 * HASH9_MAX_LANES + 3;
+    vector<unsigned char> vData(80 * nCount);
+    vector<const unsigned char*> vpData(nCount);
+    for (unsigned int i = 0; i < nCount; i++)
+    {
+        for (unsigned int j = 0; j < 80; j++)
+            vData[80 * i + j] = (unsigned char)(j < 76 ? j * 3 : i + j);
+        vpData[i] = &vData[80 * i];
+    }
+
+    int nBackend = x13_get_backend();
+    for (int b = 0; b < X13_BACKEND_COUNT; b++)
+    {
+        if (!x13_select_backend(b))
+            continue;
+        for (unsigned int n = 1; n <= nCount; n++)
+        {
+            vector<uint256> vHash(n);
+            Hash9xN(&vpData[0], 80, n, &vHash[0]);
+            for (unsigned int i = 0; i < n; i++)
+                BOOST_CHECK_MESSAGE(vHash[i] == Hash9(vpData[i], vpData[i] + 80), x13_backend_name(b));
+        }
+    }
+    x13_select_backend(nBackend);
+}
+
+BOOST_AUTO_TEST_CASE(hashblock_cblock_hash_cache)
+{
+    CBlock block;
+    BOOST_CHECK_EQUAL(END(block.nNonce) - BEGIN(block.nVersion), (int)CBlock::HEADER_SIZE);
+
+    block.nVersion = 1;
+    block.hashPrevBlock = 0;
+    block.hashMerkleRoot = uint256("0xa3e2c050dda5178062a8f9b4834cfb4c6754c33ae7c7679b9d7481b1aa17d854");
+    block.nTime = 1407547785;
+    block.nBits = 0x1e0fffff;
+    block.nNonce = 557934;
+
+    uint64 nComputed = nBlockHashComputed.get();
+    uint64 nCached = nBlockHashCached.get();
+    BOOST_CHECK(block.GetHash() == GenesisHash());
+    BOOST_CHECK(block.GetHash() == GenesisHash());
+    BOOST_CHECK_EQUAL(nBlockHashComputed.get() - nComputed, 1U);
+    BOOST_CHECK_EQUAL(nBlockHashCached.get() - nCached, 1U);
+
+    // Assigning a header field invalidates the cached hash
+    block.nNonce++;
+    BOOST_CHECK(block.GetHash() == Hash9(BEGIN(block.nVersion), END(block.nNonce)));
+    BOOST_CHECK(block.GetHash() != GenesisHash());
+    block.nNonce--;
+    BOOST_CHECK(block.GetHash() == GenesisHash());
+
+    // Copies carry the cache along
+    CBlock copy(block);
+    nComputed = nBlockHashComputed.get();
+    BOOST_CHECK(copy.GetHash() == GenesisHash());
+    BOOST_CHECK_EQUAL(nBlockHashComputed.get() - nComputed, 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,164 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "kernel.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(kernel_tests)
+
+static CStakeKernelInput MakeKernelInput(int64 nValueIn)
+{
+    CStakeKernelInput input;
+    input.prevout = COutPoint(GetRandHash(), 1);
+    input.hashBlockFrom = GetRandHash();
+    input.nTimeBlockFrom = 1400000000;
+    input.nTxPrevOffset = 81;
+    input.nTimeTxPrev = input.nTimeBlockFrom - 30;
+    input.nValueIn = nValueIn;
+    input.fModifier = true;
+    input.nStakeModifier = 0x0123456789abcdefULL;
+    return input;
+}
+
+BOOST_AUTO_TEST_CASE(kernel_search_hash)
+{
+    // An easy target: the first timestamp tried has a kernel
+    CStakeKernelInput input = MakeKernelInput(1000 * COIN);
+    unsigned int nTimeTx = input.nTimeBlockFrom + 5 * 24 * 60 * 60;
+    unsigned int nTimeTxFound = 0;
+    uint256 hashProofOfStake = 0;
+    BOOST_CHECK(SearchStakeKernel(input, 0x207fffff, nTimeTx, 60, nTimeTxFound, hashProofOfStake));
+    BOOST_CHECK_EQUAL(nTimeTxFound, nTimeTx);
+
+    // The kernel hash matches the stream CheckStakeKernelHash() hashes
+    CDataStream ss(SER_GETHASH, 0);
+    ss << input.nStakeModifier;
+    ss << input.nTimeBlockFrom << input.nTxPrevOffset << input.nTimeTxPrev << input.prevout.n << nTimeTxFound;
+    BOOST_CHECK(hashProofOfStake == Hash(ss.begin(), ss.end()));
+}
+
+BOOST_AUTO_TEST_CASE(kernel_search_bounds)
+{
+    CStakeKernelInput input = MakeKernelInput(1000 * COIN);
+    unsigned int nTimeTx = input.nTimeBlockFrom + 5 * 24 * 60 * 60;
+    unsigned int nTimeTxFound = 0;
+    uint256 hashProofOfStake = 0;
+
+    // A target no hash meets
+    BOOST_CHECK(!SearchStakeKernel(input, 0x01010000, nTimeTx, 60, nTimeTxFound, hashProofOfStake));
+
+    // No modifier yet, or nothing to search
+    input.fModifier = false;
+    BOOST_CHECK(!SearchStakeKernel(input, 0x207fffff, nTimeTx, 60, nTimeTxFound, hashProofOfStake));
+    input.fModifier = true;
+    BOOST_CHECK(!SearchStakeKernel(input, 0x207fffff, nTimeTx, 0, nTimeTxFound, hashProofOfStake));
+
+    // Coins younger than the min age never produce a kernel
+    BOOST_CHECK(!SearchStakeKernel(input, 0x207fffff, input.nTimeBlockFrom + nStakeMinAge - 1, 60, nTimeTxFound, hashProofOfStake));
+}
+
+BOOST_AUTO_TEST_CASE(kernel_search_threads)
+{
+    // Only one of many candidates can stake; every thread count finds it
+    vector<CStakeKernelInput> vInput;
+    for (int i = 0; i < 200; i++)
+    {
+        vInput.push_back(MakeKernelInput(1000 * COIN));
+        vInput.back().fModifier = (i == 137);
+    }
+    unsigned int nTimeTx = vInput[0].nTimeBlockFrom + 5 * 24 * 60 * 60;
+
+    // Without workers the calling thread searches every partition, then
+    // the same searches run on a pool that outlives them
+    boost::thread_group threadGroup;
+    for (int nPass = 0; nPass < 2; nPass++)
+    {
+        for (int nThreads = 1; nThreads <= 8; nThreads++)
+        {
+            unsigned int nIndex = 0;
+            unsigned int nTimeTxFound = 0;
+            uint256 hashProofOfStake = 0;
+            BOOST_CHECK(SearchStakeKernels(vInput, 0x207fffff, nTimeTx, 60, nThreads, nIndex, nTimeTxFound, hashProofOfStake));
+            BOOST_CHECK_EQUAL(nIndex, 137U);
+            BOOST_CHECK_EQUAL(nTimeTxFound, nTimeTx);
+        }
+        for (int i = 0; i < 3 && nPass == 0; i++)
+            threadGroup.create_thread(boost::bind(&ThreadStakeSearch, (void*)NULL));
+    }
+    StopStakeSearchThreads();
+    threadGroup.join_all();
+
+    // A single thread stops at the first kernel in candidate order
+    vector<CStakeKernelInput> vInputSmall(1, MakeKernelInput(10 * COIN));
+    vInputSmall.push_back(MakeKernelInput(20 * COIN));
+    unsigned int nIndex = 0;
+    unsigned int nTimeTxFound = 0;
+    uint256 hashProofOfStake = 0;
+    BOOST_CHECK(SearchStakeKernels(vInputSmall, 0x207fffff, nTimeTx, 60, 1, nIndex, nTimeTxFound, hashProofOfStake));
+    BOOST_CHECK_EQUAL(nIndex, 0U);
+
+    vInput.clear();
+    BOOST_CHECK(!SearchStakeKernels(vInput, 0x207fffff, nTimeTx, 60, 4, nIndex, nTimeTxFound, hashProofOfStake));
+}
+
+// The block the pnext walk of GetKernelStakeModifier() stops at
+static const CBlockIndex* WalkStakeModifier(const CBlockIndex* pindexFrom, int64 nTime)
+{
+    const CBlockIndex* pindex = pindexFrom;
+    int64 nModifierTime = pindexFrom->GetBlockTime();
+    while (nModifierTime < nTime)
+    {
+        if (!pindex->pnext)
+            return NULL;
+        pindex = pindex->pnext;
+        if (pindex->GeneratedStakeModifier())
+            nModifierTime = pindex->GetBlockTime();
+    }
+    return pindex;
+}
+
+BOOST_AUTO_TEST_CASE(kernel_modifier_index)
+{
+    // A chain with out of order block times and a modifier every few blocks
+    vector<CBlockIndex> vBlock(300);
+    CStakeModifierIndex index;
+    for (unsigned int i = 0; i < vBlock.size(); i++)
+    {
+        vBlock[i].nHeight = i;
+        vBlock[i].nTime = 1400000000 + i * 60 + (GetRand(7) == 0 ? GetRand(1200) : 0) - 300;
+        vBlock[i].SetStakeModifier(GetRand(1000000), GetRand(3) == 0);
+        if (i > 0)
+        {
+            vBlock[i].pprev = &vBlock[i - 1];
+            vBlock[i - 1].pnext = &vBlock[i];
+        }
+        index.Connect(&vBlock[i]);
+    }
+
+    for (unsigned int i = 0; i < vBlock.size(); i++)
+        for (int64 nInterval = 1; nInterval < 4000; nInterval += 333)
+        {
+            int64 nTime = vBlock[i].GetBlockTime() + nInterval;
+            const CBlockIndex* pindex = index.Find(i, nTime);
+            const CBlockIndex* pindexWalk = WalkStakeModifier(&vBlock[i], nTime);
+            BOOST_CHECK(pindex == pindexWalk);
+        }
+
+    // Unwind to a fork point and extend again
+    index.Disconnect(&vBlock[200]);
+    vBlock[199].pnext = NULL;
+    BOOST_CHECK(index.Find(150, vBlock[150].GetBlockTime() + 60) == WalkStakeModifier(&vBlock[150], vBlock[150].GetBlockTime() + 60));
+    BOOST_CHECK(index.Find(199, vBlock[199].GetBlockTime() + 1) == NULL);
+    for (unsigned int i = 200; i < vBlock.size(); i++)
+    {
+        vBlock[i - 1].pnext = &vBlock[i];
+        index.Connect(&vBlock[i]);
+    }
+    BOOST_CHECK(index.Find(190, vBlock[190].GetBlockTime() + 1000) == WalkStakeModifier(&vBlock[190], vBlock[190].GetBlockTime() + 1000));
+
+    index.Clear();
+    BOOST_CHECK_EQUAL(index.size(), 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
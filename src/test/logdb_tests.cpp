@@ -0,0 +1,97 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/filesystem.hpp>
+
+#include "db.h"
+#include "logdb.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(logdb_tests)
+
+static boost::filesystem::path TempLogPath()
+{
+    return boost::filesystem::temp_directory_path() / strprintf("logdb_test_%"PRI64x".log", GetRand(~(uint64)0));
+}
+
+BOOST_AUTO_TEST_CASE(logdb_batches)
+{
+    CLogDB logdb;
+    BOOST_CHECK(logdb.Open(boost::filesystem::path()));
+
+    CLogDB::CBatch batch;
+    batch.Write("b", "2");
+    batch.Write("a", "1");
+    batch.Write("c", "");
+    BOOST_CHECK(logdb.WriteBatch(batch));
+
+    string strValue;
+    BOOST_CHECK(logdb.Read("a", strValue) && strValue == "1");
+    BOOST_CHECK(logdb.Read("b", strValue) && strValue == "2");
+    BOOST_CHECK(logdb.Read("c", strValue) && strValue.empty());
+    BOOST_CHECK(!logdb.Read("d", strValue));
+    BOOST_CHECK_EQUAL(logdb.GetCount(), 3U);
+
+    batch.Clear();
+    batch.Erase("b");
+    batch.Write("a", "11");
+    BOOST_CHECK(logdb.WriteBatch(batch));
+    BOOST_CHECK(!logdb.Exists("b"));
+    BOOST_CHECK(logdb.Read("a", strValue) && strValue == "11");
+
+    // Ordered scan
+    string strKey;
+    BOOST_CHECK(logdb.Seek("", true, strKey, strValue) && strKey == "a");
+    BOOST_CHECK(logdb.Seek("a", true, strKey, strValue) && strKey == "a");
+    BOOST_CHECK(logdb.Seek("a", false, strKey, strValue) && strKey == "c");
+    BOOST_CHECK(!logdb.Seek("c", false, strKey, strValue));
+}
+
+BOOST_AUTO_TEST_CASE(logdb_reopen_and_torn_batch)
+{
+    boost::filesystem::path path = TempLogPath();
+    {
+        CLogDB logdb;
+        BOOST_CHECK(logdb.Open(path));
+        CLogDB::CBatch batch;
+        for (int i = 0; i < 100; i++)
+            batch.Write(strprintf("key%03d", i), strprintf("value%d", i));
+        BOOST_CHECK(logdb.WriteBatch(batch));
+        batch.Clear();
+        batch.Erase("key050");
+        BOOST_CHECK(logdb.WriteBatch(batch));
+    }
+
+    // Simulate a crash in the middle of appending a batch
+    int64 nGoodSize = boost::filesystem::file_size(path);
+    FILE* file = fopen(path.string().c_str(), "ab");
+    BOOST_CHECK(file != NULL);
+    const char garbage[] = "BTKV\x40\x00\x00\x00partial";
+    fwrite(garbage, sizeof(garbage), 1, file);
+    fclose(file);
+
+    {
+        CLogDB logdb;
+        BOOST_CHECK(logdb.Open(path));
+        BOOST_CHECK_EQUAL(logdb.GetCount(), 99U);
+        BOOST_CHECK_EQUAL(logdb.GetFileSize(), nGoodSize);
+        string strValue;
+        BOOST_CHECK(logdb.Read("key099", strValue) && strValue == "value99");
+        BOOST_CHECK(!logdb.Exists("key050"));
+
+        // New batches follow the last good one
+        CLogDB::CBatch batch;
+        batch.Write("key050", "again");
+        BOOST_CHECK(logdb.WriteBatch(batch));
+    }
+    {
+        CLogDB logdb;
+        BOOST_CHECK(logdb.Open(path));
+        string strValue;
+        BOOST_CHECK(logdb.Read("key050", strValue) && strValue == "again");
+        BOOST_CHECK_EQUAL(logdb.GetCount(), 100U);
+    }
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,183 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(mempool_tests)
+
+static CTransaction MakeSpend(const uint256& hashPrev, unsigned int n, int64 nValue)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(hashPrev, n);
+    tx.vin[0].scriptSig = CScript() << OP_1;
+    tx.vout.resize(2);
+    tx.vout[0].nValue = nValue;
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    tx.vout[1].nValue = nValue;
+    tx.vout[1].scriptPubKey = CScript() << OP_TRUE;
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(mempool_entry_links)
+{
+    CTxMemPool pool;
+    CTransaction txParent = MakeSpend(GetRandHash(), 0, 10 * COIN);
+    uint256 hashParent = txParent.GetHash();
+    CTransaction txChild = MakeSpend(hashParent, 1, 4 * COIN);
+    uint256 hashChild = txChild.GetHash();
+
+    // The child arrives first, as when a reorganization resurrects its parent
+    pool.addUnchecked(hashChild, txChild);
+    BOOST_CHECK(pool.mapEntry[hashChild].setDependsOn.empty());
+    pool.addUnchecked(hashParent, txParent);
+    BOOST_CHECK(pool.mapEntry[hashChild].setDependsOn.count(hashParent));
+    BOOST_CHECK(pool.mapEntry[hashParent].setDependers.count(hashChild));
+    BOOST_CHECK_EQUAL(pool.mapEntry[hashChild].nTxSize, ::GetSerializeSize(txChild, SER_NETWORK, PROTOCOL_VERSION));
+
+    // Inputs from the pool count towards the fee but not the priority
+    MapPrevTx mapInputs;
+    mapInputs[hashParent].first = CTxIndex();
+    mapInputs[hashParent].second = txParent;
+    CTxMemPoolEntry& entry = pool.mapEntry[hashChild];
+    entry.SetInputs(txChild, mapInputs);
+    BOOST_CHECK(entry.fInputs);
+    BOOST_CHECK_EQUAL(entry.nFee, 2 * COIN);
+    BOOST_CHECK_EQUAL(entry.nValueInChain, 0);
+    BOOST_CHECK_EQUAL(entry.GetPriority(nBestHeight + 10), 0.0);
+    BOOST_CHECK_EQUAL(entry.GetFeePerKb(), double(2 * COIN) / (double(entry.nTxSize) / 1000.0));
+
+    // Mining the parent leaves the child without dependencies
+    pool.remove(txParent);
+    BOOST_CHECK(!pool.mapEntry.count(hashParent));
+    BOOST_CHECK(pool.mapEntry[hashChild].setDependsOn.empty());
+    BOOST_CHECK(!pool.mapEntry[hashChild].fInputs);
+
+    pool.clear();
+    BOOST_CHECK(pool.mapEntry.empty());
+    BOOST_CHECK(pool.setFeePerKb.empty());
+}
+
+BOOST_AUTO_TEST_CASE(mempool_fee_order)
+{
+    CTxMemPool pool;
+    CTransaction txParent = MakeSpend(GetRandHash(), 0, 100 * COIN);
+    uint256 hashParent = txParent.GetHash();
+    pool.addUnchecked(hashParent, txParent);
+
+    MapPrevTx mapInputs;
+    mapInputs[hashParent].first = CTxIndex();
+    mapInputs[hashParent].second = txParent;
+    vector<uint256> vExpected;
+    for (int i = 0; i < 2; i++)
+    {
+        // Output 0 pays the smaller fee
+        CTransaction tx = MakeSpend(hashParent, i, (i == 0 ? 49 : 45) * COIN);
+        pool.addUnchecked(tx.GetHash(), tx, mapInputs);
+        vExpected.push_back(tx.GetHash());
+    }
+
+    // Lowest fee rate first, the order TrimToSize evicts in
+    vector<uint256> vtxid;
+    for (set<pair<double, uint256> >::iterator it = pool.setFeePerKb.begin(); it != pool.setFeePerKb.end(); ++it)
+        if ((*it).second != hashParent)
+            vtxid.push_back((*it).second);
+    BOOST_CHECK(vtxid == vExpected);
+}
+
+BOOST_AUTO_TEST_CASE(mempool_trim)
+{
+    CTxMemPool pool;
+    CTransaction txParent = MakeSpend(GetRandHash(), 0, 100 * COIN);
+    uint256 hashParent = txParent.GetHash();
+    MapPrevTx mapInputs;
+    mapInputs[txParent.vin[0].prevout.hash].first = CTxIndex();
+    mapInputs[txParent.vin[0].prevout.hash].second = MakeSpend(GetRandHash(), 0, 201 * COIN);
+    pool.addUnchecked(hashParent, txParent, mapInputs); // fee 1 COIN
+    BOOST_CHECK(pool.nTotalUsage > ::GetSerializeSize(txParent, SER_NETWORK, PROTOCOL_VERSION));
+
+    // A low fee child of the parent, and an unrelated high fee transaction
+    MapPrevTx mapInputsChild;
+    mapInputsChild[hashParent].first = CTxIndex();
+    mapInputsChild[hashParent].second = txParent;
+    CTransaction txChild = MakeSpend(hashParent, 0, 50 * COIN - 1);
+    pool.addUnchecked(txChild.GetHash(), txChild, mapInputsChild); // fee 2 satoshi
+
+    CTransaction txOther = MakeSpend(GetRandHash(), 0, 10 * COIN);
+    mapInputs.clear();
+    mapInputs[txOther.vin[0].prevout.hash].first = CTxIndex();
+    mapInputs[txOther.vin[0].prevout.hash].second = MakeSpend(GetRandHash(), 0, 40 * COIN);
+    pool.addUnchecked(txOther.GetHash(), txOther, mapInputs); // fee 20 COIN
+
+    // Within the limit nothing goes
+    BOOST_CHECK_EQUAL(pool.TrimToSize(pool.nTotalUsage), 0U);
+
+    // The child has the lowest fee rate and goes first, then the parent
+    uint64 nUsageOther = pool.mapEntry[txOther.GetHash()].nUsage;
+    BOOST_CHECK_EQUAL(pool.TrimToSize(pool.nTotalUsage - 1), 1U);
+    BOOST_CHECK(!pool.exists(txChild.GetHash()));
+    pool.addUnchecked(txChild.GetHash(), txChild, mapInputsChild);
+    BOOST_CHECK_EQUAL(pool.TrimToSize(nUsageOther), 2U);
+    BOOST_CHECK(!pool.exists(hashParent));
+    BOOST_CHECK(!pool.exists(txChild.GetHash()));
+    BOOST_CHECK(pool.exists(txOther.GetHash()));
+    BOOST_CHECK_EQUAL(pool.nTotalUsage, nUsageOther);
+
+    // Evicting a parent takes the transactions spending it along
+    pool.addUnchecked(hashParent, txParent);
+    pool.addUnchecked(txChild.GetHash(), txChild);
+    BOOST_CHECK_EQUAL(pool.removeWithDependers(hashParent), 2U);
+    pool.removeWithDependers(txOther.GetHash());
+    BOOST_CHECK_EQUAL(pool.nTotalUsage, 0U);
+    BOOST_CHECK(pool.mapNextTx.empty());
+}
+
+BOOST_AUTO_TEST_CASE(mempool_trim_stale_inputs)
+{
+    CTxMemPool pool;
+    CTransaction txParent = MakeSpend(GetRandHash(), 0, 100 * COIN);
+    uint256 hashParent = txParent.GetHash();
+    MapPrevTx mapInputs;
+    mapInputs[txParent.vin[0].prevout.hash].first = CTxIndex();
+    mapInputs[txParent.vin[0].prevout.hash].second = MakeSpend(GetRandHash(), 0, 201 * COIN);
+    pool.addUnchecked(hashParent, txParent, mapInputs);
+
+    // A high fee child of the parent, and an unrelated lower fee transaction
+    MapPrevTx mapInputsChild;
+    mapInputsChild[hashParent].first = CTxIndex();
+    mapInputsChild[hashParent].second = txParent;
+    CTransaction txChild = MakeSpend(hashParent, 0, 10 * COIN);
+    uint256 hashChild = txChild.GetHash();
+    pool.addUnchecked(hashChild, txChild, mapInputsChild); // fee 80 COIN
+
+    CTransaction txOther = MakeSpend(GetRandHash(), 0, 10 * COIN);
+    uint256 hashOther = txOther.GetHash();
+    mapInputs.clear();
+    mapInputs[txOther.vin[0].prevout.hash].first = CTxIndex();
+    mapInputs[txOther.vin[0].prevout.hash].second = MakeSpend(GetRandHash(), 0, 40 * COIN);
+    pool.addUnchecked(hashOther, txOther, mapInputs); // fee 20 COIN
+
+    // Mining the parent leaves the child's priority to work out again, but
+    // it keeps its fee rate, and the lower fee transaction goes first
+    pool.remove(txParent);
+    BOOST_CHECK(!pool.mapEntry[hashChild].fInputs);
+    BOOST_CHECK_EQUAL(pool.mapEntry[hashChild].nFee, 80 * COIN);
+    BOOST_CHECK_EQUAL(pool.setFeePerKb.size(), 2U);
+    BOOST_CHECK((*pool.setFeePerKb.begin()).second == hashOther);
+    BOOST_CHECK_EQUAL(pool.TrimToSize(pool.nTotalUsage - 1), 1U);
+    BOOST_CHECK(!pool.exists(hashOther));
+    BOOST_CHECK(pool.exists(hashChild));
+
+    // A transaction added without its inputs has no fee yet and goes first
+    pool.addUnchecked(hashOther, txOther);
+    BOOST_CHECK((*pool.setFeePerKb.begin()).second == hashOther);
+    BOOST_CHECK_EQUAL(pool.TrimToSize(pool.nTotalUsage - 1), 1U);
+    BOOST_CHECK(!pool.exists(hashOther));
+    BOOST_CHECK(pool.exists(hashChild));
+    pool.remove(txChild);
+    BOOST_CHECK(pool.setFeePerKb.empty());
+    BOOST_CHECK_EQUAL(pool.nTotalUsage, 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,74 @@
+#include <boost/test/unit_test.hpp>
+
+#include "net.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(message_tests)
+
+// Frame a payload the way CNode::EndMessage does
+static CDataStream Frame(const char* pszCommand, const CDataStream& payload, bool fBadChecksum=false)
+{
+    CMessageHeader hdr(pszCommand, payload.size());
+    uint256 hash = Hash(payload.begin(), payload.end());
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+    if (fBadChecksum)
+        hdr.nChecksum ^= 1;
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << hdr;
+    ss += payload;
+    return ss;
+}
+
+BOOST_AUTO_TEST_CASE(message_assembler)
+{
+    CDataStream ping(SER_NETWORK, PROTOCOL_VERSION);
+    ping << (uint64)12345;
+    CDataStream inv(SER_NETWORK, PROTOCOL_VERSION);
+    for (int i = 0; i < 1000; i++)
+        inv << GetRandHash();
+
+    // Garbage, two good messages around a corrupt one, and a partial message
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << (unsigned int)0x12345678 << (unsigned char)pchMessageStart[0];
+    stream += Frame("ping", ping);
+    stream += Frame("inv", inv, true);
+    stream += Frame("inv", inv);
+    CDataStream partial = Frame("ping", ping);
+    stream.write(&partial[0], partial.size() - 1);
+
+    // Feed it in pieces of varying size
+    for (int nChunk = 1; nChunk <= 4096; nChunk *= 8)
+    {
+        CMessageAssembler assembler;
+        deque<CNetMessage> vMsg;
+        for (unsigned int nPos = 0; nPos < stream.size(); nPos += nChunk)
+            assembler.Receive(&stream[nPos], min((unsigned int)nChunk, (unsigned int)stream.size() - nPos), vMsg, PROTOCOL_VERSION);
+
+        BOOST_CHECK_EQUAL(assembler.nSkippedBytes, 5U);
+        BOOST_CHECK_EQUAL(assembler.nBadMessages, 1U);
+        BOOST_REQUIRE_EQUAL(vMsg.size(), 3U);
+        BOOST_CHECK(vMsg[0].fComplete && vMsg[0].strCommand == "ping");
+        uint64 nNonce;
+        vMsg[0].vRecv >> nNonce;
+        BOOST_CHECK_EQUAL(nNonce, 12345U);
+        BOOST_CHECK(vMsg[1].fComplete && vMsg[1].strCommand == "inv");
+        BOOST_CHECK(vMsg[1].vRecv.str() == inv.str());
+        BOOST_CHECK(!vMsg[2].fComplete);
+
+        // The last byte completes the partial message
+        assembler.Receive(&partial[partial.size() - 1], 1, vMsg, PROTOCOL_VERSION);
+        BOOST_CHECK(vMsg[2].fComplete && vMsg[2].vRecv.str() == ping.str());
+    }
+
+    // A message without payload is complete as soon as its header is
+    CMessageAssembler assembler;
+    deque<CNetMessage> vMsg;
+    CDataStream verack = Frame("verack", CDataStream(SER_NETWORK, PROTOCOL_VERSION));
+    assembler.Receive(&verack[0], verack.size(), vMsg, PROTOCOL_VERSION);
+    BOOST_REQUIRE_EQUAL(vMsg.size(), 1U);
+    BOOST_CHECK(vMsg[0].fComplete && vMsg[0].vRecv.empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -250,6 +250,55 @@ BOOST_AUTO_TEST_CASE(multisig_Solver1)
     }
 }
 
+BOOST_AUTO_TEST_CASE(multisig_IsMine_lookup)
+{
+    CBasicKeyStore keystore;
+    CKey key[3];
+    for (int i = 0; i < 3; i++)
+        key[i].MakeNewKey(i != 1);
+    keystore.AddKey(key[0]);
+    keystore.AddKey(key[1]);
+
+    // Pay to pubkey, either size, and pay to pubkey hash
+    for (int i = 0; i < 3; i++)
+    {
+        CScript s;
+        s << key[i].GetPubKey() << OP_CHECKSIG;
+        BOOST_CHECK(s.IsPayToPubKey());
+        BOOST_CHECK_EQUAL(IsMine(keystore, s), i < 2);
+        s.SetDestination(key[i].GetPubKey().GetID());
+        BOOST_CHECK(s.IsPayToPubKeyHash());
+        BOOST_CHECK_EQUAL(IsMine(keystore, s), i < 2);
+    }
+
+    // The same hash pushed with OP_PUSHDATA1 takes the Solver() path
+    CKeyID keyID = key[0].GetPubKey().GetID();
+    CScript s;
+    s << OP_DUP << OP_HASH160;
+    s.push_back(OP_PUSHDATA1);
+    s.push_back(20);
+    s.insert(s.end(), (unsigned char*)&keyID, (unsigned char*)&keyID + 20);
+    s << OP_EQUALVERIFY << OP_CHECKSIG;
+    BOOST_CHECK(!s.IsPayToPubKeyHash());
+    BOOST_CHECK(IsMine(keystore, s));
+
+    // Pay to script hash needs the script, and the script must be ours
+    CScript redeem;
+    redeem << OP_2 << key[0].GetPubKey() << key[1].GetPubKey() << OP_2 << OP_CHECKMULTISIG;
+    CScript partial;
+    partial << OP_2 << key[0].GetPubKey() << key[2].GetPubKey() << OP_2 << OP_CHECKMULTISIG;
+    CScript p2sh, p2shPartial;
+    p2sh.SetDestination(redeem.GetID());
+    p2shPartial.SetDestination(partial.GetID());
+    BOOST_CHECK(!IsMine(keystore, p2sh));
+    keystore.AddCScript(redeem);
+    keystore.AddCScript(partial);
+    BOOST_CHECK(IsMine(keystore, p2sh));
+    BOOST_CHECK(!IsMine(keystore, p2shPartial));
+    keystore.AddKey(key[2]);
+    BOOST_CHECK(IsMine(keystore, p2shPartial));
+}
+
 BOOST_AUTO_TEST_CASE(multisig_Sign)
 {
     // Test SignSignature() (and therefore the version of Solver() that signs transactions)
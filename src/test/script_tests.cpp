@@ -261,6 +261,42 @@ BOOST_AUTO_TEST_CASE(script_CHECKMULTISIG12)
     BOOST_CHECK(!VerifyScript(badsig1, scriptPubKey12, txTo12, 0, true, 0));
 }
 
+BOOST_AUTO_TEST_CASE(script_sigcache)
+{
+    CKey key;
+    key.MakeNewKey(true);
+
+    CScript scriptPubKey;
+    scriptPubKey << key.GetPubKey() << OP_CHECKSIG;
+
+    CTransaction txTo;
+    txTo.vin.resize(1);
+    txTo.vout.resize(1);
+    txTo.vout[0].nValue = 1;
+
+    uint256 hash = SignatureHash(scriptPubKey, txTo, 0, SIGHASH_ALL);
+    vector<unsigned char> vchSig;
+    BOOST_CHECK(key.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    CScript scriptSig;
+    scriptSig << vchSig;
+
+    uint64 nSize, nHits, nMisses, nHits2, nMisses2;
+    GetSignatureCacheStats(nSize, nHits, nMisses);
+
+    // First check is a miss that fills the cache, second one is a hit
+    BOOST_CHECK(VerifyScript(scriptSig, scriptPubKey, txTo, 0, true, 0));
+    BOOST_CHECK(VerifyScript(scriptSig, scriptPubKey, txTo, 0, true, 0));
+    GetSignatureCacheStats(nSize, nHits2, nMisses2);
+    BOOST_CHECK_EQUAL(nHits2 - nHits, 1U);
+    BOOST_CHECK_EQUAL(nMisses2 - nMisses, 1U);
+    BOOST_CHECK(nSize > 0);
+
+    // A different sighash must not be served from the cache
+    txTo.vout[0].nValue = 2;
+    BOOST_CHECK(!VerifyScript(scriptSig, scriptPubKey, txTo, 0, true, 0));
+}
+
 BOOST_AUTO_TEST_CASE(script_CHECKMULTISIG23)
 {
     CKey key1, key2, key3, key4;
@@ -0,0 +1,132 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "txcache.h"
+#include "wallet.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(txcache_tests)
+
+BOOST_AUTO_TEST_CASE(txcache_writeback)
+{
+    CTxCache cache;
+    cache.SetMaxSize(64 * 1024);
+
+    string strValue;
+    bool fFound;
+    BOOST_CHECK(!cache.Get("a", strValue, fFound));
+
+    // Committed writes stay dirty
+    CLogDB::CBatch batch;
+    batch.Write("a", "1");
+    batch.Erase("b");
+    cache.Write(batch);
+    BOOST_CHECK(cache.Get("a", strValue, fFound) && fFound && strValue == "1");
+    BOOST_CHECK(cache.Get("b", strValue, fFound) && !fFound);
+
+    CLogDB::CBatch batchDirty;
+    cache.GetDirty(batchDirty);
+    BOOST_CHECK_EQUAL(batchDirty.mapWrites.size(), 2U);
+    BOOST_CHECK(!cache.NeedsFlush());
+
+    // A write that lands after the flush started stays dirty
+    batch.Clear();
+    batch.Write("a", "2");
+    cache.Write(batch);
+    cache.SetFlushed(batchDirty);
+    CLogDB::CBatch batchDirty2;
+    cache.GetDirty(batchDirty2);
+    BOOST_CHECK_EQUAL(batchDirty2.mapWrites.size(), 1U);
+    BOOST_CHECK(batchDirty2.mapWrites["a"].second == "2");
+    cache.SetFlushed(batchDirty2);
+    BOOST_CHECK(!cache.Get("b", strValue, fFound));
+
+    // Clean entries are dropped to fit the budget, dirty ones never
+    batch.Clear();
+    for (int i = 0; i < 200; i++)
+        batch.Write(strprintf("dirty%03d", i), string(100, 'x'));
+    cache.Write(batch);
+    for (int i = 0; i < 200; i++)
+        cache.AddClean(strprintf("clean%03d", i), string(100, 'y'));
+    BOOST_CHECK(cache.NeedsFlush());
+    BOOST_CHECK(!cache.Get("clean000", strValue, fFound));
+    for (int i = 0; i < 200; i++)
+        BOOST_CHECK(cache.Get(strprintf("dirty%03d", i), strValue, fFound) && fFound);
+
+    batchDirty.Clear();
+    cache.GetDirty(batchDirty);
+    BOOST_CHECK_EQUAL(batchDirty.mapWrites.size(), 200U);
+    cache.SetFlushed(batchDirty);
+    BOOST_CHECK(!cache.NeedsFlush());
+    int64 nSize, nDirty;
+    uint64 nHits, nMisses;
+    cache.GetStats(nSize, nDirty, nHits, nMisses);
+    BOOST_CHECK(nSize <= 32 * 1024);
+    BOOST_CHECK_EQUAL(nDirty, 0);
+}
+
+BOOST_AUTO_TEST_CASE(txcache_outputs)
+{
+    CTxCache cache;
+    CKey key;
+    key.MakeNewKey(true);
+    CBasicKeyStore keystore;
+    keystore.AddKey(key);
+
+    CTransaction txFrom;
+    txFrom.nTime = 1400000000;
+    txFrom.vin.resize(2);
+    txFrom.vin[0].prevout = COutPoint(GetRandHash(), 3);
+    txFrom.vin[0].scriptSig = CScript() << vector<unsigned char>(72, 1);
+    txFrom.vout.resize(2);
+    txFrom.vout[0].nValue = 5 * COIN;
+    txFrom.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    txFrom.vout[1].nValue = 7 * COIN;
+
+    CDiskTxPos pos(1, 100, 181);
+    CTransaction txPrev;
+    BOOST_CHECK(!cache.GetOutputs(pos, txPrev));
+    cache.AddOutputs(pos, txFrom);
+    BOOST_CHECK(!cache.GetOutputs(CDiskTxPos(2, 100, 181), txPrev));
+    BOOST_CHECK(cache.GetOutputs(pos, txPrev));
+    BOOST_CHECK(txPrev.vout == txFrom.vout);
+    BOOST_CHECK_EQUAL(txPrev.nTime, txFrom.nTime);
+    BOOST_CHECK(!txPrev.IsCoinBase() && !txPrev.IsCoinStake());
+
+    // Spending it verifies against the cached outputs alone
+    CTransaction txTo;
+    txTo.vin.resize(1);
+    txTo.vin[0].prevout = COutPoint(txFrom.GetHash(), 0);
+    txTo.vout.resize(1);
+    txTo.vout[0].nValue = 1 * COIN;
+    BOOST_CHECK(SignSignature(keystore, txFrom, txTo, 0));
+    BOOST_CHECK(CScriptCheck(txPrev, txTo, 0, true, 0)());
+    MapPrevTx inputs;
+    inputs[txFrom.GetHash()].second = txPrev;
+    BOOST_CHECK_EQUAL(txTo.GetValueIn(inputs), 5 * COIN);
+
+    // Coinbase and coinstake survive the round trip
+    CTransaction txCoinBase;
+    txCoinBase.vin.resize(1);
+    txCoinBase.vin[0].scriptSig = CScript() << 486604799;
+    txCoinBase.vout.resize(1);
+    txCoinBase.vout[0].nValue = 50 * COIN;
+    BOOST_CHECK(txCoinBase.IsCoinBase());
+    cache.AddOutputs(CDiskTxPos(1, 200, 281), txCoinBase);
+    BOOST_CHECK(cache.GetOutputs(CDiskTxPos(1, 200, 281), txPrev) && txPrev.IsCoinBase());
+
+    CTransaction txCoinStake(txFrom);
+    txCoinStake.vout[0].SetEmpty();
+    BOOST_CHECK(txCoinStake.IsCoinStake());
+    cache.AddOutputs(CDiskTxPos(1, 300, 381), txCoinStake);
+    BOOST_CHECK(cache.GetOutputs(CDiskTxPos(1, 300, 381), txPrev) && txPrev.IsCoinStake());
+
+    int64 nSize, nDirty;
+    uint64 nHits, nMisses;
+    cache.GetStats(nSize, nDirty, nHits, nMisses);
+    BOOST_CHECK_EQUAL(nHits, 3U);
+    BOOST_CHECK_EQUAL(nMisses, 2U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
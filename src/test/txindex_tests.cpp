@@ -0,0 +1,162 @@
+#include <boost/test/unit_test.hpp>
+
+#include "db.h"
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(txindex_tests)
+
+// CTxDB with access to the raw records
+class CTestTxDB : public CTxDB
+{
+public:
+    CTestTxDB() : CTxDB("r+") {}
+
+    bool WriteLegacyTxIndex(uint256 hash, const CTxIndex& txindex)
+    {
+        // client version, pos, vSpent, as written before the compact format
+        return Write(make_pair(string("tx"), hash), make_pair(CLIENT_VERSION, make_pair(txindex.pos, txindex.vSpent)));
+    }
+
+    bool IsLegacyRecord(uint256 hash)
+    {
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        return ReadRaw(make_pair(string("tx"), hash), ssValue) && CTxIndex::IsLegacyFormat(ssValue);
+    }
+
+private:
+    struct CRawValue
+    {
+        CDataStream* pss;
+        template<typename Stream>
+        void Unserialize(Stream& s, int nType, int nVersion)
+        {
+            pss->write(&s[0], s.size());
+            s.ignore(s.size());
+        }
+    };
+
+    template<typename K>
+    bool ReadRaw(const K& key, CDataStream& ssValue)
+    {
+        CRawValue raw;
+        raw.pss = &ssValue;
+        return Read(key, raw);
+    }
+};
+
+BOOST_AUTO_TEST_CASE(txindex_varint)
+{
+    uint64 values[] = { 0, 1, 127, 128, 255, 256, 16383, 16384, 16511, 65535, 0xffffffffULL, 0x100000000ULL, ~(uint64)0 };
+    unsigned int sizes[] = { 1, 1, 1, 2, 2, 2, 2, 2, 2, 3, 5, 5, 10 };
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    for (unsigned int i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+    {
+        unsigned int nSizeBefore = ss.size();
+        WriteVarInt(ss, values[i]);
+        BOOST_CHECK_EQUAL(ss.size() - nSizeBefore, sizes[i]);
+        BOOST_CHECK_EQUAL(GetSizeOfVarInt(values[i]), sizes[i]);
+    }
+    for (unsigned int i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+    {
+        uint64 n = ReadVarInt<CDataStream, uint64>(ss);
+        BOOST_CHECK(n == values[i]);
+    }
+    BOOST_CHECK(ss.empty());
+
+    // Encodings from the table in serialize.h
+    CDataStream ss2(SER_DISK, CLIENT_VERSION);
+    WriteVarInt(ss2, 65535U);
+    WriteVarInt(ss2, 0x100000000ULL);
+    BOOST_CHECK_EQUAL(HeRETr(ss2.begin(), ss2.end()), string("82fe7f8efefeff00"));
+
+    // Corrupt input that does not fit the type is rejected
+    CDataStream ss3(SER_DISK, CLIENT_VERSION);
+    WriteVarInt(ss3, 0x100000000ULL);
+    BOOST_CHECK_THROW((ReadVarInt<CDataStream, unsigned int>(ss3)), std::ios_base::failure);
+    CDataStream ss4(SER_DISK, CLIENT_VERSION);
+    for (int i = 0; i < 11; i++)
+        ss4 << (unsigned char)0xff;
+    BOOST_CHECK_THROW((ReadVarInt<CDataStream, uint64>(ss4)), std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_CASE(txindex_compact_roundtrip)
+{
+    CTxIndex txindex(CDiskTxPos(2, 123456789, 123456789 + 81), 20);
+    txindex.vSpent[3] = CDiskTxPos(2, 123460000, 123460300);
+    txindex.vSpent[19] = CDiskTxPos(3, 500, 581);
+    txindex.vSpent[7] = CDiskTxPos(1, 1, 1); // memory pool marker, nTxPos == nBlockPos
+
+    // Until the index is converted records keep the original format
+    BOOST_CHECK(!fTxIndexCompact);
+    CDataStream ssOld(SER_DISK, CLIENT_VERSION);
+    ssOld << txindex;
+    BOOST_CHECK(CTxIndex::IsLegacyFormat(ssOld));
+    BOOST_CHECK_EQUAL(ssOld.size(), ::GetSerializeSize(txindex, SER_DISK, CLIENT_VERSION));
+    int nVersion;
+    CDiskTxPos pos;
+    vector<CDiskTxPos> vSpent;
+    ssOld >> nVersion >> pos >> vSpent;
+    BOOST_CHECK(nVersion == CLIENT_VERSION && pos == txindex.pos && vSpent == txindex.vSpent);
+
+    fTxIndexCompact = true;
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << txindex;
+    BOOST_CHECK(!CTxIndex::IsLegacyFormat(ss));
+    BOOST_CHECK_EQUAL(ss.size(), ::GetSerializeSize(txindex, SER_DISK, CLIENT_VERSION));
+    CTxIndex txindex2;
+    ss >> txindex2;
+    BOOST_CHECK(txindex == txindex2);
+    BOOST_CHECK(ss.empty());
+
+    // Original format is still read
+    CDataStream ssLegacy(SER_DISK, CLIENT_VERSION);
+    ssLegacy << CLIENT_VERSION << txindex.pos << txindex.vSpent;
+    BOOST_CHECK(CTxIndex::IsLegacyFormat(ssLegacy));
+    unsigned int nLegacySize = ssLegacy.size();
+    CTxIndex txindex3;
+    ssLegacy >> txindex3;
+    BOOST_CHECK(txindex == txindex3);
+
+    // A fresh two-output record
+    CTxIndex txindexNew(CDiskTxPos(1, 50000000, 50000000 + 300), 2);
+    unsigned int nCompact = ::GetSerializeSize(txindexNew, SER_DISK, CLIENT_VERSION);
+    BOOST_CHECK(nCompact <= 13);
+    BOOST_TEST_MESSAGE(strprintf("20 outputs, 3 spent: %u -> %u bytes; 2 outputs: %u bytes", nLegacySize, ::GetSerializeSize(txindex, SER_DISK, CLIENT_VERSION), nCompact));
+    fTxIndexCompact = false;
+}
+
+BOOST_AUTO_TEST_CASE(txindex_convert)
+{
+    vector<pair<uint256, CTxIndex> > vRecords;
+    for (int i = 0; i < 500; i++)
+    {
+        CTxIndex txindex(CDiskTxPos(1, 1000 * i, 1000 * i + 81), 1 + i % 5);
+        if (i % 3 == 0)
+            txindex.vSpent[0] = CDiskTxPos(1, 1000 * i + 5000, 1000 * i + 5200);
+        vRecords.push_back(make_pair(GetRandHash(), txindex));
+    }
+
+    CTestTxDB txdb;
+    BOOST_CHECK(txdb.TxnBegin());
+    for (unsigned int i = 0; i < vRecords.size(); i++)
+        BOOST_CHECK(txdb.WriteLegacyTxIndex(vRecords[i].first, vRecords[i].second));
+    BOOST_CHECK(txdb.TxnCommit());
+
+    // Legacy records read as before, and are compact once converted
+    CTxIndex txindex;
+    BOOST_CHECK(txdb.IsLegacyRecord(vRecords[0].first));
+    BOOST_CHECK(txdb.ReadTxIndex(vRecords[0].first, txindex) && txindex == vRecords[0].second);
+    fTxIndexCompact = true;
+    BOOST_CHECK(txdb.CompactTxIndex());
+    for (unsigned int i = 0; i < vRecords.size(); i++)
+    {
+        BOOST_CHECK(!txdb.IsLegacyRecord(vRecords[i].first));
+        BOOST_CHECK(txdb.ReadTxIndex(vRecords[i].first, txindex) && txindex == vRecords[i].second);
+    }
+    fTxIndexCompact = false;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
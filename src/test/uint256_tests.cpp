@@ -1,6 +1,8 @@
 #include <boost/test/unit_test.hpp>
 
 #include "uint256.h"
+#include "bignum.h"
+#include "main.h"
 
 BOOST_AUTO_TEST_SUITE(uint256_tests)
 
@@ -15,4 +17,48 @@ BOOST_AUTO_TEST_CASE(uint256_equality)
     BOOST_CHECK(num1+num2 == num3+num2);
 }
 
+BOOST_AUTO_TEST_CASE(uint256_division)
+{
+    uint256 num = ~uint256(0);
+    BOOST_CHECK(num / uint256(1) == num);
+    BOOST_CHECK(num / num == uint256(1));
+    BOOST_CHECK(uint256(7) / uint256(8) == uint256(0));
+    BOOST_CHECK(uint256(1000000) / uint256(7) == uint256(142857));
+    BOOST_CHECK((num >> 20) / uint256(0x10000) == num >> 36);
+    BOOST_CHECK_THROW(num / uint256(0), std::domain_error);
+
+    for (int i = 0; i < 64; i++)
+    {
+        uint256 a = GetRandHash();
+        uint256 b = GetRandHash() >> (i * 4);
+        if (b == 0)
+            continue;
+        CBigNum bnQuotient = CBigNum(a) / CBigNum(b);
+        BOOST_CHECK((a / b) == bnQuotient.getuint256());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(uint256_block_trust)
+{
+    // GetBlockTrust() must match the CBigNum arithmetic it replaced
+    unsigned int vBits[] = { 0x1d00ffff, 0x1e0fffff, 0x1f00ffff, 0x207fffff, 0x1b0404cb, 0x03123456, 0x01003456, 0x00000000, 0x1d80ffff };
+    CBigNum bnProofOfWorkLimit(~uint256(0) >> 20);
+    BOOST_FOREACH(unsigned int nBits, vBits)
+    {
+        CBlockIndex index;
+        index.nBits = nBits;
+        CBigNum bnTarget;
+        bnTarget.SetCompact(nBits);
+
+        CBigNum bnPoWTrust = bnTarget <= 0 ? 0 : bnProofOfWorkLimit / (bnTarget+1);
+        if (bnTarget > 0 && bnPoWTrust <= 1)
+            bnPoWTrust = 1;
+        BOOST_CHECK(index.GetBlockTrust() == bnPoWTrust.getuint256());
+
+        index.SetProofOfStake();
+        CBigNum bnPoSTrust = bnTarget <= 0 ? 0 : (CBigNum(1)<<256) / (bnTarget+1);
+        BOOST_CHECK(index.GetBlockTrust() == bnPoSTrust.getuint256());
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -1,5 +1,6 @@
 #include <boost/test/unit_test.hpp>
 
+#include "init.h"
 #include "main.h"
 #include "wallet.h"
 
@@ -64,24 +65,24 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
         empty_wallet();
 
         // with an empty wallet we can't even pay one cent
-        BOOST_CHECK(!wallet.SelectCoinsMinConf( 1 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK(!wallet.SelectCoinsMinConf( 1 * CENT, GetAdjustedTime(), 1, 6, vCoins, setCoinsRet, nValueRet));
 
         add_coin(1*CENT, 4);        // add a new 1 cent coin
 
         // with a new 1 cent coin, we still can't find a mature 1 cent
-        BOOST_CHECK(!wallet.SelectCoinsMinConf( 1 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK(!wallet.SelectCoinsMinConf( 1 * CENT, GetAdjustedTime(), 1, 6, vCoins, setCoinsRet, nValueRet));
 
         // but we can find a new 1 cent
-        BOOST_CHECK( wallet.SelectCoinsMinConf( 1 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf( 1 * CENT, GetAdjustedTime(), 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 1 * CENT);
 
         add_coin(2*CENT);           // add a mature 2 cent coin
 
         // we can't make 3 cents of mature coins
-        BOOST_CHECK(!wallet.SelectCoinsMinConf( 3 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK(!wallet.SelectCoinsMinConf( 3 * CENT, GetAdjustedTime(), 1, 6, vCoins, setCoinsRet, nValueRet));
 
         // we can make 3 cents of new  coins
-        BOOST_CHECK( wallet.SelectCoinsMinConf( 3 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf( 3 * CENT, GetAdjustedTime(), 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 3 * CENT);
 
         add_coin(5*CENT);           // add a mature 5 cent coin,
@@ -91,33 +92,33 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
         // now we have new: 1+10=11 (of which 10 was self-sent), and mature: 2+5+20=27.  total = 38
 
         // we can't make 38 cents only if we disallow new coins:
-        BOOST_CHECK(!wallet.SelectCoinsMinConf(38 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK(!wallet.SelectCoinsMinConf(38 * CENT, GetAdjustedTime(), 1, 6, vCoins, setCoinsRet, nValueRet));
         // we can't even make 37 cents if we don't allow new coins even if they're from us
-        BOOST_CHECK(!wallet.SelectCoinsMinConf(38 * CENT, 6, 6, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK(!wallet.SelectCoinsMinConf(38 * CENT, GetAdjustedTime(), 6, 6, vCoins, setCoinsRet, nValueRet));
         // but we can make 37 cents if we accept new coins from ourself
-        BOOST_CHECK( wallet.SelectCoinsMinConf(37 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(37 * CENT, GetAdjustedTime(), 1, 6, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 37 * CENT);
         // and we can make 38 cents if we accept all new coins
-        BOOST_CHECK( wallet.SelectCoinsMinConf(38 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(38 * CENT, GetAdjustedTime(), 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 38 * CENT);
 
         // try making 34 cents from 1,2,5,10,20 - we can't do it exactly
-        BOOST_CHECK( wallet.SelectCoinsMinConf(34 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(34 * CENT, GetAdjustedTime(), 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_GT(nValueRet, 34 * CENT);         // but should get more than 34 cents
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 3);     // the best should be 20+10+5.  it's incredibly unlikely the 1 or 2 got included (but possible)
 
         // when we try making 7 cents, the smaller coins (1,2,5) are enough.  We should see just 2+5
-        BOOST_CHECK( wallet.SelectCoinsMinConf( 7 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf( 7 * CENT, GetAdjustedTime(), 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 7 * CENT);
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 2);
 
         // when we try making 8 cents, the smaller coins (1,2,5) are exactly enough.
-        BOOST_CHECK( wallet.SelectCoinsMinConf( 8 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf( 8 * CENT, GetAdjustedTime(), 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK(nValueRet == 8 * CENT);
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 3);
 
         // when we try making 9 cents, no subset of smaller coins is enough, and we get the next bigger coin (10)
-        BOOST_CHECK( wallet.SelectCoinsMinConf( 9 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf( 9 * CENT, GetAdjustedTime(), 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 10 * CENT);
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 1);
 
@@ -131,30 +132,30 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
         add_coin(30*CENT); // now we have 6+7+8+20+30 = 71 cents total
 
         // check that we have 71 and not 72
-        BOOST_CHECK( wallet.SelectCoinsMinConf(71 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
-        BOOST_CHECK(!wallet.SelectCoinsMinConf(72 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(71 * CENT, GetAdjustedTime(), 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK(!wallet.SelectCoinsMinConf(72 * CENT, GetAdjustedTime(), 1, 1, vCoins, setCoinsRet, nValueRet));
 
         // now try making 16 cents.  the best smaller coins can do is 6+7+8 = 21; not as good at the next biggest coin, 20
-        BOOST_CHECK( wallet.SelectCoinsMinConf(16 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(16 * CENT, GetAdjustedTime(), 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 20 * CENT); // we should get 20 in one coin
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 1);
 
         add_coin( 5*CENT); // now we have 5+6+7+8+20+30 = 75 cents total
 
         // now if we try making 16 cents again, the smaller coins can make 5+6+7 = 18 cents, better than the next biggest coin, 20
-        BOOST_CHECK( wallet.SelectCoinsMinConf(16 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(16 * CENT, GetAdjustedTime(), 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 18 * CENT); // we should get 18 in 3 coins
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 3);
 
         add_coin( 18*CENT); // now we have 5+6+7+8+18+20+30
 
         // and now if we try making 16 cents again, the smaller coins can make 5+6+7 = 18 cents, the same as the next biggest coin, 18
-        BOOST_CHECK( wallet.SelectCoinsMinConf(16 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(16 * CENT, GetAdjustedTime(), 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 18 * CENT);  // we should get 18 in 1 coin
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 1); // because in the event of a tie, the biggest coin wins
 
         // now try making 11 cents.  we should get 5+6
-        BOOST_CHECK( wallet.SelectCoinsMinConf(11 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(11 * CENT, GetAdjustedTime(), 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 11 * CENT);
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 2);
 
@@ -163,11 +164,11 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
         add_coin( 2*COIN);
         add_coin( 3*COIN);
         add_coin( 4*COIN); // now we have 5+6+7+8+18+20+30+100+200+300+400 = 1094 cents
-        BOOST_CHECK( wallet.SelectCoinsMinConf(95 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(95 * CENT, GetAdjustedTime(), 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 1 * COIN);  // we should get 1 BTC in 1 coin
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 1);
 
-        BOOST_CHECK( wallet.SelectCoinsMinConf(195 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(195 * CENT, GetAdjustedTime(), 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 2 * COIN);  // we should get 2 BTC in 1 coin
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 1);
 
@@ -181,14 +182,14 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
 
         // try making 1 cent from 0.1 + 0.2 + 0.3 + 0.4 + 0.5 = 1.5 cents
         // we'll get sub-cent change whatever happens, so can expect 1.0 exactly
-        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, GetAdjustedTime(), 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 1 * CENT);
 
         // but if we add a bigger coin, making it possible to avoid sub-cent change, things change:
         add_coin(1111*CENT);
 
         // try making 1 cent from 0.1 + 0.2 + 0.3 + 0.4 + 0.5 + 1111 = 1112.5 cents
-        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, GetAdjustedTime(), 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 1 * CENT); // we should get the exact amount
 
         // if we add more sub-cent coins:
@@ -196,7 +197,7 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
         add_coin(0.7*CENT);
 
         // and try again to make 1.0 cents, we can still make 1.0 cents
-        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, GetAdjustedTime(), 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 1 * CENT); // we should get the exact amount
 
         // run the 'mtgox' test (see http://blockexplorer.com/tx/29a3efd3ef04f9153d47a990bd7b048a4b2d213daaa5fb8ed670fb85f13bdbcf)
@@ -205,7 +206,7 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
         for (int i = 0; i < 20; i++)
             add_coin(50000 * COIN);
 
-        BOOST_CHECK( wallet.SelectCoinsMinConf(500000 * COIN, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(500000 * COIN, GetAdjustedTime(), 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 500000 * COIN); // we should get the exact amount
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 10); // in ten coins
 
@@ -218,7 +219,7 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
         add_coin(0.6 * CENT);
         add_coin(0.7 * CENT);
         add_coin(1111 * CENT);
-        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, GetAdjustedTime(), 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 1111 * CENT); // we get the bigger coin
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 1);
 
@@ -228,7 +229,7 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
         add_coin(0.6 * CENT);
         add_coin(0.8 * CENT);
         add_coin(1111 * CENT);
-        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(1 * CENT, GetAdjustedTime(), 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 1 * CENT);   // we should get the exact amount
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 2); // in two coins 0.4+0.6
 
@@ -239,12 +240,12 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
         add_coin(1 * COIN);
 
         // trying to make 1.0001 from these three coins
-        BOOST_CHECK( wallet.SelectCoinsMinConf(1.0001 * COIN, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(1.0001 * COIN, GetAdjustedTime(), 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 1.0105 * COIN);   // we should get all coins
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 3);
 
         // but if we try to make 0.999, we should take the bigger of the two small coins to avoid sub-cent change
-        BOOST_CHECK( wallet.SelectCoinsMinConf(0.999 * COIN, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK( wallet.SelectCoinsMinConf(0.999 * COIN, GetAdjustedTime(), 1, 1, vCoins, setCoinsRet, nValueRet));
         BOOST_CHECK_EQUAL(nValueRet, 1.01 * COIN);   // we should get 1 + 0.01
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 2);
 
@@ -256,8 +257,8 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
 
             // picking 50 from 100 coins doesn't depend on the shuffle,
             // but does depend on randomness in the stochastic approximation code
-            BOOST_CHECK(wallet.SelectCoinsMinConf(50 * COIN, 1, 6, vCoins, setCoinsRet , nValueRet));
-            BOOST_CHECK(wallet.SelectCoinsMinConf(50 * COIN, 1, 6, vCoins, setCoinsRet2, nValueRet));
+            BOOST_CHECK(wallet.SelectCoinsMinConf(50 * COIN, GetAdjustedTime(), 1, 6, vCoins, setCoinsRet , nValueRet));
+            BOOST_CHECK(wallet.SelectCoinsMinConf(50 * COIN, GetAdjustedTime(), 1, 6, vCoins, setCoinsRet2, nValueRet));
             BOOST_CHECK(!equal_sets(setCoinsRet, setCoinsRet2));
 
             int fails = 0;
@@ -265,8 +266,8 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
             {
                 // selecting 1 from 100 identical coins depends on the shuffle; this test will fail 1% of the time
                 // run the test RANDOM_REPEATS times and only complain if all of them fail
-                BOOST_CHECK(wallet.SelectCoinsMinConf(COIN, 1, 6, vCoins, setCoinsRet , nValueRet));
-                BOOST_CHECK(wallet.SelectCoinsMinConf(COIN, 1, 6, vCoins, setCoinsRet2, nValueRet));
+                BOOST_CHECK(wallet.SelectCoinsMinConf(COIN, GetAdjustedTime(), 1, 6, vCoins, setCoinsRet , nValueRet));
+                BOOST_CHECK(wallet.SelectCoinsMinConf(COIN, GetAdjustedTime(), 1, 6, vCoins, setCoinsRet2, nValueRet));
                 if (equal_sets(setCoinsRet, setCoinsRet2))
                     fails++;
             }
@@ -282,8 +283,8 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
             {
                 // selecting 1 from 100 identical coins depends on the shuffle; this test will fail 1% of the time
                 // run the test RANDOM_REPEATS times and only complain if all of them fail
-                BOOST_CHECK(wallet.SelectCoinsMinConf(90*CENT, 1, 6, vCoins, setCoinsRet , nValueRet));
-                BOOST_CHECK(wallet.SelectCoinsMinConf(90*CENT, 1, 6, vCoins, setCoinsRet2, nValueRet));
+                BOOST_CHECK(wallet.SelectCoinsMinConf(90*CENT, GetAdjustedTime(), 1, 6, vCoins, setCoinsRet , nValueRet));
+                BOOST_CHECK(wallet.SelectCoinsMinConf(90*CENT, GetAdjustedTime(), 1, 6, vCoins, setCoinsRet2, nValueRet));
                 if (equal_sets(setCoinsRet, setCoinsRet2))
                     fails++;
             }
@@ -292,4 +293,278 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     }
 }
 
+BOOST_AUTO_TEST_CASE(wallet_balance_cache)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    BOOST_REQUIRE(pwalletMain->AddKey(key));
+
+    int64 nBalance = pwalletMain->GetBalance();
+    int64 nUnconfirmed = pwalletMain->GetUnconfirmedBalance();
+    vector<COutput> vAvailable;
+    pwalletMain->AvailableCoins(vAvailable, false);
+    unsigned int nAvailable = vAvailable.size();
+
+    // An unconfirmed payment from someone else, one output ours
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vout.resize(2);
+    tx.vout[0].nValue = 3 * COIN;
+    tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    tx.vout[1].nValue = 5 * COIN;
+    tx.vout[1].scriptPubKey = CScript() << OP_TRUE;
+    BOOST_REQUIRE(pwalletMain->AddToWallet(CWalletTx(pwalletMain, tx)));
+
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), nBalance);
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed + 3 * COIN);
+    pwalletMain->AvailableCoins(vAvailable, false);
+    BOOST_CHECK_EQUAL(vAvailable.size(), nAvailable + 1);
+    pwalletMain->AvailableCoins(vAvailable, true);
+    BOOST_CHECK(vAvailable.size() <= nAvailable);
+
+    // Changes to the spent flags reach the cached balances
+    CWalletTx& wtx = pwalletMain->mapWallet[tx.GetHash()];
+    wtx.MarkSpent(0);
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed);
+    pwalletMain->AvailableCoins(vAvailable, false);
+    BOOST_CHECK_EQUAL(vAvailable.size(), nAvailable);
+    wtx.MarkUnspent(0);
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed + 3 * COIN);
+
+    BOOST_CHECK(pwalletMain->EraseFromWallet(tx.GetHash()));
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed);
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), nBalance);
+}
+
+BOOST_AUTO_TEST_CASE(wallet_rescan)
+{
+    BOOST_REQUIRE(pindexGenesisBlock != NULL);
+
+    // The genesis block pays nobody in the wallet
+    BOOST_CHECK_EQUAL(pwalletMain->ScanForWalletTransactions(pindexGenesisBlock), 0);
+    CRescanProgress progress = pwalletMain->GetRescanProgress();
+    BOOST_CHECK(!progress.fActive);
+    BOOST_CHECK_EQUAL(progress.nStartHeight, 0);
+    BOOST_CHECK_EQUAL(progress.nHeight, nBestHeight);
+    BOOST_CHECK_EQUAL(progress.nEndHeight, nBestHeight);
+
+    BOOST_CHECK_EQUAL(pwalletMain->ScanForWalletTransactions(NULL), 0);
+}
+
+// A proof-of-stake block holding vtxIn after its coinbase and coinstake,
+// so it reads back without a proof-of-work check
+static CBlock MakeRescanBlock(const vector<CTransaction>& vtxIn, const uint256& hashPrev)
+{
+    CBlock block;
+    block.nVersion = CBlock::CURRENT_VERSION;
+    block.hashPrevBlock = hashPrev;
+    block.nTime = GetAdjustedTime();
+    block.nBits = CBigNum(~uint256(0) >> 20).GetCompact();
+    block.vtx.resize(2);
+    block.vtx[0].vin.resize(1);
+    block.vtx[0].vin[0].prevout.SetNull();
+    block.vtx[0].vin[0].scriptSig = CScript() << GetRandHash();
+    block.vtx[0].vout.resize(1);
+    block.vtx[1].vin.resize(1);
+    block.vtx[1].vin[0].prevout = COutPoint(GetRandHash(), 0);
+    block.vtx[1].vout.resize(2);
+    block.vtx[1].vout[1].nValue = COIN;
+    block.vtx[1].vout[1].scriptPubKey = CScript() << OP_TRUE;
+    block.vtx.insert(block.vtx.end(), vtxIn.begin(), vtxIn.end());
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+static CTransaction MakeRescanTx(const COutPoint& prevout, const CScript& scriptPubKey, int64 nValue)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = prevout;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = nValue;
+    tx.vout[0].scriptPubKey = scriptPubKey;
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(wallet_rescan_blocks)
+{
+    CWallet walletRescan("wallet_rescan_test.dat");
+    bool fFirstRun;
+    BOOST_REQUIRE(walletRescan.LoadWallet(fFirstRun) == DB_LOAD_OK);
+    CKey keyA, keyB, keyOther;
+    keyA.MakeNewKey(true);
+    keyB.MakeNewKey(false);
+    keyOther.MakeNewKey(true);
+    BOOST_REQUIRE(walletRescan.AddKey(keyA));
+    BOOST_REQUIRE(walletRescan.AddKey(keyB));
+    CScript scriptA, scriptB, scriptOther;
+    scriptA.SetDestination(keyA.GetPubKey().GetID());
+    scriptB << keyB.GetPubKey() << OP_CHECKSIG;
+    scriptOther.SetDestination(keyOther.GetPubKey().GetID());
+
+    // More blocks than reading threads. Every fourth block pays the wallet,
+    // alternately by key hash and by public key; block 10 pays away the
+    // coin of block 5, and every block pays someone else.
+    const int nBlocks = 40;
+    vector<CBlock> vBlock;
+    vector<uint256> vExpected;
+    vector<uint256> vExpectedBlock;
+    uint256 hashPrev = 0;
+    uint256 hashPay5 = 0;
+    for (int i = 0; i < nBlocks; i++)
+    {
+        vector<CTransaction> vtx;
+        vtx.push_back(MakeRescanTx(COutPoint(GetRandHash(), 0), scriptOther, COIN));
+        if (i == 10)
+            vtx.push_back(MakeRescanTx(COutPoint(hashPay5, 0), scriptOther, 5 * CENT));
+        if (i % 4 == 1)
+        {
+            vtx.push_back(MakeRescanTx(COutPoint(GetRandHash(), 0), (i / 4) % 2 == 0 ? scriptA : scriptB, i * CENT));
+            if (i == 5)
+                hashPay5 = vtx.back().GetHash();
+        }
+        vBlock.push_back(MakeRescanBlock(vtx, hashPrev));
+        hashPrev = vBlock.back().GetHash();
+        for (unsigned int j = 1; j < vtx.size(); j++)
+        {
+            vExpected.push_back(vtx[j].GetHash());
+            vExpectedBlock.push_back(hashPrev);
+        }
+    }
+
+    vector<uint256> vHashBlock(nBlocks);
+    vector<CBlockIndex*> vIndex(nBlocks);
+    for (int i = 0; i < nBlocks; i++)
+    {
+        unsigned int nFile, nBlockPos;
+        BOOST_REQUIRE(vBlock[i].WriteToDisk(nFile, nBlockPos));
+        vHashBlock[i] = vBlock[i].GetHash();
+        vIndex[i] = new CBlockIndex(nFile, nBlockPos, vBlock[i]);
+        vIndex[i]->phashBlock = &vHashBlock[i];
+        vIndex[i]->nHeight = i + 1;
+        if (i > 0)
+        {
+            vIndex[i]->pprev = vIndex[i - 1];
+            vIndex[i - 1]->pnext = vIndex[i];
+        }
+    }
+
+    // Found in chain order, whichever thread read the block
+    BOOST_CHECK_EQUAL(walletRescan.ScanForWalletTransactions(vIndex[0]), (int)vExpected.size());
+    BOOST_CHECK_EQUAL(walletRescan.mapWallet.size(), vExpected.size());
+    for (unsigned int i = 0; i < vExpected.size(); i++)
+    {
+        BOOST_REQUIRE(walletRescan.mapWallet.count(vExpected[i]));
+        const CWalletTx& wtx = walletRescan.mapWallet[vExpected[i]];
+        BOOST_CHECK(wtx.hashBlock == vExpectedBlock[i]);
+        if (i > 0)
+            BOOST_CHECK(wtx.nOrderPos > walletRescan.mapWallet[vExpected[i - 1]].nOrderPos);
+    }
+    CRescanProgress progress = walletRescan.GetRescanProgress();
+    BOOST_CHECK_EQUAL(progress.nStartHeight, 1);
+    BOOST_CHECK_EQUAL(progress.nHeight, nBlocks);
+
+    // A second pass only updates what it found
+    BOOST_CHECK_EQUAL(walletRescan.ScanForWalletTransactions(vIndex[0]), 0);
+    BOOST_CHECK_EQUAL(walletRescan.mapWallet.size(), vExpected.size());
+
+    for (int i = 0; i < nBlocks; i++)
+        delete vIndex[i];
+}
+
+BOOST_AUTO_TEST_CASE(wallet_load)
+{
+    const string strFile = "wallet_load_test.dat";
+    vector<CKey> vKey(20);
+    vector<uint256> vHash;
+    {
+        CWalletDB walletdb(strFile, "cr+");
+        for (unsigned int i = 0; i < vKey.size(); i++)
+        {
+            vKey[i].MakeNewKey(i % 2 == 0);
+            BOOST_REQUIRE(walletdb.WriteKey(vKey[i].GetPubKey(), vKey[i].GetPrivKey()));
+        }
+
+        // More transactions than the loader reads ahead, each with an
+        // unconfirmed supporting transaction
+        for (int i = 0; i < 5000; i++)
+        {
+            CTransaction tx;
+            tx.vin.resize(1);
+            tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+            tx.vout.resize(1);
+            tx.vout[0].nValue = (i + 1) * CENT;
+            tx.vout[0].scriptPubKey.SetDestination(vKey[i % vKey.size()].GetPubKey().GetID());
+            CWalletTx wtx(NULL, tx);
+            wtx.nOrderPos = i;
+            wtx.vtxPrev.push_back(CMerkleTx(tx));
+            BOOST_REQUIRE(walletdb.WriteTx(wtx.GetHash(), wtx));
+            vHash.push_back(wtx.GetHash());
+        }
+    }
+
+    CWallet wallet(strFile);
+    BOOST_CHECK(CWalletDB(strFile, "cr+").LoadWallet(&wallet) == DB_LOAD_OK);
+    for (unsigned int i = 0; i < vKey.size(); i++)
+        BOOST_CHECK(wallet.HaveKey(vKey[i].GetPubKey().GetID()));
+    BOOST_REQUIRE_EQUAL(wallet.mapWallet.size(), vHash.size());
+    for (unsigned int i = 0; i < vHash.size(); i++)
+    {
+        const CWalletTx& wtx = wallet.mapWallet[vHash[i]];
+        BOOST_CHECK_EQUAL(wtx.nOrderPos, (int64)i);
+        BOOST_CHECK_EQUAL(wtx.vtxPrev.size(), 1U);
+        BOOST_CHECK_EQUAL(wtx.GetCredit(), (int64)(i + 1) * CENT);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(wallet_tx_indexes)
+{
+    const string strFile = "wallet_index_test.dat";
+    CWallet wallet(strFile);
+    CWalletDB walletdb(strFile, "cr+");
+    CKey key;
+    key.MakeNewKey(true);
+    BOOST_REQUIRE(wallet.AddKey(key));
+
+    vector<uint256> vHash;
+    for (int i = 0; i < 3; i++)
+    {
+        CTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        tx.vout.resize(1);
+        tx.vout[0].nValue = (i + 1) * CENT;
+        tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+        BOOST_REQUIRE(wallet.AddToWallet(CWalletTx(&wallet, tx)));
+        vHash.push_back(tx.GetHash());
+    }
+
+    CAccountingEntry acentry;
+    acentry.strAccount = "a";
+    acentry.nCreditDebit = CENT;
+    acentry.nTime = GetAdjustedTime();
+    acentry.nOrderPos = wallet.IncOrderPosNext(&walletdb);
+    BOOST_REQUIRE(walletdb.WriteAccountingEntry(acentry));
+    wallet.AddAccountingEntry(acentry);
+
+    // The activity log lists everything in the order it was added
+    BOOST_REQUIRE_EQUAL(wallet.wtxOrdered.size(), 4U);
+    CWallet::TxItems::iterator it = wallet.wtxOrdered.begin();
+    for (int i = 0; i < 3; i++, ++it)
+        BOOST_CHECK((*it).second.first && (*it).second.first->GetHash() == vHash[i]);
+    BOOST_CHECK(!(*it).second.first && (*it).second.second->strAccount == "a");
+
+    // Transactions in no block are always included
+    vector<const CWalletTx*> vwtx;
+    wallet.GetTransactionsSince(nBestHeight, vwtx);
+    BOOST_CHECK_EQUAL(vwtx.size(), 3U);
+
+    BOOST_CHECK(wallet.EraseFromWallet(vHash[1]));
+    BOOST_CHECK_EQUAL(wallet.wtxOrdered.size(), 3U);
+    vwtx.clear();
+    wallet.GetTransactionsSince(nBestHeight, vwtx);
+    BOOST_CHECK_EQUAL(vwtx.size(), 2U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,218 @@
+// Copyright (c) 2014 The BlackToken developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txcache.h"
+
+using namespace std;
+
+CTxCache txcache;
+
+// Rough allocator overhead of a map node plus list node
+static const int64 TXCACHE_ENTRY_OVERHEAD = 96;
+
+CTxOutputs::CTxOutputs(const CTransaction& tx) :
+    nVersion(tx.nVersion), nTime(tx.nTime), fCoinBase(tx.IsCoinBase()), vout(tx.vout)
+{
+}
+
+void CTxOutputs::ToTransaction(CTransaction& tx) const
+{
+    tx.SetNull();
+    tx.nVersion = nVersion;
+    tx.nTime = nTime;
+    // A null prevout marks a coinbase; any other prevout makes IsCoinStake()
+    // depend on the outputs only, as it does for the original transaction
+    if (fCoinBase)
+        tx.vin.push_back(CTxIn());
+    else
+        tx.vin.push_back(CTxIn(COutPoint(0, 0)));
+    tx.vout = vout;
+}
+
+unsigned int CTxOutputs::GetMemorySize() const
+{
+    unsigned int nSize = sizeof(*this) + vout.capacity() * sizeof(CTxOut);
+    BOOST_FOREACH(const CTxOut& txout, vout)
+        nSize += txout.scriptPubKey.capacity();
+    return nSize;
+}
+
+
+CTxCache::CTxCache() :
+    nMaxSize(25 << 20), nCleanSize(0), nDirtySize(0), nOutputsSize(0), nOutputsHits(0), nOutputsMisses(0)
+{
+}
+
+int64 CTxCache::EntrySize(const string& strKey, const string& strValue)
+{
+    return strKey.size() + strValue.size() + TXCACHE_ENTRY_OVERHEAD;
+}
+
+void CTxCache::SetMaxSize(int64 nMaxSizeIn)
+{
+    LOCK(cs_txcache);
+    nMaxSize = nMaxSizeIn;
+    Trim();
+}
+
+void CTxCache::EraseEntry(map<string, CEntry>::iterator mi)
+{
+    int64 nSize = EntrySize(mi->first, mi->second.strValue);
+    if (mi->second.fDirty)
+        nDirtySize -= nSize;
+    else
+    {
+        nCleanSize -= nSize;
+        listClean.erase(mi->second.itClean);
+    }
+    mapEntries.erase(mi);
+}
+
+// Drop the oldest clean data until both halves fit the budget again;
+// dirty entries are only released by a flush
+void CTxCache::Trim()
+{
+    while (nOutputsSize > nMaxSize / 2 && !listOutputs.empty())
+    {
+        map<uint64, CTxOutputs>::iterator mi = mapOutputs.find(listOutputs.front());
+        nOutputsSize -= mi->second.GetMemorySize() + TXCACHE_ENTRY_OVERHEAD;
+        mapOutputs.erase(mi);
+        listOutputs.pop_front();
+    }
+    while (nDirtySize + nCleanSize > nMaxSize / 2 && !listClean.empty())
+        EraseEntry(mapEntries.find(listClean.front()));
+}
+
+bool CTxCache::Get(const string& strKey, string& strValue, bool& fFound)
+{
+    LOCK(cs_txcache);
+    map<string, CEntry>::iterator mi = mapEntries.find(strKey);
+    if (mi == mapEntries.end())
+        return false;
+    fFound = !mi->second.fErased;
+    if (fFound)
+        strValue = mi->second.strValue;
+    return true;
+}
+
+void CTxCache::AddClean(const string& strKey, const string& strValue)
+{
+    LOCK(cs_txcache);
+    if (nMaxSize <= 0 || mapEntries.count(strKey))
+        return;
+    CEntry& entry = mapEntries[strKey];
+    entry.strValue = strValue;
+    entry.fErased = false;
+    entry.fDirty = false;
+    entry.itClean = listClean.insert(listClean.end(), strKey);
+    nCleanSize += EntrySize(strKey, strValue);
+    Trim();
+}
+
+void CTxCache::Write(const CLogDB::CBatch& batch)
+{
+    LOCK(cs_txcache);
+    for (map<string, pair<bool, string> >::const_iterator it = batch.mapWrites.begin(); it != batch.mapWrites.end(); ++it)
+    {
+        map<string, CEntry>::iterator mi = mapEntries.find(it->first);
+        if (mi != mapEntries.end())
+            EraseEntry(mi);
+        CEntry& entry = mapEntries[it->first];
+        entry.fErased = it->second.first;
+        entry.strValue = it->second.second;
+        entry.fDirty = true;
+        nDirtySize += EntrySize(it->first, entry.strValue);
+    }
+    Trim();
+}
+
+bool CTxCache::NeedsFlush() const
+{
+    LOCK(cs_txcache);
+    return nDirtySize > nMaxSize / 4;
+}
+
+void CTxCache::GetDirty(CLogDB::CBatch& batch) const
+{
+    LOCK(cs_txcache);
+    for (map<string, CEntry>::const_iterator mi = mapEntries.begin(); mi != mapEntries.end(); ++mi)
+    {
+        if (!mi->second.fDirty)
+            continue;
+        if (mi->second.fErased)
+            batch.Erase(mi->first);
+        else
+            batch.Write(mi->first, mi->second.strValue);
+    }
+}
+
+void CTxCache::SetFlushed(const CLogDB::CBatch& batch)
+{
+    LOCK(cs_txcache);
+    for (map<string, pair<bool, string> >::const_iterator it = batch.mapWrites.begin(); it != batch.mapWrites.end(); ++it)
+    {
+        map<string, CEntry>::iterator mi = mapEntries.find(it->first);
+        if (mi == mapEntries.end() || !mi->second.fDirty || mi->second.fErased != it->second.first || mi->second.strValue != it->second.second)
+            continue;
+        if (mi->second.fErased)
+        {
+            EraseEntry(mi);
+            continue;
+        }
+        int64 nSize = EntrySize(mi->first, mi->second.strValue);
+        nDirtySize -= nSize;
+        nCleanSize += nSize;
+        mi->second.fDirty = false;
+        mi->second.itClean = listClean.insert(listClean.end(), mi->first);
+    }
+    Trim();
+}
+
+bool CTxCache::GetOutputs(const CDiskTxPos& pos, CTransaction& txRet)
+{
+    LOCK(cs_txcache);
+    map<uint64, CTxOutputs>::const_iterator mi = mapOutputs.find(PosKey(pos));
+    if (mi == mapOutputs.end())
+    {
+        nOutputsMisses++;
+        return false;
+    }
+    nOutputsHits++;
+    mi->second.ToTransaction(txRet);
+    return true;
+}
+
+void CTxCache::AddOutputs(const CDiskTxPos& pos, const CTransaction& tx)
+{
+    LOCK(cs_txcache);
+    if (nMaxSize <= 0)
+        return;
+    uint64 nKey = PosKey(pos);
+    if (mapOutputs.count(nKey))
+        return;
+    CTxOutputs& outputs = mapOutputs[nKey];
+    outputs = CTxOutputs(tx);
+    listOutputs.push_back(nKey);
+    nOutputsSize += outputs.GetMemorySize() + TXCACHE_ENTRY_OVERHEAD;
+    Trim();
+}
+
+void CTxCache::Clear()
+{
+    LOCK(cs_txcache);
+    mapEntries.clear();
+    listClean.clear();
+    mapOutputs.clear();
+    listOutputs.clear();
+    nCleanSize = nDirtySize = nOutputsSize = 0;
+}
+
+void CTxCache::GetStats(int64& nSizeRet, int64& nDirtyRet, uint64& nHitsRet, uint64& nMissesRet) const
+{
+    LOCK(cs_txcache);
+    nSizeRet = nCleanSize + nDirtySize + nOutputsSize;
+    nDirtyRet = nDirtySize;
+    nHitsRet = nOutputsHits;
+    nMissesRet = nOutputsMisses;
+}
@@ -0,0 +1,106 @@
+// Copyright (c) 2014 The BlackToken developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_TXCACHE_H
+#define BITCOIN_TXCACHE_H
+
+#include "main.h"
+#include "logdb.h"
+
+#include <list>
+#include <map>
+#include <string>
+
+/** The parts of a transaction that validation looks at when its outputs
+ *  are spent: the outputs themselves, its time and whether it is a coinbase.
+ *  Input scripts, usually most of a transaction, are dropped.
+ */
+class CTxOutputs
+{
+public:
+    int nVersion;
+    unsigned int nTime;
+    bool fCoinBase;
+    std::vector<CTxOut> vout;
+
+    CTxOutputs() : nVersion(0), nTime(0), fCoinBase(false) {}
+    explicit CTxOutputs(const CTransaction& tx);
+
+    /** Rebuild a transaction with the same outputs, time, IsCoinBase() and
+     *  IsCoinStake().  Its inputs are placeholders, so its hash differs. */
+    void ToTransaction(CTransaction& tx) const;
+
+    unsigned int GetMemorySize() const;
+};
+
+
+/** In-memory view between validation and CTxDB.
+ *
+ * Committed CTxDB writes are kept here as dirty entries and written to the
+ * storage engine in one batch at a block boundary, see FlushTxDB().  Values
+ * read from the engine stay cached, and the outputs of previous transactions
+ * are kept by disk position so connecting a spend does not have to read and
+ * deserialize the whole transaction.  Half of the -dbcache budget goes to
+ * each; the oldest clean data is dropped first.
+ */
+class CTxCache
+{
+private:
+    struct CEntry
+    {
+        std::string strValue;
+        bool fErased;
+        bool fDirty;
+        std::list<std::string>::iterator itClean;
+    };
+
+    std::map<std::string, CEntry> mapEntries;
+    std::list<std::string> listClean;   // clean entries, oldest first
+    std::map<uint64, CTxOutputs> mapOutputs;
+    std::list<uint64> listOutputs;      // oldest first
+    int64 nMaxSize;
+    int64 nCleanSize;
+    int64 nDirtySize;
+    int64 nOutputsSize;
+    uint64 nOutputsHits;
+    uint64 nOutputsMisses;
+
+    static int64 EntrySize(const std::string& strKey, const std::string& strValue);
+    static uint64 PosKey(const CDiskTxPos& pos) { return ((uint64)pos.nFile << 32) | pos.nTxPos; }
+    void EraseEntry(std::map<std::string, CEntry>::iterator mi);
+    void Trim();
+
+public:
+    mutable CCriticalSection cs_txcache;
+
+    CTxCache();
+
+    void SetMaxSize(int64 nMaxSizeIn);
+    int64 GetMaxSize() const { return nMaxSize; }
+
+    /** Look a key up.  Returns false if the cache does not know the key,
+     *  otherwise sets fFound and, if found, strValue. */
+    bool Get(const std::string& strKey, std::string& strValue, bool& fFound);
+    /** Remember a value just read from the storage engine */
+    void AddClean(const std::string& strKey, const std::string& strValue);
+    /** Apply a committed batch of writes; they stay dirty until flushed */
+    void Write(const CLogDB::CBatch& batch);
+
+    /** Whether dirty entries fill half of their share of the budget */
+    bool NeedsFlush() const;
+    /** Collect the dirty entries, to be written as one batch */
+    void GetDirty(CLogDB::CBatch& batch) const;
+    /** Mark the entries of a written batch clean */
+    void SetFlushed(const CLogDB::CBatch& batch);
+
+    /** Outputs of the transaction at pos, as cached by AddOutputs() */
+    bool GetOutputs(const CDiskTxPos& pos, CTransaction& txRet);
+    void AddOutputs(const CDiskTxPos& pos, const CTransaction& tx);
+
+    void Clear();
+    void GetStats(int64& nSizeRet, int64& nDirtyRet, uint64& nHitsRet, uint64& nMissesRet) const;
+};
+
+extern CTxCache txcache;
+
+#endif
@@ -8,6 +8,7 @@
 #include <limits.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
@@ -168,6 +169,50 @@ public:
         return *this;
     }
 
+    base_uint& operator/=(const base_uint& b)
+    {
+        // shift-and-subtract long division
+        base_uint div = b;
+        base_uint num = *this;
+        for (int i = 0; i < WIDTH; i++)
+            pn[i] = 0;
+        int num_bits = num.bits();
+        int div_bits = div.bits();
+        if (div_bits == 0)
+            throw std::domain_error("base_uint::operator/= : division by zero");
+        if (div_bits > num_bits)
+            return *this;
+        int shift = num_bits - div_bits;
+        div <<= shift;
+        while (shift >= 0)
+        {
+            if (num >= div)
+            {
+                num -= div;
+                pn[shift / 32] |= (1U << (shift & 31));
+            }
+            div >>= 1;
+            shift--;
+        }
+        return *this;
+    }
+
+    // Position of the highest set bit plus one, zero for zero
+    unsigned int bits() const
+    {
+        for (int pos = WIDTH-1; pos >= 0; pos--)
+        {
+            if (pn[pos])
+            {
+                for (int nbits = 31; nbits > 0; nbits--)
+                    if (pn[pos] & (1U << nbits))
+                        return 32*pos + nbits + 1;
+                return 32*pos + 1;
+            }
+        }
+        return 0;
+    }
+
 
     base_uint& operator++()
     {
@@ -617,6 +662,7 @@ inline const uint256 operator&(const uint256& a, const uint256& b)      { return
 inline const uint256 operator|(const uint256& a, const uint256& b)      { return (base_uint256)a |  (base_uint256)b; }
 inline const uint256 operator+(const uint256& a, const uint256& b)      { return (base_uint256)a +  (base_uint256)b; }
 inline const uint256 operator-(const uint256& a, const uint256& b)      { return (base_uint256)a -  (base_uint256)b; }
+inline const uint256 operator/(const uint256& a, const uint256& b)      { return uint256(a) /= b; }
 
 
 
@@ -13,6 +13,7 @@
 #include "coincontrol.h"
 
 #include <boost/algorithm/string.hpp>
+#include <boost/bind.hpp>
 
 using namespace std;
 extern int nStakeMaxAge;
@@ -312,28 +313,91 @@ int64 CWallet::IncOrderPosNext(CWalletDB *pwalletdb)
     return nRet;
 }
 
-CWallet::TxItems CWallet::OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount)
+// Only call this once the entry is committed to the wallet database, so the
+// activity log never lists an entry that is not in wallet.dat
+void CWallet::AddAccountingEntry(const CAccountingEntry& acentry)
 {
-    CWalletDB walletdb(strWalletFile);
+    LOCK(cs_wallet);
+    laccentries.push_back(acentry);
+    CAccountingEntry& entry = laccentries.back();
+    wtxOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+}
 
-    // First: get all CWalletTx and CAccountingEntry into a sorted-by-order multimap.
-    TxItems txOrdered;
+// Height under which a transaction is indexed
+static int GetIndexHeight(const CWalletTx& wtx, bool fMainChainOnly)
+{
+    if (wtx.hashBlock == 0)
+        return -1;
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(wtx.hashBlock);
+    if (mi == mapBlockIndex.end() || (fMainChainOnly && !(*mi).second->IsInMainChain()))
+        return -1;
+    return (*mi).second->nHeight;
+}
 
-    // Note: maintaining indices in the database of (account,time) --> txid and (account, time) --> acentry
-    // would make this much faster for applications that do this a lot.
-    for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+void CWallet::IndexTxHeight(CWalletTx& wtx, int nHeight)
+{
+    if (wtx.fHeightIndexed && wtx.nIndexedHeight == nHeight)
+        return;
+    UnindexTxHeight(wtx);
+    mapTxByHeight.insert(make_pair(nHeight, &wtx));
+    wtx.fHeightIndexed = true;
+    wtx.nIndexedHeight = nHeight;
+}
+
+void CWallet::UnindexTxHeight(CWalletTx& wtx)
+{
+    if (!wtx.fHeightIndexed)
+        return;
+    pair<multimap<int, CWalletTx*>::iterator, multimap<int, CWalletTx*>::iterator> range = mapTxByHeight.equal_range(wtx.nIndexedHeight);
+    for (multimap<int, CWalletTx*>::iterator it = range.first; it != range.second; ++it)
     {
-        CWalletTx* wtx = &((*it).second);
-        txOrdered.insert(make_pair(wtx->nOrderPos, TxPair(wtx, (CAccountingEntry*)0)));
+        if ((*it).second == &wtx)
+        {
+            mapTxByHeight.erase(it);
+            break;
+        }
     }
-    acentries.clear();
-    walletdb.ListAccountCreditDebit(strAccount, acentries);
-    BOOST_FOREACH(CAccountingEntry& entry, acentries)
+    wtx.fHeightIndexed = false;
+}
+
+// Called after loading, when nOrderPos and the chain are settled
+void CWallet::RebuildTxIndexes()
+{
+    wtxOrdered.clear();
+    mapTxByHeight.clear();
+    for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
     {
-        txOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+        CWalletTx& wtx = (*it).second;
+        wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
+        wtx.fHeightIndexed = false;
+        IndexTxHeight(wtx, GetIndexHeight(wtx, true));
     }
 
-    return txOrdered;
+    laccentries.clear();
+    if (fFileBacked)
+        CWalletDB(strWalletFile).ListAccountCreditDebit("*", laccentries);
+    BOOST_FOREACH(CAccountingEntry& entry, laccentries)
+        wtxOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+}
+
+void CWallet::GetTransactionsSince(int nHeight, std::vector<const CWalletTx*>& vwtxRet) const
+{
+    LOCK(cs_wallet);
+    multimap<int, CWalletTx*>::const_iterator it = mapTxByHeight.begin();
+    for (; it != mapTxByHeight.end() && (*it).first == -1; ++it)
+        vwtxRet.push_back((*it).second);
+    for (it = mapTxByHeight.upper_bound(std::max(nHeight, -1)); it != mapTxByHeight.end(); ++it)
+        vwtxRet.push_back((*it).second);
+}
+
+// A block holding the transaction left the main chain; it stays with the
+// unconfirmed ones until it is seen in a block again
+void CWallet::TransactionDisconnected(const uint256& hashTx)
+{
+    LOCK(cs_wallet);
+    map<uint256, CWalletTx>::iterator mi = mapWallet.find(hashTx);
+    if (mi != mapWallet.end())
+        IndexTxHeight((*mi).second, -1);
 }
 
 void CWallet::WalletUpdateSpent(const CTransaction &tx)
@@ -369,9 +433,30 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        RebuildUnspentIndex();
     }
 }
 
+// Whether wtx belongs in setUnspentTx: it has an unspent output of ours,
+// or is an immature coinbase or coinstake, whose whole credit counts
+bool CWallet::IsUnspentCandidate(const CWalletTx& wtx) const
+{
+    bool fImmature = wtx.GetBlocksToMaturity() > 0;
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+        if ((fImmature || !wtx.IsSpent(i)) && IsMine(wtx.vout[i]))
+            return true;
+    return false;
+}
+
+void CWallet::RebuildUnspentIndex()
+{
+    setUnspentTx.clear();
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        if (IsUnspentCandidate((*it).second))
+            setUnspentTx.insert((*it).first);
+    fBalanceCached = false;
+}
+
 bool CWallet::AddToWallet(const CWalletTx& wtxIn)
 {
     uint256 hash = wtxIn.GetHash();
@@ -386,6 +471,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
         {
             wtx.nTimeReceived = GetAdjustedTime();
             wtx.nOrderPos = IncOrderPosNext();
+            wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
+            wtx.fHeightIndexed = false; // a copy may carry the flag of another wallet's entry
 
             wtx.nTimeSmart = wtx.nTimeReceived;
             if (wtxIn.hashBlock != 0)
@@ -397,9 +484,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
                     {
                         // Tolerate times up to the last timestamp in the wallet not more than 5 minutes into the future
                         int64 latestTolerated = latestNow + 300;
-                        std::list<CAccountingEntry> acentries;
-                        TxItems txOrdered = OrderedTxItems(acentries);
-                        for (TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+                        for (TxItems::reverse_iterator it = wtxOrdered.rbegin(); it != wtxOrdered.rend(); ++it)
                         {
                             CWalletTx *const pwtx = (*it).second.first;
                             if (pwtx == &wtx)
@@ -456,6 +541,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
             }
             fUpdated |= wtx.UpdateSpent(wtxIn.vfSpent);
         }
+        IndexTxHeight(wtx, GetIndexHeight(wtx, false));
 
         //// debug print
         printf("AddToWallet %s  %s%s\n", wtxIn.GetHash().ToString().substr(0,10).c_str(), (fInsertedNew ? "new" : ""), (fUpdated ? "update" : ""));
@@ -481,6 +567,10 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
             }
         }
 #endif
+        if (IsUnspentCandidate(wtx))
+            setUnspentTx.insert(hash);
+        fBalanceCached = false;
+
         // since AddToWallet is called directly for self-originating transactions, check for consumption of own coins
         WalletUpdateSpent(wtx);
 
@@ -529,8 +619,25 @@ bool CWallet::EraseFromWallet(uint256 hash)
         return false;
     {
         LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
+        map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end())
+        {
+            CWalletTx& wtx = (*mi).second;
+            pair<TxItems::iterator, TxItems::iterator> range = wtxOrdered.equal_range(wtx.nOrderPos);
+            for (TxItems::iterator it = range.first; it != range.second; ++it)
+            {
+                if ((*it).second.first == &wtx)
+                {
+                    wtxOrdered.erase(it);
+                    break;
+                }
+            }
+            UnindexTxHeight(wtx);
+            mapWallet.erase(mi);
             CWalletDB(strWalletFile).EraseTx(hash);
+        }
+        setUnspentTx.erase(hash);
+        fBalanceCached = false;
     }
     return true;
 }
@@ -728,7 +835,6 @@ void CWalletTx::AddSupportingTransactions(CTxDB& txdb)
 {
     vtxPrev.clear();
 
-    const int COPY_DEPTH = 3;
     if (SetMerkleBranch() < COPY_DEPTH)
     {
         vector<uint256> vWorkQueue;
@@ -789,28 +895,198 @@ bool CWalletTx::WriteToDisk()
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
+/** Blocks handed from the rescan readers to the committing thread */
+class CRescanQueue
+{
+public:
+    /** A block as read, with the hashes of its transactions and whether
+     *  an output of each may pay the wallet */
+    class CReadBlock
+    {
+    public:
+        CBlock* pblock; // NULL if unreadable
+        std::vector<uint256> vHash;
+        std::vector<char> vCandidate;
+    };
+
+    boost::mutex mutex;
+    boost::condition_variable condRead;   // room in the window
+    boost::condition_variable condCommit; // the next block to commit was read
+
+    const std::vector<CBlockIndex*>& vIndex;
+    const CKeyStore& keystore;
+    std::map<unsigned int, CReadBlock> mapRead; // position in vIndex -> block
+    unsigned int nNext;      // next position to read
+    unsigned int nCommitted; // positions taken by the committing thread
+    bool fStop;
+
+    CRescanQueue(const std::vector<CBlockIndex*>& vIndexIn, const CKeyStore& keystoreIn) : vIndex(vIndexIn), keystore(keystoreIn), nNext(0), nCommitted(0), fStop(false)
+    {
+    }
+};
+
+// Bound on the blocks read ahead of the committing thread
+static const unsigned int RESCAN_WINDOW_BLOCKS = 512;
+
+static void ThreadRescanRead(CRescanQueue* pqueue)
+{
+    while (true)
+    {
+        unsigned int nPos;
+        {
+            boost::unique_lock<boost::mutex> lock(pqueue->mutex);
+            while (!pqueue->fStop && pqueue->nNext < pqueue->vIndex.size() && pqueue->nNext - pqueue->nCommitted >= RESCAN_WINDOW_BLOCKS)
+                pqueue->condRead.wait(lock);
+            if (pqueue->fStop || pqueue->nNext >= pqueue->vIndex.size())
+                return;
+            nPos = pqueue->nNext++;
+        }
+
+        CRescanQueue::CReadBlock read;
+        read.pblock = new CBlock();
+        if (read.pblock->ReadFromDisk(pqueue->vIndex[nPos], true))
+        {
+            unsigned int nTx = read.pblock->vtx.size();
+            read.vHash.resize(nTx);
+            read.vCandidate.resize(nTx, false);
+            for (unsigned int i = 0; i < nTx; i++)
+            {
+                const CTransaction& tx = read.pblock->vtx[i];
+                read.vHash[i] = tx.GetHash();
+                BOOST_FOREACH(const CTxOut& txout, tx.vout)
+                {
+                    // The common forms are a lookup in the keystore's
+                    // table of owned scripts
+                    if (::IsMine(pqueue->keystore, txout.scriptPubKey))
+                    {
+                        read.vCandidate[i] = true;
+                        break;
+                    }
+                }
+            }
+        }
+        else
+        {
+            delete read.pblock;
+            read.pblock = NULL;
+        }
+
+        boost::unique_lock<boost::mutex> lock(pqueue->mutex);
+        pqueue->mapRead[nPos] = read;
+        if (nPos == pqueue->nCommitted)
+            pqueue->condCommit.notify_one();
+    }
+}
+
 // Scan the block chain (starting in pindeRETart) for transactions
 // from or to us. If fUpdate is true, found transactions that already
 // exist in the wallet will be updated.
-int CWallet::ScanForWalletTransactions(CBlockIndex* pindeRETart, bool fUpdate)
+// Blocks are read and their outputs matched against the wallet keys by
+// several threads; transactions are added in chain order, taking cs_wallet
+// for one block at a time.
+int CWallet::ScanForWalletTransactions(CBlockIndex* pindeRETart, bool fUpdate, bool fShowProgress)
 {
-    int ret = 0;
+    vector<CBlockIndex*> vIndex;
+    {
+        LOCK(cs_main);
+        for (CBlockIndex* pindex = pindeRETart; pindex; pindex = pindex->pnext)
+            vIndex.push_back(pindex);
+    }
+    if (vIndex.empty())
+        return 0;
 
-    CBlockIndex* pindex = pindeRETart;
+    int64 nStart = GetTimeMillis();
+    int nThreads = boost::thread::hardware_concurrency() - 1;
+    nThreads = std::max(1, std::min(nThreads, std::min(MAX_SCRIPTCHECK_THREADS, (int)vIndex.size())));
     {
-        LOCK(cs_wallet);
-        while (pindex)
+        LOCK(cs_rescan);
+        rescanProgress = CRescanProgress();
+        rescanProgress.fActive = true;
+        rescanProgress.nStartHeight = vIndex.front()->nHeight;
+        rescanProgress.nHeight = vIndex.front()->nHeight - 1;
+        rescanProgress.nEndHeight = vIndex.back()->nHeight;
+    }
+    printf("Rescanning %"PRIszu" blocks from height %d with %d reading threads\n", vIndex.size(), vIndex.front()->nHeight, nThreads);
+
+    CRescanQueue queue(vIndex, *this);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&ThreadRescanRead, &queue));
+
+    int ret = 0;
+    int64 nLastProgress = nStart;
+    int64 nLastStats = nStart;
+    while (!fShutdown)
+    {
+        CRescanQueue::CReadBlock read;
         {
-            CBlock block;
-            block.ReadFromDisk(pindex, true);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+            boost::unique_lock<boost::mutex> lock(queue.mutex);
+            if (queue.nCommitted == vIndex.size())
+                break;
+            while (!queue.mapRead.count(queue.nCommitted))
+                queue.condCommit.wait(lock);
+            std::map<unsigned int, CRescanQueue::CReadBlock>::iterator mi = queue.mapRead.find(queue.nCommitted);
+            read = (*mi).second;
+            queue.mapRead.erase(mi);
+            queue.nCommitted++;
+            queue.condRead.notify_all();
+        }
+
+        if (read.pblock)
+        {
+            LOCK(cs_wallet);
+            for (unsigned int i = 0; i < read.pblock->vtx.size(); i++)
             {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
+                // Anything else neither pays us nor spends a coin of ours,
+                // and AddToWalletIfInvolvingMe() would leave it alone
+                const CTransaction& tx = read.pblock->vtx[i];
+                bool fInvolved = read.vCandidate[i] || mapWallet.count(read.vHash[i]);
+                for (unsigned int j = 0; j < tx.vin.size() && !fInvolved; j++)
+                    fInvolved = mapWallet.count(tx.vin[j].prevout.hash);
+                if (fInvolved && AddToWalletIfInvolvingMe(tx, read.pblock, fUpdate))
                     ret++;
             }
-            pindex = pindex->pnext;
+            delete read.pblock;
+        }
+
+        int64 nNow = GetTimeMillis();
+        if (nNow - nLastProgress >= 1000 || queue.nCommitted == vIndex.size())
+        {
+            double dRate = queue.nCommitted * 1000.0 / std::max(nNow - nStart, (int64)1);
+            {
+                LOCK(cs_rescan);
+                rescanProgress.nHeight = vIndex[queue.nCommitted - 1]->nHeight;
+                rescanProgress.dBlocksPerSecond = dRate;
+            }
+            if (fShowProgress)
+                uiInterface.InitMessage(strprintf(_("Rescanning... %d%%"), (int)(100 * queue.nCommitted / vIndex.size())));
+            nLastProgress = nNow;
+        }
+        if (nNow - nLastStats >= 10000)
+        {
+            printf("Rescanned %u of %"PRIszu" blocks, %.1f blocks/s, %d transactions found\n",
+                   queue.nCommitted, vIndex.size(), queue.nCommitted * 1000.0 / (nNow - nStart), ret);
+            nLastStats = nNow;
         }
     }
+
+    {
+        boost::unique_lock<boost::mutex> lock(queue.mutex);
+        queue.fStop = true;
+        queue.condRead.notify_all();
+    }
+    threadGroup.join_all();
+    for (std::map<unsigned int, CRescanQueue::CReadBlock>::iterator mi = queue.mapRead.begin(); mi != queue.mapRead.end(); ++mi)
+        delete (*mi).second.pblock;
+
+    int64 nElapsed = std::max(GetTimeMillis() - nStart, (int64)1);
+    {
+        LOCK(cs_rescan);
+        rescanProgress.fActive = false;
+        rescanProgress.dBlocksPerSecond = queue.nCommitted * 1000.0 / nElapsed;
+    }
+    printf("Rescanned %u blocks in %"PRI64d"ms, %.1f blocks/s, %d transactions found\n",
+           queue.nCommitted, nElapsed, queue.nCommitted * 1000.0 / nElapsed, ret);
     return ret;
 }
 
@@ -965,50 +1241,73 @@ void CWallet::ResendWalletTransactions()
 //
 
 
-int64 CWallet::GetBalance() const
+// Recompute the balances if the wallet or the best chain changed since
+// they were last cached
+void CWallet::CacheBalances() const
 {
-    int64 nTotal = 0;
+    if (fBalanceCached && pindexBalanceCached == pindexBest)
+        return;
+
+    int64 nBalance = 0;
+    int64 nUnconfirmed = 0;
+    int64 nImmature = 0;
+    int64 nStake = 0;
+    bool fVolatile = false;
+    for (set<uint256>::iterator it = setUnspentTx.begin(); it != setUnspentTx.end(); )
     {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(*it);
+        if (mi == mapWallet.end() || !IsUnspentCandidate((*mi).second))
         {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsFinal() && pcoin->IsConfirmed())
-                nTotal += pcoin->GetAvailableCredit();
+            setUnspentTx.erase(it++);
+            continue;
+        }
+        ++it;
+
+        const CWalletTx* pcoin = &(*mi).second;
+        // Finality by time changes without a new block
+        if (!pcoin->IsFinal())
+            fVolatile = true;
+        if (pcoin->IsFinal() && pcoin->IsConfirmed())
+            nBalance += pcoin->GetAvailableCredit();
+        else
+            nUnconfirmed += pcoin->GetAvailableCredit();
+
+        if (pcoin->GetBlocksToMaturity() > 0 && pcoin->IsInMainChain())
+        {
+            if (pcoin->IsCoinBase())
+                nImmature += GetCredit(*pcoin);
+            else if (pcoin->IsCoinStake())
+                nStake += GetCredit(*pcoin);
         }
     }
 
-    return nTotal;
+    nBalanceCached = nBalance;
+    nUnconfirmedBalanceCached = nUnconfirmed;
+    nImmatureBalanceCached = nImmature;
+    nStakeCached = nStake;
+    pindexBalanceCached = pindexBest;
+    fBalanceCached = !fVolatile;
+}
+
+int64 CWallet::GetBalance() const
+{
+    LOCK(cs_wallet);
+    CacheBalances();
+    return nBalanceCached;
 }
 
 int64 CWallet::GetUnconfirmedBalance() const
 {
-    int64 nTotal = 0;
-    {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsFinal() || !pcoin->IsConfirmed())
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    LOCK(cs_wallet);
+    CacheBalances();
+    return nUnconfirmedBalanceCached;
 }
 
 int64 CWallet::GetImmatureBalance() const
 {
-    int64 nTotal = 0;
-    {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx& pcoin = (*it).second;
-            if (pcoin.IsCoinBase() && pcoin.GetBlocksToMaturity() > 0 && pcoin.IsInMainChain())
-                nTotal += GetCredit(pcoin);
-        }
-    }
-    return nTotal;
+    LOCK(cs_wallet);
+    CacheBalances();
+    return nImmatureBalanceCached;
 }
 
 // populate vCoins with vector of spendable COutputs
@@ -1018,9 +1317,12 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        for (set<uint256>::const_iterator it = setUnspentTx.begin(); it != setUnspentTx.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(*it);
+            if (mi == mapWallet.end())
+                continue;
+            const CWalletTx* pcoin = &(*mi).second;
 
             if (!pcoin->IsFinal())
                 continue;
@@ -1036,7 +1338,7 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
             for (unsigned int i = 0; i < pcoin->vout.size(); i++)
                 if (!(pcoin->IsSpent(i)) && IsMine(pcoin->vout[i]) && pcoin->vout[i].nValue > 0 &&
-                 (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i)))
+                 (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*mi).first, i)))
                     vCoins.push_back(COutput(pcoin, i, pcoin->GetDepthInMainChain()));
         }
     }
@@ -1083,28 +1385,17 @@ static void ApproximateBestSubset(vector<pair<int64, pair<const CWalletTx*,unsig
 // ppcoin: total coins staked (non-spendable until maturity)
 int64 CWallet::GetStake() const
 {
-    int64 nTotal = 0;
     LOCK(cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin);
-    }
-    return nTotal;
+    CacheBalances();
+    return nStakeCached;
 }
 
 int64 CWallet::GetNewMint() const
 {
-    int64 nTotal = 0;
+    // Immature coinbase outputs in the main chain are the new mint
     LOCK(cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin);
-    }
-    return nTotal;
+    CacheBalances();
+    return nImmatureBalanceCached;
 }
 
 bool CWallet::SelectCoinsMinConf(int64 nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, vector<COutput> vCoins, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64& nValueRet) const
@@ -1466,97 +1757,94 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     if (setCoins.empty())
         return false;
 
-    int64 nCredit = 0;
-    CScript scriptPubKeyKernel;
-    BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+    // Look up the kernel inputs of the candidates; the cache only goes to
+    // disk for outputs it has not seen since the chain tip last moved
+    static int nMaRETakeSearchInterval = 60;
+    vector<PAIRTYPE(const CWalletTx*, unsigned int)> vCandidates;
+    vector<CStakeKernelInput> vInput;
     {
-        CTxDB txdb("r");
-        CTxIndex txindex;
-		{
-		    LOCK2(cs_main, cs_wallet);
-			if (!txdb.ReadTxIndex(pcoin.first->GetHash(), txindex))
-				continue;
-		}
+        LOCK2(cs_main, cs_wallet);
+        set<COutPoint> setPrevout;
+        BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+        {
+            CStakeKernelInput input;
+            if (!stakeKernelCache.Get(*pcoin.first, pcoin.second, input))
+                continue;
+            setPrevout.insert(input.prevout);
 
-        // Read block header
-        CBlock block;
-		{
-		    LOCK2(cs_main, cs_wallet);
-			if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
-				continue;
-		}
+            if (input.nTimeBlockFrom + nStakeMinAge > txNew.nTime - nMaRETakeSearchInterval)
+                continue; // only count coins meeting min age requirement
+            vCandidates.push_back(pcoin);
+            vInput.push_back(input);
+        }
+        stakeKernelCache.Prune(setPrevout);
+    }
 
-        static int nMaRETakeSearchInterval = 60;
-		
-		// printf(">> block.GetBlockTime() = %"PRI64d", nStakeMinAge = %d, txNew.nTime = %d\n", block.GetBlockTime(), nStakeMinAge,txNew.nTime); 
-        if (block.GetBlockTime() + nStakeMinAge > txNew.nTime - nMaRETakeSearchInterval)
-            continue; // only count coins meeting min age requirement
-
-        bool fKernelFound = false;
-        for (unsigned int n=0; n<min(nSearchInterval,(int64)nMaRETakeSearchInterval) && !fKernelFound && !fShutdown; n++)
-        {
-			// printf(">> In.....\n");
-            // Search backward in time from the given txNew timestamp 
-            // Search nSearchInterval seconds back up to nMaRETakeSearchInterval
-            uint256 hashProofOfStake = 0;
-            COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-            if (CheckStakeKernelHash(nBits, block, txindex.pos.nTxPos - txindex.pos.nBlockPos, *pcoin.first, prevoutStake, txNew.nTime - n, hashProofOfStake))
+    // Search backward in time from the given txNew timestamp
+    // Search nSearchInterval seconds back up to nMaRETakeSearchInterval
+    // A kernel that cannot be used is dropped and the search repeated
+    int64 nCredit = 0;
+    CScript scriptPubKeyKernel;
+    unsigned int nIndex = 0;
+    unsigned int nTimeTx = 0;
+    uint256 hashProofOfStake = 0;
+    while (!fShutdown && SearchStakeKernels(vInput, nBits, txNew.nTime, min(nSearchInterval, (int64)nMaRETakeSearchInterval), nStakeThreads, nIndex, nTimeTx, hashProofOfStake))
+    {
+        PAIRTYPE(const CWalletTx*, unsigned int) pcoin = vCandidates[nIndex];
+        unsigned int nTimeBlockFrom = vInput[nIndex].nTimeBlockFrom;
+        vCandidates.erase(vCandidates.begin() + nIndex);
+        vInput.erase(vInput.begin() + nIndex);
+
+        // Found a kernel
+        if (fDebug && GetBoolArg("-printcoinstake"))
+            printf("CreateCoinStake : kernel found\n");
+        vector<valtype> vSolutions;
+        txnouttype whichType;
+        CScript scriptPubKeyOut;
+        scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
+        if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
+        {
+            if (fDebug && GetBoolArg("-printcoinstake"))
+                printf("CreateCoinStake : failed to parse kernel\n");
+            continue;
+        }
+        if (fDebug && GetBoolArg("-printcoinstake"))
+            printf("CreateCoinStake : parsed kernel type=%d\n", whichType);
+        if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
+        {
+            if (fDebug && GetBoolArg("-printcoinstake"))
+                printf("CreateCoinStake : no support for kernel type=%d\n", whichType);
+            continue;  // only support pay to public key and pay to address
+        }
+        if (whichType == TX_PUBKEYHASH) // pay to address type
+        {
+            // convert to pay to public key type
+            CKey key;
+            if (!keystore.GetKey(uint160(vSolutions[0]), key))
             {
-               // Found a kernel
                 if (fDebug && GetBoolArg("-printcoinstake"))
-                    printf("CreateCoinStake : kernel found\n");
-                vector<valtype> vSolutions;
-                txnouttype whichType;
-                CScript scriptPubKeyOut;
-                scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
-                if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
-                {
-                    if (fDebug && GetBoolArg("-printcoinstake"))
-                        printf("CreateCoinStake : failed to parse kernel\n");
-                    break;
-                }
-                if (fDebug && GetBoolArg("-printcoinstake"))
-                    printf("CreateCoinStake : parsed kernel type=%d\n", whichType);
-                if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
-                {
-                    if (fDebug && GetBoolArg("-printcoinstake"))
-                        printf("CreateCoinStake : no support for kernel type=%d\n", whichType);
-                    break;  // only support pay to public key and pay to address
-                }
-                if (whichType == TX_PUBKEYHASH) // pay to address type
-                {
-                    // convert to pay to public key type
-                    CKey key;
-                    if (!keystore.GetKey(uint160(vSolutions[0]), key))
-                    {
-                        if (fDebug && GetBoolArg("-printcoinstake"))
-                            printf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-                    scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
-                }
-                else
-                    scriptPubKeyOut = scriptPubKeyKernel;
+                    printf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                continue;  // unable to find corresponding public key
+            }
+            scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
+        }
+        else
+            scriptPubKeyOut = scriptPubKeyKernel;
 
-                txNew.nTime -= n; 
-                txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
-                nCredit += pcoin.first->vout[pcoin.second].nValue;
+        txNew.nTime = nTimeTx;
+        txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
+        nCredit += pcoin.first->vout[pcoin.second].nValue;
 
-				// printf(">> Wallet: CreateCoinStake: nCredit = %"PRI64d"\n", nCredit);
+        // printf(">> Wallet: CreateCoinStake: nCredit = %"PRI64d"\n", nCredit);
 
-                vwtxPrev.push_back(pcoin.first);
-                txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
-                if (block.GetBlockTime() + nStakeSplitAge > txNew.nTime)
-                    txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
+        vwtxPrev.push_back(pcoin.first);
+        txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+        if (nTimeBlockFrom + nStakeSplitAge > txNew.nTime)
+            txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
 
-                if (fDebug && GetBoolArg("-printcoinstake"))
-                    printf("CreateCoinStake : added kernel type=%d\n", whichType);
-                fKernelFound = true;
-                break;
-            }
-        }
-        if (fKernelFound || fShutdown)
-            break; // if kernel is found stop searching
+        if (fDebug && GetBoolArg("-printcoinstake"))
+            printf("CreateCoinStake : added kernel type=%d\n", whichType);
+        break; // if kernel is found stop searching
     }
     if (nCredit == 0 || nCredit > nBalance - nReserveBalance)
 	{
@@ -1776,6 +2064,12 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
         return nLoadWalletRet;
     fFirstRunRet = !vchDefaultKey.IsValid();
 
+    {
+        LOCK(cs_wallet);
+        RebuildUnspentIndex();
+        RebuildTxIndexes();
+    }
+
     NewThread(ThreadFlushWalletDB, &strWalletFile);
     return DB_LOAD_OK;
 }
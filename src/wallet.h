@@ -11,6 +11,7 @@
 #include <stdlib.h>
 
 #include "main.h"
+#include "kernel.h"
 #include "key.h"
 #include "keystore.h"
 #include "script.h"
@@ -19,6 +20,9 @@
 #include "walletdb.h"
 
 extern bool fWalletUnlockMintOnly;
+
+// Transactions this deep in the main chain are relayed without supporting transactions
+static const int COPY_DEPTH = 3;
 class CAccountingEntry;
 class CWalletTx;
 class CReserveKey;
@@ -64,6 +68,19 @@ public:
     )
 };
 
+/** Progress of the running, or else the last, wallet rescan */
+class CRescanProgress
+{
+public:
+    bool fActive;
+    int nStartHeight;
+    int nHeight;     // last block committed
+    int nEndHeight;
+    double dBlocksPerSecond;
+
+    CRescanProgress() : fActive(false), nStartHeight(0), nHeight(0), nEndHeight(0), dBlocksPerSecond(0) {}
+};
+
 /** A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
  */
@@ -80,6 +97,38 @@ private:
     // the maximum wallet format version: memory-only variable that specifies to what version this wallet may be upgraded
     int nWalletMaxVersion;
 
+    // kernel inputs of the outputs CreateCoinStake() tries; guarded by cs_main and cs_wallet
+    CStakeKernelCache stakeKernelCache;
+
+    // Transactions that may still hold unspent or immature outputs of ours.
+    // A superset: entries are added as transactions arrive or outputs are
+    // marked unspent, and pruned when the balances are recomputed.
+    // Memory only, guarded by cs_wallet.
+    mutable std::set<uint256> setUnspentTx;
+
+    // balances over setUnspentTx, valid while fBalanceCached is set and the
+    // best chain has not moved from pindexBalanceCached
+    mutable bool fBalanceCached;
+    mutable const CBlockIndex* pindexBalanceCached;
+    mutable int64 nBalanceCached;
+    mutable int64 nUnconfirmedBalanceCached;
+    mutable int64 nImmatureBalanceCached;
+    mutable int64 nStakeCached;
+
+    bool IsUnspentCandidate(const CWalletTx& wtx) const;
+    void RebuildUnspentIndex();
+    void CacheBalances() const;
+
+    // Transactions by the height of their block, -1 for those in no block of
+    // the main chain. Memory only, guarded by cs_wallet.
+    std::multimap<int, CWalletTx*> mapTxByHeight;
+
+    void IndexTxHeight(CWalletTx& wtx, int nHeight);
+    void UnindexTxHeight(CWalletTx& wtx);
+
+    mutable CCriticalSection cs_rescan;
+    CRescanProgress rescanProgress; // guarded by cs_rescan, not cs_wallet
+
 public:
     mutable CCriticalSection cs_wallet;
 
@@ -101,6 +150,8 @@ public:
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
         nOrderPosNext = 0;
+        fBalanceCached = false;
+        pindexBalanceCached = NULL;
     }
     CWallet(std::string strWalletFileIn)
     {
@@ -111,6 +162,8 @@ public:
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
         nOrderPosNext = 0;
+        fBalanceCached = false;
+        pindexBalanceCached = NULL;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -155,19 +208,36 @@ public:
     typedef std::pair<CWalletTx*, CAccountingEntry*> TxPair;
     typedef std::multimap<int64, TxPair > TxItems;
 
-    /** Get the wallet's activity log
-        @return multimap of ordered transactions and accounting entries
-        @warning Returned pointers are *only* valid within the scope of passed acentries
+    /** The wallet's activity log: transactions and accounting entries by
+        nOrderPos, kept up to date as they are added. Guarded by cs_wallet.
      */
-    TxItems OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount = "");
+    TxItems wtxOrdered;
+    std::list<CAccountingEntry> laccentries;
+
+    void AddAccountingEntry(const CAccountingEntry& acentry);
+    void RebuildTxIndexes();
+
+    /** Append the transactions in blocks above nHeight, and those in no block
+        of the main chain, to vwtxRet
+     */
+    void GetTransactionsSince(int nHeight, std::vector<const CWalletTx*>& vwtxRet) const;
 
     void MarkDirty();
+    // called by CWalletTx when spent flags change
+    void MarkBalanceDirty() const { fBalanceCached = false; }
+    void MarkUnspentTx(const uint256& hash) const { setUnspentTx.insert(hash); fBalanceCached = false; }
     bool AddToWallet(const CWalletTx& wtxIn);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate = false, bool fFindBlock = false);
     bool EraseFromWallet(uint256 hash);
     void WalletUpdateSpent(const CTransaction& prevout);
-    int ScanForWalletTransactions(CBlockIndex* pindeRETart, bool fUpdate = false);
+    void TransactionDisconnected(const uint256& hashTx);
+    int ScanForWalletTransactions(CBlockIndex* pindeRETart, bool fUpdate = false, bool fShowProgress = false);
     int ScanForWalletTransaction(const uint256& hashTx);
+    CRescanProgress GetRescanProgress() const
+    {
+        LOCK(cs_rescan);
+        return rescanProgress;
+    }
     void ReacceptWalletTransactions();
     void ResendWalletTransactions();
     int64 GetBalance() const;
@@ -390,6 +460,8 @@ public:
     mutable int64 nCreditCached;
     mutable int64 nAvailableCreditCached;
     mutable int64 nChangeCached;
+    bool fHeightIndexed;  // in CWallet::mapTxByHeight under nIndexedHeight
+    int nIndexedHeight;
 
     CWalletTx()
     {
@@ -431,6 +503,8 @@ public:
         nCreditCached = 0;
         nAvailableCreditCached = 0;
         nChangeCached = 0;
+        fHeightIndexed = false;
+        nIndexedHeight = -1;
         nOrderPos = -1;
     }
 
@@ -508,6 +582,8 @@ public:
                 fAvailableCreditCached = false;
             }
         }
+        if (fReturn && pwallet)
+            pwallet->MarkBalanceDirty();
         return fReturn;
     }
 
@@ -535,6 +611,8 @@ public:
         {
             vfSpent[nOut] = true;
             fAvailableCreditCached = false;
+            if (pwallet)
+                pwallet->MarkBalanceDirty();
         }
     }
 
@@ -547,6 +625,8 @@ public:
         {
             vfSpent[nOut] = false;
             fAvailableCreditCached = false;
+            if (pwallet)
+                pwallet->MarkUnspentTx(GetHash());
         }
     }
 
@@ -6,6 +6,7 @@
 #include "walletdb.h"
 #include "wallet.h"
 #include <boost/filesystem.hpp>
+#include <boost/bind.hpp>
 
 using namespace std;
 using namespace boost;
@@ -178,10 +179,109 @@ CWalletDB::ReorderTransactions(CWallet* pwallet)
         }
     }
 
+    // The order positions the indexes are keyed on have moved
+    pwallet->RebuildTxIndexes();
+
     return DB_LOAD_OK;
 }
 
 
+// Deserialize and check a "tx" record, undoing the serialization change of
+// 31600. No wallet state is touched, so records can be decoded in parallel.
+static bool DecodeWalletTx(CDataStream& ssKey, CDataStream& ssValue, uint256& hash, CWalletTx& wtx,
+                           bool& fUpgraded, string& strErr)
+{
+    ssKey >> hash;
+    ssValue >> wtx;
+    if (!wtx.CheckTransaction() || wtx.GetHash() != hash)
+        return false;
+
+    // Undo serialize changes in 31600
+    fUpgraded = false;
+    if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
+    {
+        if (!ssValue.empty())
+        {
+            char fTmp;
+            char fUnused;
+            ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
+            strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
+                               wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount.c_str(), hash.ToString().c_str());
+            wtx.fTimeReceivedIsTxTime = fTmp;
+        }
+        else
+        {
+            strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString().c_str());
+            wtx.fTimeReceivedIsTxTime = 0;
+        }
+        fUpgraded = true;
+    }
+    return true;
+}
+
+static void LoadWalletTx(CWallet* pwallet, const uint256& hash, const CWalletTx& wtxIn, bool fUpgraded,
+                         vector<uint256>& vWalletUpgrade, bool& fAnyUnordered)
+{
+    CWalletTx& wtx = pwallet->mapWallet[hash];
+    wtx = wtxIn;
+    wtx.BindWallet(pwallet);
+    if (fUpgraded)
+        vWalletUpgrade.push_back(hash);
+    if (wtx.nOrderPos == -1)
+        fAnyUnordered = true;
+}
+
+// Parse and verify a "key" or "wkey" record; like DecodeWalletTx() it
+// leaves the wallet alone
+static bool DecodeWalletKey(const string& strType, CDataStream& ssKey, CDataStream& ssValue, CKey& key, string& strErr)
+{
+    vector<unsigned char> vchPubKey;
+    ssKey >> vchPubKey;
+    if (strType == "key")
+    {
+        CPrivKey pkey;
+        ssValue >> pkey;
+        key.SetPubKey(vchPubKey);
+        if (!key.SetPrivKey(pkey))
+        {
+            strErr = "Error reading wallet database: CPrivKey corrupt";
+            return false;
+        }
+        if (key.GetPubKey() != vchPubKey)
+        {
+            strErr = "Error reading wallet database: CPrivKey pubkey inconsistency";
+            return false;
+        }
+        if (!key.IsValid())
+        {
+            strErr = "Error reading wallet database: invalid CPrivKey";
+            return false;
+        }
+    }
+    else
+    {
+        CWalletKey wkey;
+        ssValue >> wkey;
+        key.SetPubKey(vchPubKey);
+        if (!key.SetPrivKey(wkey.vchPrivKey))
+        {
+            strErr = "Error reading wallet database: CPrivKey corrupt";
+            return false;
+        }
+        if (key.GetPubKey() != vchPubKey)
+        {
+            strErr = "Error reading wallet database: CWalletKey pubkey inconsistency";
+            return false;
+        }
+        if (!key.IsValid())
+        {
+            strErr = "Error reading wallet database: invalid CWalletKey";
+            return false;
+        }
+    }
+    return true;
+}
+
 bool
 ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
              int& nFileVersion, vector<uint256>& vWalletUpgrade,
@@ -201,47 +301,11 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
         else if (strType == "tx")
         {
             uint256 hash;
-            ssKey >> hash;
-            CWalletTx& wtx = pwallet->mapWallet[hash];
-            ssValue >> wtx;
-            if (wtx.CheckTransaction() && (wtx.GetHash() == hash))
-                wtx.BindWallet(pwallet);
-            else
-            {
-                pwallet->mapWallet.erase(hash);
+            CWalletTx wtx;
+            bool fUpgraded;
+            if (!DecodeWalletTx(ssKey, ssValue, hash, wtx, fUpgraded, strErr))
                 return false;
-            }
-
-            // Undo serialize changes in 31600
-            if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
-            {
-                if (!ssValue.empty())
-                {
-                    char fTmp;
-                    char fUnused;
-                    ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
-                    strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
-                                       wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount.c_str(), hash.ToString().c_str());
-                    wtx.fTimeReceivedIsTxTime = fTmp;
-                }
-                else
-                {
-                    strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString().c_str());
-                    wtx.fTimeReceivedIsTxTime = 0;
-                }
-                vWalletUpgrade.push_back(hash);
-            }
-
-            if (wtx.nOrderPos == -1)
-                fAnyUnordered = true;
-
-            //// debug print
-            //printf("LoadWallet  %s\n", wtx.GetHash().ToString().c_str());
-            //printf(" %12"PRI64d"  %s  %s  %s\n",
-            //    wtx.vout[0].nValue,
-            //    DateTimeStrFormat("%x %H:%M:%S", wtx.GetBlockTime()).c_str(),
-            //    wtx.hashBlock.ToString().substr(0,20).c_str(),
-            //    wtx.mapValue["message"].c_str());
+            LoadWalletTx(pwallet, hash, wtx, fUpgraded, vWalletUpgrade, fAnyUnordered);
         }
         else if (strType == "acentry")
         {
@@ -262,51 +326,9 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
         }
         else if (strType == "key" || strType == "wkey")
         {
-            vector<unsigned char> vchPubKey;
-            ssKey >> vchPubKey;
             CKey key;
-            if (strType == "key")
-            {
-                CPrivKey pkey;
-                ssValue >> pkey;
-                key.SetPubKey(vchPubKey);
-                if (!key.SetPrivKey(pkey))
-                {
-                    strErr = "Error reading wallet database: CPrivKey corrupt";
-                    return false;
-                }
-                if (key.GetPubKey() != vchPubKey)
-                {
-                    strErr = "Error reading wallet database: CPrivKey pubkey inconsistency";
-                    return false;
-                }
-                if (!key.IsValid())
-                {
-                    strErr = "Error reading wallet database: invalid CPrivKey";
-                    return false;
-                }
-            }
-            else
-            {
-                CWalletKey wkey;
-                ssValue >> wkey;
-                key.SetPubKey(vchPubKey);
-                if (!key.SetPrivKey(wkey.vchPrivKey))
-                {
-                    strErr = "Error reading wallet database: CPrivKey corrupt";
-                    return false;
-                }
-                if (key.GetPubKey() != vchPubKey)
-                {
-                    strErr = "Error reading wallet database: CWalletKey pubkey inconsistency";
-                    return false;
-                }
-                if (!key.IsValid())
-                {
-                    strErr = "Error reading wallet database: invalid CWalletKey";
-                    return false;
-                }
-            }
+            if (!DecodeWalletKey(strType, ssKey, ssValue, key, strErr))
+                return false;
             if (!pwallet->LoadKey(key))
             {
                 strErr = "Error reading wallet database: LoadKey failed";
@@ -386,6 +408,107 @@ static bool IsKeyType(string strType)
             strType == "mkey" || strType == "ckey");
 }
 
+/** A wallet record read by LoadWallet(). Transactions and unencrypted keys
+ *  are decoded by the loading threads, everything else where it is applied. */
+class CWalletLoadRecord
+{
+public:
+    CDataStream ssKey;
+    CDataStream ssValue;
+    std::string strType;
+    bool fDecode;
+    bool fDecoded; // guarded by the queue mutex
+    bool fOK;
+    std::string strErr;
+    uint256 hash;
+    CWalletTx* pwtx;
+    bool fUpgraded;
+    CKey* pkey;
+
+    CWalletLoadRecord() : ssKey(SER_DISK, CLIENT_VERSION), ssValue(SER_DISK, CLIENT_VERSION),
+                          fDecode(false), fDecoded(false), fOK(false), pwtx(NULL), fUpgraded(false), pkey(NULL) {}
+    ~CWalletLoadRecord()
+    {
+        delete pwtx;
+        delete pkey;
+    }
+};
+
+class CWalletLoadQueue
+{
+public:
+    boost::mutex mutex;
+    boost::condition_variable condDecode; // a record to decode, or the end
+    boost::condition_variable condApply;  // a record was decoded
+    std::deque<CWalletLoadRecord*> dequeDecode;
+    bool fEnd;
+
+    CWalletLoadQueue() : fEnd(false) {}
+};
+
+// Bound on the records read ahead of the one being applied
+static const unsigned int WALLET_LOAD_WINDOW = 4096;
+
+static void ThreadWalletLoadDecode(CWalletLoadQueue* pqueue)
+{
+    loop
+    {
+        CWalletLoadRecord* precord;
+        {
+            boost::unique_lock<boost::mutex> lock(pqueue->mutex);
+            while (!pqueue->fEnd && pqueue->dequeDecode.empty())
+                pqueue->condDecode.wait(lock);
+            if (pqueue->dequeDecode.empty())
+                return;
+            precord = pqueue->dequeDecode.front();
+            pqueue->dequeDecode.pop_front();
+        }
+
+        try {
+            string strType;
+            precord->ssKey >> strType;
+            if (strType == "tx")
+            {
+                precord->pwtx = new CWalletTx();
+                precord->fOK = DecodeWalletTx(precord->ssKey, precord->ssValue, precord->hash, *precord->pwtx,
+                                              precord->fUpgraded, precord->strErr);
+            }
+            else
+            {
+                precord->pkey = new CKey();
+                precord->fOK = DecodeWalletKey(strType, precord->ssKey, precord->ssValue, *precord->pkey, precord->strErr);
+            }
+        }
+        catch (...) {
+            precord->fOK = false;
+        }
+
+        boost::unique_lock<boost::mutex> lock(pqueue->mutex);
+        precord->fDecoded = true;
+        pqueue->condApply.notify_one();
+    }
+}
+
+// Supporting transactions only serve to relay a transaction the chain does
+// not hold yet, see CWalletTx::AddSupportingTransactions()
+static unsigned int PruneSupportingTransactions(CWalletTx& wtx)
+{
+    unsigned int nPruned = wtx.vtxPrev.size();
+    if (nPruned == 0 || wtx.GetDepthInMainChain() < COPY_DEPTH)
+        return 0;
+    vector<CMerkleTx>().swap(wtx.vtxPrev);
+    return nPruned;
+}
+
+// Whether the oldest record read can be applied
+static bool IsDecoded(CWalletLoadQueue& queue, const std::deque<CWalletLoadRecord*>& dequeApply)
+{
+    if (dequeApply.empty())
+        return false;
+    boost::unique_lock<boost::mutex> lock(queue.mutex);
+    return !dequeApply.front()->fDecode || dequeApply.front()->fDecoded;
+}
+
 DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
 {
     pwallet->vchDefaultKey = CPubKey();
@@ -396,42 +519,108 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
     bool fNoncriticalErrors = false;
     DBErrors result = DB_LOAD_OK;
 
+    int64 nStart = GetTimeMillis();
+    int nThreads = boost::thread::hardware_concurrency() - 1;
+    nThreads = std::max(1, std::min(nThreads, MAX_SCRIPTCHECK_THREADS));
+    unsigned int nRecords = 0;
+    unsigned int nTx = 0;
+    unsigned int nPruned = 0;
+
+    // Records are read in cursor order and applied in the same order, while
+    // the loading threads decode transactions and keys in between
+    CWalletLoadQueue queue;
+    std::deque<CWalletLoadRecord*> dequeApply;
+    boost::thread_group threadGroup;
+    for (int i = 0; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&ThreadWalletLoadDecode, &queue));
+
     try {
         LOCK(pwallet->cs_wallet);
         int nMinVersion = 0;
         if (Read((string)"minversion", nMinVersion))
         {
             if (nMinVersion > CLIENT_VERSION)
-                return DB_TOO_NEW;
-            pwallet->LoadMinVersion(nMinVersion);
+                result = DB_TOO_NEW;
+            else
+                pwallet->LoadMinVersion(nMinVersion);
         }
 
         // Get cursor
-        Dbc* pcursor = GetCursor();
-        if (!pcursor)
+        Dbc* pcursor = (result == DB_LOAD_OK ? GetCursor() : NULL);
+        if (!pcursor && result == DB_LOAD_OK)
         {
             printf("Error getting wallet database cursor\n");
-            return DB_CORRUPT;
+            result = DB_CORRUPT;
         }
 
+        bool fEnd = (pcursor == NULL);
         loop
         {
-            // Read next record
-            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-            int ret = ReadAtCursor(pcursor, ssKey, ssValue);
-            if (ret == DB_NOTFOUND)
+            // Read ahead until the oldest record can be applied or the window is full
+            if (!fEnd && dequeApply.size() < WALLET_LOAD_WINDOW && !IsDecoded(queue, dequeApply))
+            {
+                // Read next record
+                CWalletLoadRecord* precord = new CWalletLoadRecord();
+                int ret = ReadAtCursor(pcursor, precord->ssKey, precord->ssValue);
+                if (ret != 0)
+                {
+                    delete precord;
+                    if (ret != DB_NOTFOUND)
+                    {
+                        printf("Error reading next record from wallet database\n");
+                        result = DB_CORRUPT;
+                    }
+                    fEnd = true;
+                    continue;
+                }
+
+                try {
+                    CDataStream(precord->ssKey) >> precord->strType;
+                }
+                catch (...) {
+                }
+                precord->fDecode = (precord->strType == "tx" || precord->strType == "key" || precord->strType == "wkey");
+                dequeApply.push_back(precord);
+                if (precord->fDecode)
+                {
+                    boost::unique_lock<boost::mutex> lock(queue.mutex);
+                    queue.dequeDecode.push_back(precord);
+                    queue.condDecode.notify_one();
+                }
+                continue;
+            }
+            if (dequeApply.empty())
                 break;
-            else if (ret != 0)
+
+            CWalletLoadRecord* precord = dequeApply.front();
             {
-                printf("Error reading next record from wallet database\n");
-                return DB_CORRUPT;
+                boost::unique_lock<boost::mutex> lock(queue.mutex);
+                while (precord->fDecode && !precord->fDecoded)
+                    queue.condApply.wait(lock);
             }
+            dequeApply.pop_front();
+            nRecords++;
 
             // Try to be tolerant of single corrupt records:
-            string strType, strErr;
-            if (!ReadKeyValue(pwallet, ssKey, ssValue, nFileVersion,
-                              vWalletUpgrade, fIsEncrypted, fAnyUnordered, strType, strErr))
+            string strType = precord->strType, strErr = precord->strErr;
+            bool fOK = precord->fOK;
+            if (!precord->fDecode)
+                fOK = ReadKeyValue(pwallet, precord->ssKey, precord->ssValue, nFileVersion,
+                                   vWalletUpgrade, fIsEncrypted, fAnyUnordered, strType, strErr);
+            else if (fOK && strType == "tx")
+            {
+                nPruned += PruneSupportingTransactions(*precord->pwtx);
+                LoadWalletTx(pwallet, precord->hash, *precord->pwtx, precord->fUpgraded, vWalletUpgrade, fAnyUnordered);
+                nTx++;
+            }
+            else if (fOK && !pwallet->LoadKey(*precord->pkey))
+            {
+                strErr = "Error reading wallet database: LoadKey failed";
+                fOK = false;
+            }
+            delete precord;
+
+            if (!fOK)
             {
                 // losing keys is considered a catastrophic error, anything else
                 // we assume the user can live with:
@@ -449,13 +638,27 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
             if (!strErr.empty())
                 printf("%s\n", strErr.c_str());
         }
-        pcursor->close();
+        if (pcursor)
+            pcursor->close();
     }
     catch (...)
     {
         result = DB_CORRUPT;
     }
 
+    {
+        boost::unique_lock<boost::mutex> lock(queue.mutex);
+        queue.fEnd = true;
+        queue.dequeDecode.clear();
+        queue.condDecode.notify_all();
+    }
+    threadGroup.join_all();
+    BOOST_FOREACH(CWalletLoadRecord* precord, dequeApply)
+        delete precord;
+
+    printf("Loaded %u wallet records, %u transactions, with %d decoding threads in %"PRI64d"ms; dropped %u supporting transactions\n",
+           nRecords, nTx, nThreads, GetTimeMillis() - nStart, nPruned);
+
     if (fNoncriticalErrors && result == DB_LOAD_OK)
         result = DB_NONCRITICAL_ERROR;
 
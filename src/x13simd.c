@@ -0,0 +1,498 @@
+/*
+ * Runtime-dispatched SIMD backends for the fixed-size stages of the X13
+ * chain.  See x13simd.h.
+ *
+ * Groestl-512 and ECHO-512 are both built from the AES round function, which
+ * makes them a natural fit for AES-NI:
+ *
+ *  - ECHO-512 applies two full AES rounds to each of its sixteen 128-bit
+ *    words per round, which maps one-to-one onto AESENC.
+ *
+ *  - Groestl-512 uses the AES S-box but its own ShiftBytes/MixBytes.  The
+ *    1024-bit state is held as eight 128-bit rows; SubBytes and ShiftBytes
+ *    are done together with one PSHUFB (which also undoes the AES ShiftRows
+ *    step) followed by AESENCLAST with a zero key, and MixBytes becomes a
+ *    short series of byte-wise GF(2^8) doublings and XORs across rows.
+ *
+ * Only the one-block case used by Hash9() (a 64-byte message) is handled;
+ * the padding is therefore constant and folded into the input block.
+ *
+ * For Hash9xN() there are also multi-buffer kernels that hash up to eight
+ * independent messages at once, one message per 32-bit lane of an AVX2
+ * register.  CubeHash is the most expensive stage of the chain and consists
+ * only of 32-bit additions, rotations, XORs and word swaps, so it is written
+ * with GCC vector types and compiled for AVX2.
+ */
+
+#include <string.h>
+
+#include "x13simd.h"
+#include "sph_groestl.h"
+#include "sph_cubehash.h"
+#include "sph_echo.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9) || defined(__clang__))
+#define X13_HAVE_AESNI 1
+#include <cpuid.h>
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#include <wmmintrin.h>
+#define X13_TARGET_AESNI __attribute__((target("sse2,ssse3,aes")))
+#define X13_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define X13_HAVE_AESNI 0
+#endif
+
+static volatile int x13_backend = -1;
+
+/* ------------------------------------------------------------------------ */
+/* Portable reference implementations                                       */
+
+void x13_groestl512_64_sph(const void *in, void *out)
+{
+    sph_groestl512_context ctx;
+
+    sph_groestl512_init(&ctx);
+    sph_groestl512(&ctx, in, 64);
+    sph_groestl512_close(&ctx, out);
+}
+
+void x13_echo512_64_sph(const void *in, void *out)
+{
+    sph_echo512_context ctx;
+
+    sph_echo512_init(&ctx);
+    sph_echo512(&ctx, in, 64);
+    sph_echo512_close(&ctx, out);
+}
+
+void x13_cubehash512_64_n_sph(const void *in, void *out, unsigned int n)
+{
+    sph_cubehash512_context ctx;
+    unsigned int i;
+
+    for (i = 0; i < n; i ++) {
+        sph_cubehash512_init(&ctx);
+        sph_cubehash512(&ctx, (const unsigned char *)in + 64 * i, 64);
+        sph_cubehash512_close(&ctx, (unsigned char *)out + 64 * i);
+    }
+}
+
+#if X13_HAVE_AESNI
+
+/* ------------------------------------------------------------------------ */
+/* Groestl-512, one padded 128-byte block                                   */
+
+/*
+ * PSHUFB mask that rotates a row left by 0 bytes and pre-applies the inverse
+ * of the AES ShiftRows permutation, so that AESENCLAST(x, 0) yields plain
+ * SubBytes of the rotated row.  Rotating by s bytes is the same mask plus s
+ * (PSHUFB only looks at the low four bits of each index).
+ */
+static const unsigned char groestl_sr_mask[16] __attribute__((aligned(16))) = {
+    0, 13, 10, 7, 4, 1, 14, 11, 8, 5, 2, 15, 12, 9, 6, 3
+};
+
+/* ShiftBytes amounts for P1024 and Q1024, per row */
+static const unsigned char groestl_shift_p[8] = { 0, 1, 2, 3, 4, 5, 6, 11 };
+static const unsigned char groestl_shift_q[8] = { 1, 3, 5, 11, 0, 2, 4, 6 };
+
+X13_TARGET_AESNI static inline __m128i
+x13_mul2(__m128i a)
+{
+    /* byte-wise multiplication by x modulo x^8+x^4+x^3+x+1 */
+    __m128i hi = _mm_cmplt_epi8(a, _mm_setzero_si128());
+    return _mm_xor_si128(_mm_add_epi8(a, a),
+        _mm_and_si128(hi, _mm_set1_epi8(0x1b)));
+}
+
+X13_TARGET_AESNI static inline void
+groestl_mix_bytes(__m128i x[8])
+{
+    /*
+     * With circulant coefficients (2,2,3,4,5,3,5,7), output row i is
+     *   X ^ 2 * (Y ^ 2 * Z)
+     * where, with offsets taken relative to i,
+     *   X = a2 ^ a4 ^ a5 ^ a6 ^ a7,  Y = a0 ^ a1 ^ a2 ^ a5 ^ a7,
+     *   Z = a3 ^ a4 ^ a6 ^ a7.
+     * Sharing s_i = a_i ^ a_i+1 between rows keeps this to a few XORs.
+     */
+    __m128i a[8], s[8];
+    int i;
+
+    for (i = 0; i < 8; i ++)
+        a[i] = x[i];
+    for (i = 0; i < 8; i ++)
+        s[i] = _mm_xor_si128(a[i], a[(i + 1) & 7]);
+
+    for (i = 0; i < 8; i ++) {
+        __m128i X, Y, Z;
+
+        X = _mm_xor_si128(a[(i + 2) & 7], _mm_xor_si128(s[(i + 4) & 7], s[(i + 6) & 7]));
+        Y = _mm_xor_si128(_mm_xor_si128(s[i], a[(i + 2) & 7]),
+            _mm_xor_si128(a[(i + 5) & 7], a[(i + 7) & 7]));
+        Z = _mm_xor_si128(s[(i + 3) & 7], s[(i + 6) & 7]);
+        x[i] = _mm_xor_si128(X, x13_mul2(_mm_xor_si128(Y, x13_mul2(Z))));
+    }
+}
+
+X13_TARGET_AESNI static inline void
+groestl_perm(__m128i x[8], int q)
+{
+    const unsigned char *shift = q ? groestl_shift_q : groestl_shift_p;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi8((char)0xff);
+    const __m128i cols = _mm_set_epi8((char)0xf0, (char)0xe0, (char)0xd0,
+        (char)0xc0, (char)0xb0, (char)0xa0, (char)0x90, (char)0x80,
+        0x70, 0x60, 0x50, 0x40, 0x30, 0x20, 0x10, 0x00);
+    const __m128i sr = _mm_load_si128((const __m128i *)groestl_sr_mask);
+    __m128i mask[8];
+    int i, r;
+
+    for (i = 0; i < 8; i ++)
+        mask[i] = _mm_add_epi8(sr, _mm_set1_epi8((char)shift[i]));
+
+    for (r = 0; r < 14; r ++) {
+        __m128i rc = _mm_xor_si128(cols, _mm_set1_epi8((char)r));
+
+        /* AddRoundConstant */
+        if (q) {
+            for (i = 0; i < 7; i ++)
+                x[i] = _mm_xor_si128(x[i], ones);
+            x[7] = _mm_xor_si128(x[7], _mm_xor_si128(rc, ones));
+        } else {
+            x[0] = _mm_xor_si128(x[0], rc);
+        }
+
+        /* ShiftBytes + SubBytes */
+        for (i = 0; i < 8; i ++)
+            x[i] = _mm_aesenclast_si128(_mm_shuffle_epi8(x[i], mask[i]), zero);
+
+        groestl_mix_bytes(x);
+    }
+}
+
+void X13_TARGET_AESNI
+x13_groestl512_64_aesni(const void *in, void *out)
+{
+    unsigned char block[128], rows[8][16] __attribute__((aligned(16)));
+    __m128i h[8], m[8], p[8];
+    int i, j;
+
+    /* message, padding bit and a block count of one (big-endian) */
+    memcpy(block, in, 64);
+    memset(block + 64, 0, 64);
+    block[64] = 0x80;
+    block[127] = 1;
+
+    /* column-major bytes -> one vector per row */
+    for (i = 0; i < 8; i ++)
+        for (j = 0; j < 16; j ++)
+            rows[i][j] = block[8 * j + i];
+    for (i = 0; i < 8; i ++)
+        m[i] = _mm_load_si128((const __m128i *)rows[i]);
+
+    /* IV: the output size in bits, big-endian, in the last two bytes */
+    for (i = 0; i < 8; i ++)
+        h[i] = _mm_setzero_si128();
+    h[6] = _mm_insert_epi16(h[6], 0x0200, 7);
+
+    /* h' = P(h ^ m) ^ Q(m) ^ h */
+    for (i = 0; i < 8; i ++)
+        p[i] = _mm_xor_si128(h[i], m[i]);
+    groestl_perm(p, 0);
+    groestl_perm(m, 1);
+    for (i = 0; i < 8; i ++)
+        h[i] = _mm_xor_si128(h[i], _mm_xor_si128(p[i], m[i]));
+
+    /* output transform: trunc512(P(h') ^ h') */
+    for (i = 0; i < 8; i ++)
+        p[i] = h[i];
+    groestl_perm(p, 0);
+    for (i = 0; i < 8; i ++)
+        _mm_store_si128((__m128i *)rows[i], _mm_xor_si128(h[i], p[i]));
+
+    for (j = 8; j < 16; j ++)
+        for (i = 0; i < 8; i ++)
+            ((unsigned char *)out)[8 * (j - 8) + i] = rows[i][j];
+}
+
+/* ------------------------------------------------------------------------ */
+/* ECHO-512, one padded 128-byte block                                      */
+
+X13_TARGET_AESNI static inline void
+echo_mix_column(__m128i *w, int ia, int ib, int ic, int id)
+{
+    __m128i a = w[ia], b = w[ib], c = w[ic], d = w[id];
+    __m128i ab = _mm_xor_si128(a, b);
+    __m128i bc = _mm_xor_si128(b, c);
+    __m128i cd = _mm_xor_si128(c, d);
+    __m128i abx = x13_mul2(ab);
+    __m128i bcx = x13_mul2(bc);
+    __m128i cdx = x13_mul2(cd);
+
+    w[ia] = _mm_xor_si128(abx, _mm_xor_si128(bc, d));
+    w[ib] = _mm_xor_si128(bcx, _mm_xor_si128(a, cd));
+    w[ic] = _mm_xor_si128(cdx, _mm_xor_si128(ab, d));
+    w[id] = _mm_xor_si128(_mm_xor_si128(abx, bcx),
+        _mm_xor_si128(cdx, _mm_xor_si128(ab, c)));
+}
+
+void X13_TARGET_AESNI
+x13_echo512_64_aesni(const void *in, void *out)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set_epi32(0, 0, 0, 1);
+    /* chaining value IV and message bit count are both 512 */
+    const __m128i v512 = _mm_set_epi32(0, 0, 0, 512);
+    __m128i w[16], m[4], k, t;
+    int i, r;
+
+    for (i = 0; i < 4; i ++)
+        m[i] = _mm_loadu_si128((const __m128i *)in + i);
+    for (i = 0; i < 8; i ++)
+        w[i] = v512;
+    for (i = 0; i < 4; i ++)
+        w[8 + i] = m[i];
+    w[12] = _mm_set_epi32(0, 0, 0, 0x80);
+    w[13] = zero;
+    w[14] = _mm_set_epi32(0x02000000, 0, 0, 0);   /* output size, 16-bit LE */
+    w[15] = v512;                                 /* counter, 128-bit LE */
+
+    k = v512;
+    for (r = 0; r < 10; r ++) {
+        /* BigSubWords */
+        for (i = 0; i < 16; i ++) {
+            w[i] = _mm_aesenc_si128(_mm_aesenc_si128(w[i], k), zero);
+            k = _mm_add_epi32(k, one);
+        }
+
+        /* BigShiftRows */
+        t = w[1]; w[1] = w[5]; w[5] = w[9]; w[9] = w[13]; w[13] = t;
+        t = w[2]; w[2] = w[10]; w[10] = t;
+        t = w[6]; w[6] = w[14]; w[14] = t;
+        t = w[15]; w[15] = w[11]; w[11] = w[7]; w[7] = w[3]; w[3] = t;
+
+        /* BigMixColumns */
+        echo_mix_column(w, 0, 1, 2, 3);
+        echo_mix_column(w, 4, 5, 6, 7);
+        echo_mix_column(w, 8, 9, 10, 11);
+        echo_mix_column(w, 12, 13, 14, 15);
+    }
+
+    for (i = 0; i < 4; i ++) {
+        t = _mm_xor_si128(_mm_xor_si128(v512, m[i]),
+            _mm_xor_si128(w[i], w[i + 8]));
+        _mm_storeu_si128((__m128i *)out + i, t);
+    }
+}
+
+/* ------------------------------------------------------------------------ */
+/* CubeHash-512, up to eight 64-byte messages, one per 32-bit lane          */
+
+typedef sph_u32 x13_v8u32 __attribute__((vector_size(32)));
+
+static const sph_u32 cubehash_iv512[32] = {
+    0x2AEA2A61, 0x50F494D4, 0x2D538B8B, 0x4167D83E,
+    0x3FEE2313, 0xC701CF8C, 0xCC39968E, 0x50AC5695,
+    0x4D42C787, 0xA647A8B3, 0x97CF0BEF, 0x825B4537,
+    0xEEF864D2, 0xF22090C4, 0xD0E5CD33, 0xA23911AE,
+    0xFCD398D9, 0x148FE485, 0x1B017BEF, 0xB6444532,
+    0x6A536159, 0x2FF5781C, 0x91FA7934, 0x0DBADEA9,
+    0xD65C8A2B, 0xA5A70E75, 0xB1C62456, 0xBC796576,
+    0x1921C8F7, 0xE7989AF1, 0x7795D246, 0xD43E3B44
+};
+
+#define CH_ROTL(v, n)   (((v) << (n)) | ((v) >> (32 - (n))))
+#define CH_SWAP(a, b)   do { x13_v8u32 t_ = x[a]; x[a] = x[b]; x[b] = t_; } while (0)
+#define CH_FOR16(OP)    OP(0) OP(1) OP(2) OP(3) OP(4) OP(5) OP(6) OP(7) \
+                        OP(8) OP(9) OP(10) OP(11) OP(12) OP(13) OP(14) OP(15)
+#define CH_ADD(i)       x[(i) + 16] += x[i];
+#define CH_XOR(i)       x[i] ^= x[(i) + 16];
+#define CH_ROT7(i)      x[i] = CH_ROTL(x[i], 7);
+#define CH_ROT11(i)     x[i] = CH_ROTL(x[i], 11);
+
+/* CubeHash round, spelled out so the state stays in registers */
+#define CH_ROUND   do { \
+        CH_FOR16(CH_ADD) \
+        CH_FOR16(CH_ROT7) \
+        CH_SWAP(0, 8);   CH_SWAP(1, 9);   CH_SWAP(2, 10);  CH_SWAP(3, 11); \
+        CH_SWAP(4, 12);  CH_SWAP(5, 13);  CH_SWAP(6, 14);  CH_SWAP(7, 15); \
+        CH_FOR16(CH_XOR) \
+        CH_SWAP(16, 18); CH_SWAP(17, 19); CH_SWAP(20, 22); CH_SWAP(21, 23); \
+        CH_SWAP(24, 26); CH_SWAP(25, 27); CH_SWAP(28, 30); CH_SWAP(29, 31); \
+        CH_FOR16(CH_ADD) \
+        CH_FOR16(CH_ROT11) \
+        CH_SWAP(0, 4);   CH_SWAP(1, 5);   CH_SWAP(2, 6);   CH_SWAP(3, 7); \
+        CH_SWAP(8, 12);  CH_SWAP(9, 13);  CH_SWAP(10, 14); CH_SWAP(11, 15); \
+        CH_FOR16(CH_XOR) \
+        CH_SWAP(16, 17); CH_SWAP(18, 19); CH_SWAP(20, 21); CH_SWAP(22, 23); \
+        CH_SWAP(24, 25); CH_SWAP(26, 27); CH_SWAP(28, 29); CH_SWAP(30, 31); \
+    } while (0)
+
+void X13_TARGET_AVX2
+x13_cubehash512_64_n_avx2(const void *in, void *out, unsigned int n)
+{
+    const unsigned char *pin = (const unsigned char *)in;
+    unsigned char *pout = (unsigned char *)out;
+    union {
+        x13_v8u32 v;
+        sph_u32 w[8];
+    } t;
+    x13_v8u32 x[32];
+    unsigned int i, l, b, r;
+
+    if (n > 8) {
+        x13_cubehash512_64_n_avx2(pin + 512, pout + 512, n - 8);
+        n = 8;
+    }
+
+    for (i = 0; i < 32; i ++) {
+        for (l = 0; l < 8; l ++)
+            t.w[l] = cubehash_iv512[i];
+        x[i] = t.v;
+    }
+
+    /* two 32-byte message blocks, then the padding block (0x80) */
+    for (b = 0; b < 3; b ++) {
+        for (i = 0; i < 8; i ++) {
+            for (l = 0; l < 8; l ++)
+                t.w[l] = (b < 2 && l < n) ? sph_dec32le(pin + 64 * l + 32 * b + 4 * i)
+                    : (b == 2 && i == 0) ? 0x80 : 0;
+            x[i] ^= t.v;
+        }
+        for (r = 0; r < 16; r ++)
+            CH_ROUND;
+    }
+
+    /* finalization: flip the last state bit, then 10 x 16 rounds */
+    for (l = 0; l < 8; l ++)
+        t.w[l] = 1;
+    x[31] ^= t.v;
+    for (r = 0; r < 160; r ++)
+        CH_ROUND;
+
+    for (i = 0; i < 16; i ++) {
+        t.v = x[i];
+        for (l = 0; l < n; l ++)
+            sph_enc32le(pout + 64 * l + 4 * i, t.w[l]);
+    }
+}
+
+static int
+x13_cpu_has_avx2(void)
+{
+    unsigned int eax, ebx, ecx, edx, xcr0;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return 0;
+    if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX))
+        return 0;
+    /* the OS must save the YMM state on context switches */
+    __asm__ __volatile__ ("xgetbv" : "=a" (xcr0), "=d" (edx) : "c" (0));
+    if ((xcr0 & 6) != 6)
+        return 0;
+    if (__get_cpuid_max(0, 0) < 7)
+        return 0;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & bit_AVX2) != 0;
+}
+
+#else /* !X13_HAVE_AESNI */
+
+void x13_groestl512_64_aesni(const void *in, void *out)
+{
+    x13_groestl512_64_sph(in, out);
+}
+
+void x13_echo512_64_aesni(const void *in, void *out)
+{
+    x13_echo512_64_sph(in, out);
+}
+
+void x13_cubehash512_64_n_avx2(const void *in, void *out, unsigned int n)
+{
+    x13_cubehash512_64_n_sph(in, out, n);
+}
+
+#endif
+
+/* ------------------------------------------------------------------------ */
+/* Dispatch                                                                 */
+
+int x13_backend_supported(int backend)
+{
+    switch (backend) {
+    case X13_BACKEND_SPH:
+        return 1;
+#if X13_HAVE_AESNI
+    case X13_BACKEND_AESNI: {
+        unsigned int eax, ebx, ecx, edx;
+        if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+            return 0;
+        return (ecx & bit_SSSE3) && (ecx & bit_AES);
+    }
+    case X13_BACKEND_AVX2:
+        return x13_backend_supported(X13_BACKEND_AESNI) && x13_cpu_has_avx2();
+#endif
+    default:
+        return 0;
+    }
+}
+
+const char *x13_backend_name(int backend)
+{
+    switch (backend) {
+    case X13_BACKEND_SPH:   return "sph";
+    case X13_BACKEND_AESNI: return "aesni";
+    case X13_BACKEND_AVX2:  return "avx2";
+    default:                return "unknown";
+    }
+}
+
+int x13_select_backend(int backend)
+{
+    if (backend < 0 || backend >= X13_BACKEND_COUNT || !x13_backend_supported(backend))
+        return 0;
+    x13_backend = backend;
+    return 1;
+}
+
+int x13_get_backend(void)
+{
+    int backend = x13_backend;
+
+    if (backend < 0) {
+        /* pick the best supported backend; racing callers agree on it */
+        for (backend = X13_BACKEND_COUNT - 1; backend > X13_BACKEND_SPH; backend --)
+            if (x13_backend_supported(backend))
+                break;
+        x13_backend = backend;
+    }
+    return backend;
+}
+
+void x13_groestl512_64(const void *in, void *out)
+{
+    if (x13_get_backend() >= X13_BACKEND_AESNI)
+        x13_groestl512_64_aesni(in, out);
+    else
+        x13_groestl512_64_sph(in, out);
+}
+
+void x13_echo512_64(const void *in, void *out)
+{
+    if (x13_get_backend() >= X13_BACKEND_AESNI)
+        x13_echo512_64_aesni(in, out);
+    else
+        x13_echo512_64_sph(in, out);
+}
+
+void x13_cubehash512_64_n(const void *in, void *out, unsigned int n)
+{
+    if (x13_get_backend() >= X13_BACKEND_AVX2)
+        x13_cubehash512_64_n_avx2(in, out, n);
+    else
+        x13_cubehash512_64_n_sph(in, out, n);
+}
@@ -0,0 +1,68 @@
+/*
+ * Runtime-dispatched SIMD backends for the fixed-size stages of the X13
+ * chain used by Hash9().
+ *
+ * Every stage of Hash9() after blake512 hashes exactly one 64-byte digest,
+ * so the backends here implement "64 bytes in, 64 bytes out" entry points
+ * instead of the full streaming sph_* API.  The portable sph_* code remains
+ * the reference implementation and the fallback on CPUs (or compilers)
+ * without the required instruction set extensions.
+ */
+
+#ifndef X13SIMD_H
+#define X13SIMD_H
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/** Available implementations of the SIMD accelerated X13 stages. */
+enum
+{
+    X13_BACKEND_SPH = 0,    /* portable sph_* scalar code */
+    X13_BACKEND_AESNI = 1,  /* SSSE3 + AES-NI (groestl512, echo512) */
+    X13_BACKEND_AVX2 = 2,   /* AES-NI + AVX2 multi-buffer kernels (cubehash512) */
+    X13_BACKEND_COUNT
+};
+
+/** Return non-zero if the running CPU supports the given backend. */
+int x13_backend_supported(int backend);
+
+/** Name of a backend, for logging. */
+const char *x13_backend_name(int backend);
+
+/**
+ * Select the backend used by the dispatching entry points below.  The best
+ * supported backend is chosen automatically on first use; this only needs
+ * to be called to force a particular one.  Returns 0 if the backend is not
+ * supported by this CPU/build, in which case the selection is unchanged.
+ */
+int x13_select_backend(int backend);
+
+/** Backend currently used by the dispatching entry points. */
+int x13_get_backend(void);
+
+/* Dispatching one-block entry points used by Hash9(). */
+void x13_groestl512_64(const void *in, void *out);
+void x13_echo512_64(const void *in, void *out);
+
+/**
+ * Dispatching multi-buffer entry point used by Hash9xN(): hashes n
+ * independent 64-byte messages stored back to back in in[], writing n
+ * 64-byte digests to out[].
+ */
+void x13_cubehash512_64_n(const void *in, void *out, unsigned int n);
+
+/* Explicit implementations, exposed for known-answer testing. */
+void x13_groestl512_64_sph(const void *in, void *out);
+void x13_echo512_64_sph(const void *in, void *out);
+void x13_groestl512_64_aesni(const void *in, void *out);
+void x13_echo512_64_aesni(const void *in, void *out);
+void x13_cubehash512_64_n_sph(const void *in, void *out, unsigned int n);
+void x13_cubehash512_64_n_avx2(const void *in, void *out, unsigned int n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif